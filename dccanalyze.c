@@ -0,0 +1,391 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * dccanalyze.c - Decode a pulse trace back into DCC packets.
+ *
+ * dccanalyze [-h] [--gpio=N] [--vcd=FILE] [--summary] [TRACE]
+ *
+ * This tool reads a trace of the pulses that were generated, as written
+ * by the simulated backend (see PIDCC_SIM_TRACE in pidcc_sim.c), from the
+ * TRACE file or from standard input. Each line is one gpioPulse_t:
+ *
+ *    <start> <gpioOn> <gpioOff> <usDelay>
+ *
+ * with start in microseconds and the masks in hexadecimal.
+ *
+ * The signal on one GPIO (by default the first one turned on in the trace)
+ * is decoded as a DCC decoder would: half bits of 52 to 64 microseconds
+ * are "1", half bits of 90 to 10000 microseconds are "0", a packet starts
+ * after at least 10 "1" bits, each byte is preceded by a "0" bit and the
+ * packet ends with a "1" bit. For each packet, one line is printed:
+ *
+ *    <time> <duration> pre=<bits> <bytes> ok|bad gap=<us> [addr=<a>
+ *    repeat=<n> since=<us>]
+ *
+ * time is in seconds since the start of the trace, duration in
+ * microseconds from the first preamble bit to the end bit, gap is the time
+ * since the end of the previous packet, and since the time since the end
+ * of the previous packet to the same decoder. The repeat count is the
+ * number of identical packets sent in a row to that decoder. A packet sent
+ * less than 5 ms after the previous one to the same decoder is marked
+ * with "!5ms".
+ *
+ * A summary is printed at the end: number of packets, errors, the
+ * preamble lengths, the number of 5 ms violations, and the line occupancy
+ * (the portion of time spent transmitting packets, as opposed to filler
+ * "0" bits and separators).
+ *
+ * The --vcd option also writes the signal of each GPIO used in the first
+ * pulse to a VCD file, for use with a waveform viewer (GTKWave, ..).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pidcc_packet.h"
+
+#define DCCMAXBYTES 17 // 16 data bytes and the error detection byte.
+
+static int DccGpio = -1;
+static int DccSummaryOnly = 0;
+
+static long long DccOrigin = -1;
+
+// Decoder state.
+//
+static int DccHalf = -1;         // The pending half bit, or -1.
+static long long DccHalfStart;
+
+static int DccOnes = 0;          // Preamble "1" bits so far.
+static int DccEndBit = 0;        // The previous end bit, part of a preamble.
+static long long DccPreambleStart;
+static int DccInPacket = 0;
+static int DccBitCount;          // Bits in the current byte, -1: start bit.
+static unsigned char DccBytes[DCCMAXBYTES];
+static int DccByteCount;
+static int DccPreamble;
+static long long DccPacketStart;
+
+// Statistics.
+//
+static long DccPackets = 0;
+static long DccBadPackets = 0;
+static long DccFramingErrors = 0;
+static long DccViolations = 0;
+static int DccPreambleMin = 0;
+static int DccPreambleMax = 0;
+static long long DccBusyTime = 0;
+static long long DccLastEnd = -1;
+static long long DccFirstTime = -1;
+static long long DccLastTime = 0;
+
+// The previous packet to each decoder, for repeats and the 5 ms rule.
+//
+#define DCCMAXDECODERS 1024
+
+typedef struct {
+   int address;
+   int repeat;
+   long long end;
+   int length;
+   unsigned char data[DCCMAXBYTES];
+} DccDecoder;
+
+static DccDecoder DccDecoders[DCCMAXDECODERS];
+static int DccDecoderCount = 0;
+
+static DccDecoder *dccanalyze_decoder (int address) {
+
+   int i;
+   for (i = 0; i < DccDecoderCount; ++i) {
+      if (DccDecoders[i].address == address) return DccDecoders + i;
+   }
+   if (DccDecoderCount >= DCCMAXDECODERS) return 0;
+   DccDecoder *decoder = DccDecoders + DccDecoderCount++;
+   decoder->address = address;
+   decoder->repeat = 0;
+   decoder->end = -1;
+   decoder->length = 0;
+   return decoder;
+}
+
+static void dccanalyze_packet (long long end) {
+
+   int i;
+   unsigned char detect = 0;
+   for (i = 0; i < DccByteCount; ++i) detect ^= DccBytes[i];
+   int ok = (detect == 0) && (DccByteCount >= 3);
+
+   DccPackets += 1;
+   if (!ok) DccBadPackets += 1;
+   if ((DccPreambleMin == 0) || (DccPreamble < DccPreambleMin))
+      DccPreambleMin = DccPreamble;
+   if (DccPreamble > DccPreambleMax) DccPreambleMax = DccPreamble;
+   DccBusyTime += end - DccPacketStart;
+
+   char line[512];
+   int cursor = snprintf (line, sizeof(line), "%.6f %lld pre=%d",
+                          (DccPacketStart - DccOrigin) / 1000000.0,
+                          end - DccPacketStart, DccPreamble);
+   for (i = 0; i < DccByteCount; ++i) {
+      cursor += snprintf (line+cursor, sizeof(line)-cursor,
+                          " %02x", DccBytes[i]);
+   }
+   cursor += snprintf (line+cursor, sizeof(line)-cursor,
+                       " %s gap=%lld", ok ? "ok" : "bad",
+                       (DccLastEnd < 0) ? 0 : DccPacketStart - DccLastEnd);
+   DccLastEnd = end;
+
+   if (ok) {
+      int length = DccByteCount - 1; // Without the error detection byte.
+      int address = pidcc_packet_address (DccBytes, length);
+      DccDecoder *decoder = 0;
+      if ((address != PIDCC_NOADDRESS) && (address != PIDCC_BROADCAST))
+         decoder = dccanalyze_decoder (address);
+      if (decoder) {
+         if ((decoder->length == length) &&
+             (!memcmp (decoder->data, DccBytes, length))) {
+            decoder->repeat += 1;
+         } else {
+            decoder->repeat = 1;
+            decoder->length = length;
+            memcpy (decoder->data, DccBytes, length);
+         }
+         cursor += snprintf (line+cursor, sizeof(line)-cursor,
+                             " addr=%d repeat=%d", address, decoder->repeat);
+         if (decoder->end >= 0) {
+            long long since = DccPacketStart - decoder->end;
+            cursor += snprintf (line+cursor, sizeof(line)-cursor,
+                                " since=%lld%s", since,
+                                (since < 5000) ? " !5ms" : "");
+            if (since < 5000) DccViolations += 1;
+         }
+         decoder->end = end;
+      }
+   }
+   if (!DccSummaryOnly) puts (line);
+}
+
+static void dccanalyze_reset (void) {
+   DccHalf = -1;
+   DccOnes = 0;
+   DccEndBit = 0;
+   DccInPacket = 0;
+}
+
+static void dccanalyze_bit (int bit, long long start, long long end) {
+
+   if (!DccInPacket) {
+      if (bit) {
+         if (DccOnes == 0) DccPreambleStart = start;
+         DccOnes += 1;
+         return;
+      }
+      if (DccOnes + DccEndBit >= 10) {
+         DccInPacket = 1;
+         DccPreamble = DccOnes;
+         DccPacketStart = DccOnes ? DccPreambleStart : start;
+         DccByteCount = 0;
+         DccBitCount = 0;
+         DccBytes[0] = 0;
+      }
+      DccOnes = 0;
+      DccEndBit = 0;
+      return;
+   }
+
+   if (DccBitCount < 8) {
+      DccBytes[DccByteCount] = (DccBytes[DccByteCount] << 1) | bit;
+      DccBitCount += 1;
+      return;
+   }
+
+   // This is the bit that follows a byte: start bit or end bit.
+   DccByteCount += 1;
+   if (bit) {
+      dccanalyze_packet (end);
+      DccInPacket = 0;
+      DccOnes = 0;
+      DccEndBit = 1;
+      return;
+   }
+   if (DccByteCount >= DCCMAXBYTES) {
+      DccFramingErrors += 1;
+      dccanalyze_reset ();
+      return;
+   }
+   DccBitCount = 0;
+   DccBytes[DccByteCount] = 0;
+}
+
+static void dccanalyze_half (long long start, long long duration) {
+
+   int half;
+   if ((duration >= 52) && (duration <= 64)) half = 1;
+   else if ((duration >= 90) && (duration <= 10000)) half = 0;
+   else {
+      DccFramingErrors += 1;
+      dccanalyze_reset ();
+      return;
+   }
+   if ((DccHalf < 0) || (DccHalf != half)) {
+      // First half, or out of phase: resynchronize on this half.
+      DccHalf = half;
+      DccHalfStart = start;
+      return;
+   }
+   dccanalyze_bit (half, DccHalfStart, start + duration);
+   DccHalf = -1;
+}
+
+// VCD output.
+//
+static FILE *DccVcd = 0;
+static unsigned int DccVcdMask = 0;
+static unsigned int DccVcdLevels = 0;
+static int DccVcdStarted = 0;
+
+static void dccanalyze_vcdHeader (unsigned int mask) {
+
+   DccVcdMask = mask;
+   fprintf (DccVcd, "$timescale 1us $end\n$scope module pidcc $end\n");
+   int gpio;
+   for (gpio = 0; gpio < 32; ++gpio) {
+      if (mask & (1 << gpio))
+         fprintf (DccVcd, "$var wire 1 %c gpio%d $end\n", '!' + gpio, gpio);
+   }
+   fprintf (DccVcd, "$upscope $end\n$enddefinitions $end\n");
+}
+
+static void dccanalyze_vcd (long long t, unsigned int levels) {
+
+   unsigned int changed = (levels ^ DccVcdLevels) & DccVcdMask;
+   if (DccVcdStarted && !changed) return;
+   if (!DccVcdStarted) changed = DccVcdMask;
+   DccVcdStarted = 1;
+
+   fprintf (DccVcd, "#%lld\n", t - DccOrigin);
+   int gpio;
+   for (gpio = 0; gpio < 32; ++gpio) {
+      if (changed & (1 << gpio))
+         fprintf (DccVcd, "%d%c\n", (levels >> gpio) & 1, '!' + gpio);
+   }
+   DccVcdLevels = levels;
+}
+
+int main (int argc, const char **argv) {
+
+   const char *input = 0;
+   const char *vcd = 0;
+
+   int i;
+   for (i = 1; i < argc; ++i) {
+      if (!strncmp (argv[i], "--gpio=", 7)) {
+         DccGpio = atoi (argv[i] + 7);
+      } else if (!strncmp (argv[i], "--vcd=", 6)) {
+         vcd = argv[i] + 6;
+      } else if (!strcmp (argv[i], "--summary")) {
+         DccSummaryOnly = 1;
+      } else if (argv[i][0] == '-') {
+         printf ("%s [-h] [--gpio=N] [--vcd=FILE] [--summary] [TRACE]\n\n",
+                 argv[0]);
+         printf ("  Decode a pulse trace (see PIDCC_SIM_TRACE) into DCC packets.\n");
+         exit (strcmp (argv[i], "-h") ? 1 : 0);
+      } else {
+         input = argv[i];
+      }
+   }
+
+   FILE *trace = stdin;
+   if (input) {
+      trace = fopen (input, "r");
+      if (!trace) {
+         fprintf (stderr, "cannot open %s\n", input);
+         exit (1);
+      }
+   }
+   if (vcd) {
+      DccVcd = fopen (vcd, "w");
+      if (!DccVcd) {
+         fprintf (stderr, "cannot open %s\n", vcd);
+         exit (1);
+      }
+   }
+
+   char line[256];
+   unsigned int levels = 0;
+   int level = -1;
+   long long edge = -1; // Time of the last edge on the decoded GPIO.
+   long long end = -1;  // End of the previous pulse.
+
+   while (fgets (line, sizeof(line), trace)) {
+
+      long long start;
+      unsigned int on, off;
+      long long delay;
+      if (sscanf (line, "%lld %x %x %lld", &start, &on, &off, &delay) != 4)
+         continue;
+
+      if (DccOrigin < 0) {
+         DccOrigin = start;
+         if (DccGpio < 0) {
+            for (DccGpio = 0; DccGpio < 31; ++DccGpio) {
+               if (on & (1 << DccGpio)) break;
+            }
+         }
+         if (DccVcd) dccanalyze_vcdHeader (on | off);
+      }
+      if (DccFirstTime < 0) DccFirstTime = start;
+      DccLastTime = start + delay;
+
+      if ((end >= 0) && (start > end)) {
+         // The signal stopped for a while: start over.
+         dccanalyze_reset ();
+         edge = -1;
+      }
+      end = start + delay;
+
+      levels = (levels | on) & ~off;
+      if (DccVcd) dccanalyze_vcd (start, levels);
+
+      int newlevel = (levels >> DccGpio) & 1;
+      if (newlevel == level) continue;
+      if (edge >= 0) dccanalyze_half (edge, start - edge);
+      edge = start;
+      level = newlevel;
+   }
+   if (DccVcd) {
+      fprintf (DccVcd, "#%lld\n", DccLastTime - DccOrigin);
+      fclose (DccVcd);
+   }
+
+   long long total = DccLastTime - DccFirstTime;
+   printf ("%ld packets, %ld bad, %ld framing errors, preamble %d to %d bits, "
+           "%ld 5ms violations\n",
+           DccPackets, DccBadPackets, DccFramingErrors,
+           DccPreambleMin, DccPreambleMax, DccViolations);
+   if (total > 0) {
+      printf ("%.6f seconds, %.1f packets/s, line occupancy %.1f%%\n",
+              total / 1000000.0, DccPackets * 1000000.0 / total,
+              DccBusyTime * 100.0 / total);
+   }
+   return 0;
+}
@@ -0,0 +1,621 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * dccbench.c - Replay standard workloads against pidcc and measure it.
+ *
+ * dccbench [-h] [--pidcc=PATH] [--analyze=PATH] [--real] [--pin=A[:B]]
+ *          [--duration=SECONDS] [WORKLOAD ..]
+ *
+ * The workloads are:
+ *
+ *    flood     More speed packets than the track can carry, to as many
+ *              different decoders (saturates the transmitter).
+ *    throttle  20 locomotives, each driven by a throttle that changes the
+ *              speed every 100 to 400 ms, and sometimes the functions.
+ *    program   Service mode CV write sequences (resets, writes, recovery),
+ *              as sent by a programming track application.
+ *    burst     Bursts of 200 packets at once, more than a queue can hold.
+ *
+ * All workloads are run if none is named. Each workload is a script of
+ * pidcc commands, paced with sleep commands, that runs for the specified
+ * duration (default: 10 seconds), followed by one more second to let the
+ * queues drain. The scripts are deterministic.
+ *
+ * By default, the script is fed to the simulation build (./pidccsim) with
+ * the --virtual option: the benchmark runs faster than real time, and
+ * the trace of the generated signal is decoded by dccanalyze. With the
+ * --real option, the script is fed to the specified pidcc in real time
+ * instead (this requires the access rights of pidcc), and the metrics
+ * that need a trace of the signal are not available.
+ *
+ * For each workload, one JSON object is printed on a single line:
+ *
+ *    workload, backend   The workload name, "virtual" or "real".
+ *    duration            The duration of the workload, in seconds.
+ *    sent                The number of send commands.
+ *    accepted, full      The send commands queued, or rejected (queue full).
+ *    full_rate           The portion of the send commands rejected.
+ *    track_packets       The packets decoded from the signal during the
+ *                        workload (including idle packets and repeats).
+ *    track_pps           The same, per second.
+ *    data_pps            The packets other than idle packets, per second.
+ *    latency_us          The percentiles (p50, p90, p99, max) of the time
+ *                        from a send command being queued to the first
+ *                        bit of the preamble of the first matching packet.
+ *    unseen              The accepted packets never seen on the track
+ *                        (replaced by a more recent one, or never sent).
+ *                        These are not counted in latency_us.
+ *    cpu_us              The CPU time used by pidcc (user and system).
+ *    cpu_us_per_packet   The same, divided by the number of send commands
+ *                        accepted.
+ *
+ * A packet is matched by its content, to the first packet on the track
+ * after it was queued. A packet replaced by a more recent one to the same
+ * decoder and of the same class (see pidcc_packet_supersedes()) before
+ * that match is unseen: whatever matched was transmitted for the more
+ * recent one.
+ *
+ * In virtual mode, the CPU time includes the simulation of pigpio and the
+ * writing of the trace. The values that are not available are null.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "pidcc_packet.h"
+
+#define DCCMAXBYTES 17 // 16 data bytes and the error detection byte.
+
+#define DCCBENCHDRAIN 1 // Seconds added to the script to drain the queues.
+
+static const char *DccPidcc = "./pidccsim";
+static const char *DccAnalyze = "./dccanalyze";
+static int DccReal = 0;
+static int DccPinA = 17;
+static int DccPinB = 18;
+static int DccDuration = 10;
+
+// The script being generated, and the packets it sends.
+//
+typedef struct {
+   double queued;    // When pidcc queued it, or -1 if rejected.
+   int length;
+   unsigned char data[DCCMAXBYTES];
+} DccSent;
+
+static char *DccScript = 0;
+static size_t DccScriptLength = 0;
+static size_t DccScriptSize = 0;
+static double DccScriptTime = 0;
+
+static DccSent *DccSends = 0;
+static int DccSendCount = 0;
+static int DccSendSize = 0;
+
+// The packets decoded from the trace of the signal.
+//
+typedef struct {
+   double start;
+   int length;       // Including the error detection byte.
+   unsigned char data[DCCMAXBYTES];
+} DccSeen;
+
+static DccSeen *DccTrack = 0;
+static int DccTrackCount = 0;
+static int DccTrackSize = 0;
+
+static unsigned int DccRandom = 1;
+
+static int dccbench_random (int range) {
+   DccRandom = DccRandom * 1103515245 + 12345;
+   return (DccRandom >> 16) % range;
+}
+
+static void dccbench_printf (const char *format, ...) {
+
+   va_list args;
+   char line[256];
+
+   va_start (args, format);
+   int length = vsnprintf (line, sizeof(line), format, args);
+   va_end (args);
+
+   if (DccScriptLength + length + 1 > DccScriptSize) {
+      DccScriptSize = (DccScriptSize + length + 1) * 2;
+      DccScript = realloc (DccScript, DccScriptSize);
+   }
+   memcpy (DccScript + DccScriptLength, line, length + 1);
+   DccScriptLength += length;
+}
+
+static void dccbench_send (const char *option, int length, ...) {
+
+   if (DccSendCount >= DccSendSize) {
+      DccSendSize = DccSendSize ? DccSendSize * 2 : 1024;
+      DccSends = realloc (DccSends, DccSendSize * sizeof(DccSent));
+   }
+   DccSent *sent = DccSends + DccSendCount++;
+   sent->queued = -1;
+   sent->length = length;
+
+   va_list args;
+   int i;
+   va_start (args, length);
+   dccbench_printf ("send%s", option);
+   for (i = 0; i < length; ++i) {
+      sent->data[i] = (unsigned char) va_arg (args, int);
+      dccbench_printf (" 0x%02x", sent->data[i]);
+   }
+   va_end (args);
+   dccbench_printf ("\n");
+}
+
+static void dccbench_sleep (double seconds) {
+   dccbench_printf ("sleep %.3f\n", seconds);
+   DccScriptTime += seconds;
+}
+
+// A 128 speed steps packet, forward, never a stop or emergency stop.
+//
+static void dccbench_speed (int address, int speed) {
+   speed = 0x80 | (2 + (speed % 126));
+   if (address < 128)
+      dccbench_send ("", 3, address, 0x3f, speed);
+   else
+      dccbench_send ("", 4, 0xc0 | (address >> 8), address & 0xff, 0x3f, speed);
+}
+
+// The workloads. ------------------------------------------------------
+
+static void dccbench_flood (void) {
+
+   // 2000 packets per second, to 1000 decoders in turn: far more than
+   // the track can carry.
+   int address = 0;
+   int speed = 0;
+   while (DccScriptTime < DccDuration) {
+      int i;
+      for (i = 0; i < 20; ++i) {
+         dccbench_speed (1000 + address, speed++);
+         address = (address + 1) % 1000;
+      }
+      dccbench_sleep (0.01);
+   }
+}
+
+static void dccbench_throttle (void) {
+
+   double next[20];
+   int speed[20];
+   int i;
+   for (i = 0; i < 20; ++i) {
+      next[i] = dccbench_random (400) / 1000.0;
+      speed[i] = dccbench_random (126);
+   }
+   while (DccScriptTime < DccDuration) {
+      for (i = 0; i < 20; ++i) {
+         if (next[i] > DccScriptTime) continue;
+         int address = 3 + i;
+         if (dccbench_random (10) == 0) {
+            dccbench_send ("", 2, address, 0x80 | dccbench_random (32));
+         } else {
+            speed[i] += dccbench_random (5) - 2;
+            if (speed[i] < 0) speed[i] += 126;
+            dccbench_speed (address, speed[i]);
+         }
+         next[i] += (100 + dccbench_random (300)) / 1000.0;
+      }
+      dccbench_sleep (0.01);
+   }
+}
+
+static void dccbench_program (void) {
+
+   // Direct mode CV writes: 3 resets, 5 writes, 6 resets for recovery.
+   int cv = 0;
+   while (DccScriptTime < DccDuration) {
+      int i;
+      int value = dccbench_random (256);
+      for (i = 0; i < 3; ++i) dccbench_send (" -p", 2, 0, 0);
+      for (i = 0; i < 5; ++i)
+         dccbench_send (" -p", 3, 0x7c | (cv >> 8), cv & 0xff, value);
+      for (i = 0; i < 6; ++i) dccbench_send (" -p", 2, 0, 0);
+      cv = (cv + 1) % 1024;
+      dccbench_sleep (0.5);
+   }
+}
+
+static void dccbench_burst (void) {
+
+   int base = 0;
+   while (DccScriptTime < DccDuration) {
+      int i;
+      for (i = 0; i < 200; ++i) dccbench_speed (1000 + base + i, base + i);
+      base = (base + 200) % 8000;
+      dccbench_sleep (1.0);
+   }
+}
+
+typedef struct {
+   const char *name;
+   void (*generate) (void);
+} DccWorkload;
+
+static const DccWorkload DccWorkloads[] = {
+   {"flood", dccbench_flood},
+   {"throttle", dccbench_throttle},
+   {"program", dccbench_program},
+   {"burst", dccbench_burst},
+   {0, 0}
+};
+
+// Running pidcc. ------------------------------------------------------
+
+static int dccbench_run (const char *output, const char *trace,
+                         struct rusage *usage) {
+
+   int input[2];
+   if (pipe (input)) return 0;
+
+   pid_t pid = fork ();
+   if (pid < 0) return 0;
+
+   if (pid == 0) {
+      int fd = open (output, O_WRONLY|O_TRUNC);
+      if (fd < 0) exit (1);
+      dup2 (input[0], 0);
+      dup2 (fd, 1);
+      close (input[0]);
+      close (input[1]);
+      close (fd);
+      if (trace) setenv ("PIDCC_SIM_TRACE", trace, 1);
+      if (DccReal)
+         execl (DccPidcc, DccPidcc, (char *)0);
+      else
+         execl (DccPidcc, DccPidcc, "--virtual", (char *)0);
+      exit (1);
+   }
+   close (input[0]);
+
+   time_t start = time (0);
+   size_t cursor = 0;
+   while (cursor < DccScriptLength) {
+      ssize_t length = write (input[1], DccScript + cursor,
+                              DccScriptLength - cursor);
+      if (length <= 0) break;
+      cursor += length;
+   }
+   close (input[1]);
+
+   if (DccReal) {
+      // pidcc keeps running after the end of its input.
+      time_t end = start + (time_t)DccScriptTime + 1;
+      time_t now = time (0);
+      if (now < end) sleep (end - now);
+      kill (pid, SIGTERM);
+   }
+   int status;
+   if (wait4 (pid, &status, 0, usage) != pid) return 0;
+   return WIFEXITED(status) || DccReal;
+}
+
+// Analysis. -----------------------------------------------------------
+
+static void dccbench_outcomes (const char *output) {
+
+   FILE *status = fopen (output, "r");
+   if (!status) return;
+
+   char line[1024];
+   int next = 0;
+   while (fgets (line, sizeof(line), status)) {
+      char category;
+      double timestamp;
+      int cursor = 0;
+      if (sscanf (line, "%c %lf %n", &category, &timestamp, &cursor) < 2)
+         continue;
+      if (!cursor) continue;
+      const char *text = line + cursor;
+      if (!strncmp (text, "command queued", 14)) {
+         if (next < DccSendCount) DccSends[next++].queued = timestamp;
+      } else if (strstr (text, "queue full")) {
+         next += 1;
+      }
+   }
+   fclose (status);
+}
+
+static void dccbench_decode (const char *trace) {
+
+   // The times decoded are relative to the first pulse of the trace.
+   double origin = 0;
+   FILE *raw = fopen (trace, "r");
+   if (!raw) return;
+   long long start;
+   if (fscanf (raw, "%lld", &start) == 1) origin = start / 1000000.0;
+   fclose (raw);
+
+   char command[1024];
+   snprintf (command, sizeof(command), "%s %s", DccAnalyze, trace);
+   FILE *decoded = popen (command, "r");
+   if (!decoded) return;
+
+   char line[512];
+   while (fgets (line, sizeof(line), decoded)) {
+      double time;
+      long long duration;
+      int preamble;
+      int cursor = 0;
+      if (sscanf (line, "%lf %lld pre=%d%n",
+                  &time, &duration, &preamble, &cursor) < 3) continue;
+      if (!cursor) continue;
+
+      DccSeen packet;
+      packet.start = origin + time;
+      packet.length = 0;
+      char *token = strtok (line + cursor, " \n");
+      while (token && (strlen (token) == 2) && isxdigit (token[0])
+                   && isxdigit (token[1]) && (packet.length < DCCMAXBYTES)) {
+         packet.data[packet.length++] = strtol (token, 0, 16);
+         token = strtok (0, " \n");
+      }
+      if ((!token) || strcmp (token, "ok")) continue;
+
+      if (DccTrackCount >= DccTrackSize) {
+         DccTrackSize = DccTrackSize ? DccTrackSize * 2 : 1024;
+         DccTrack = realloc (DccTrack, DccTrackSize * sizeof(DccSeen));
+      }
+      DccTrack[DccTrackCount++] = packet;
+   }
+   pclose (decoded);
+}
+
+static int dccbench_compare (const void *a, const void *b) {
+   const DccSeen *x = (const DccSeen *)a;
+   const DccSeen *y = (const DccSeen *)b;
+   if (x->length != y->length) return x->length - y->length;
+   int order = memcmp (x->data, y->data, x->length);
+   if (order) return order;
+   if (x->start < y->start) return -1;
+   return (x->start > y->start);
+}
+
+// Return the first packet on the track that matches the one sent, at or
+// after the time it was queued. The track must be sorted.
+//
+static const DccSeen *dccbench_match (const DccSent *sent) {
+
+   DccSeen key;
+   int i;
+   unsigned char detect = 0;
+   key.length = sent->length + 1;
+   for (i = 0; i < sent->length; ++i) detect ^= (key.data[i] = sent->data[i]);
+   key.data[sent->length] = detect;
+   key.start = sent->queued;
+
+   int low = 0;
+   int high = DccTrackCount;
+   while (low < high) {
+      int middle = (low + high) / 2;
+      if (dccbench_compare (DccTrack + middle, &key) < 0)
+         low = middle + 1;
+      else
+         high = middle;
+   }
+   if (low >= DccTrackCount) return 0;
+   const DccSeen *found = DccTrack + low;
+   if (found->length != key.length) return 0;
+   if (memcmp (found->data, key.data, key.length)) return 0;
+   return found;
+}
+
+// Return 1 if a more recent send replaced this one before the packet
+// matched was transmitted.
+//
+static int dccbench_superseded (int index, const DccSeen *seen) {
+
+   const DccSent *sent = DccSends + index;
+   int i;
+   for (i = index + 1; i < DccSendCount; ++i) {
+      const DccSent *later = DccSends + i;
+      if (later->queued < 0) continue;
+      if (later->queued > seen->start) break;
+      if (pidcc_packet_supersedes (later->data, later->length,
+                                   sent->data, sent->length)) return 1;
+   }
+   return 0;
+}
+
+static int dccbench_order (const void *a, const void *b) {
+   long long x = *(const long long *)a;
+   long long y = *(const long long *)b;
+   return (x > y) - (x < y);
+}
+
+static void dccbench_report (const char *name, struct rusage *usage) {
+
+   int accepted = 0;
+   int i;
+   for (i = 0; i < DccSendCount; ++i) {
+      if (DccSends[i].queued >= 0) accepted += 1;
+   }
+   int full = DccSendCount - accepted;
+   long long cpu = (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000LL
+                   + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+
+   printf ("{\"workload\":\"%s\",\"backend\":\"%s\",\"duration\":%d,"
+           "\"sent\":%d,\"accepted\":%d,\"full\":%d,\"full_rate\":%.4f,",
+           name, DccReal ? "real" : "virtual", DccDuration,
+           DccSendCount, accepted, full,
+           DccSendCount ? (double)full / DccSendCount : 0.0);
+
+   if (DccReal) {
+      printf ("\"track_packets\":null,\"track_pps\":null,\"data_pps\":null,"
+              "\"latency_us\":null,\"unseen\":null,");
+   } else {
+      int packets = 0;
+      int data = 0;
+      for (i = 0; i < DccTrackCount; ++i) {
+         if (DccTrack[i].start >= DccDuration) continue;
+         packets += 1;
+         if (DccTrack[i].data[0] != 0xff) data += 1;
+      }
+      qsort (DccTrack, DccTrackCount, sizeof(DccSeen), dccbench_compare);
+
+      long long *latency = calloc (accepted + 1, sizeof(long long));
+      int count = 0;
+      int unseen = 0;
+      for (i = 0; i < DccSendCount; ++i) {
+         if (DccSends[i].queued < 0) continue;
+         const DccSeen *seen = dccbench_match (DccSends + i);
+         if ((!seen) || dccbench_superseded (i, seen)) {
+            unseen += 1;
+            continue;
+         }
+         latency[count++] =
+            (long long)((seen->start - DccSends[i].queued) * 1000000.0 + 0.5);
+      }
+      qsort (latency, count, sizeof(long long), dccbench_order);
+
+      printf ("\"track_packets\":%d,\"track_pps\":%.1f,\"data_pps\":%.1f,",
+              packets, (double)packets / DccDuration,
+              (double)data / DccDuration);
+      if (count > 0) {
+         printf ("\"latency_us\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,"
+                 "\"max\":%lld},",
+                 latency[count / 2], latency[(count * 9) / 10],
+                 latency[(count * 99) / 100], latency[count - 1]);
+      } else {
+         printf ("\"latency_us\":null,");
+      }
+      printf ("\"unseen\":%d,", unseen);
+      free (latency);
+   }
+   printf ("\"cpu_us\":%lld,\"cpu_us_per_packet\":", cpu);
+   if (accepted > 0)
+      printf ("%.1f}\n", (double)cpu / accepted);
+   else
+      printf ("null}\n");
+   fflush (stdout);
+}
+
+static int dccbench_workload (const DccWorkload *workload) {
+
+   DccScriptLength = 0;
+   DccScriptTime = 0;
+   DccSendCount = 0;
+   DccTrackCount = 0;
+   DccRandom = 1;
+
+   dccbench_printf ("pin %d", DccPinA);
+   if (DccPinB >= 0) dccbench_printf (" %d", DccPinB);
+   dccbench_printf ("\n");
+   workload->generate ();
+   dccbench_sleep (DCCBENCHDRAIN);
+
+   char output[] = "/tmp/dccbench-status-XXXXXX";
+   char trace[] = "/tmp/dccbench-trace-XXXXXX";
+   int fd = mkstemp (output);
+   if (fd < 0) return 0;
+   close (fd);
+   if (!DccReal) {
+      fd = mkstemp (trace);
+      if (fd < 0) return 0;
+      close (fd);
+   }
+
+   struct rusage usage;
+   int ok = dccbench_run (output, DccReal ? 0 : trace, &usage);
+   if (ok) {
+      dccbench_outcomes (output);
+      if (!DccReal) dccbench_decode (trace);
+      dccbench_report (workload->name, &usage);
+   } else {
+      fprintf (stderr, "%s: cannot run %s\n", workload->name, DccPidcc);
+   }
+   unlink (output);
+   if (!DccReal) unlink (trace);
+   return ok;
+}
+
+int main (int argc, const char **argv) {
+
+   int selected[sizeof(DccWorkloads) / sizeof(DccWorkload)];
+   int any = 0;
+   int i, j;
+
+   memset (selected, 0, sizeof(selected));
+   signal (SIGPIPE, SIG_IGN);
+
+   for (i = 1; i < argc; ++i) {
+      if (!strncmp (argv[i], "--pidcc=", 8)) {
+         DccPidcc = argv[i] + 8;
+      } else if (!strncmp (argv[i], "--analyze=", 10)) {
+         DccAnalyze = argv[i] + 10;
+      } else if (!strcmp (argv[i], "--real")) {
+         DccReal = 1;
+      } else if (!strncmp (argv[i], "--pin=", 6)) {
+         DccPinA = atoi (argv[i] + 6);
+         const char *sep = strchr (argv[i] + 6, ':');
+         DccPinB = sep ? atoi (sep + 1) : -1;
+      } else if (!strncmp (argv[i], "--duration=", 11)) {
+         DccDuration = atoi (argv[i] + 11);
+         if (DccDuration < 1) DccDuration = 1;
+      } else if (argv[i][0] == '-') {
+         printf ("%s [-h] [--pidcc=PATH] [--analyze=PATH] [--real] "
+                 "[--pin=A[:B]] [--duration=SECONDS] [WORKLOAD ..]\n\n",
+                 argv[0]);
+         printf ("  Replay standard workloads against pidcc and measure it.\n");
+         printf ("  Workloads:");
+         for (j = 0; DccWorkloads[j].name; ++j)
+            printf (" %s", DccWorkloads[j].name);
+         printf ("\n");
+         exit (strcmp (argv[i], "-h") ? 1 : 0);
+      } else {
+         for (j = 0; DccWorkloads[j].name; ++j) {
+            if (!strcmp (argv[i], DccWorkloads[j].name)) break;
+         }
+         if (!DccWorkloads[j].name) {
+            fprintf (stderr, "unknown workload %s\n", argv[i]);
+            exit (1);
+         }
+         selected[j] = 1;
+         any = 1;
+      }
+   }
+   if (DccReal && (!strcmp (DccPidcc, "./pidccsim"))) DccPidcc = "./pidcc";
+
+   int failed = 0;
+   for (j = 0; DccWorkloads[j].name; ++j) {
+      if (any && !selected[j]) continue;
+      if (!dccbench_workload (DccWorkloads + j)) failed = 1;
+   }
+   return failed;
+}
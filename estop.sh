@@ -0,0 +1,47 @@
+#!/bin/bash
+# This script checks, on the simulation, that an emergency stop does not
+# drop the packets already queued for transmission that it does not stop.
+#
+# Usage:
+#   make sim && ./estop.sh
+
+TRACE=/tmp/pidcc-estop-$$.trace
+trap "rm -f $TRACE" EXIT
+
+# Queue enough packets to fill the transmit ring, including an accessory
+# packet, then stop decoder 3 while they are waiting.
+( echo "pin 17 18"
+  echo "send 3 0x3f 0x90"
+  echo "send 4 0x3f 0x90"
+  echo "send 5 0x3f 0x90"
+  echo "send 0x81 0xf9"
+  echo "send 3 0x3f 0x91"
+  echo "send 6 0x3f 0x90"
+  echo "sleep 0.01"
+  echo "send -e 3 0x3f 0x01"
+  echo "sleep 0.3" ) | PIDCC_SIM_TRACE=$TRACE ./pidccsim --virtual > /dev/null
+
+STATUS=0
+
+# The stop must not wait behind the packets already queued.
+FIRST=`./dccanalyze --gpio=17 $TRACE | grep -m 1 -e ' 03 3f 01 ' -e ' 81 f9 '`
+case "$FIRST" in
+   *" 03 3f 01 "*) ;;
+   *) echo "FAIL: emergency stop sent after the queued packets"
+      STATUS=1
+      ;;
+esac
+
+ACCESSORY=`./dccanalyze --gpio=17 $TRACE | grep -c ' 81 f9 78 ok '`
+if [ "$ACCESSORY" -ne 3 ] ; then
+   echo "FAIL: accessory packet sent $ACCESSORY times, expected 3"
+   STATUS=1
+fi
+
+if ! ./dccanalyze --gpio=17 --summary $TRACE | grep -q ' 0 5ms violations' ; then
+   echo "FAIL: separator missing between packets to the same decoder"
+   STATUS=1
+fi
+
+if [ $STATUS -eq 0 ] ; then echo "PASS: emergency stop" ; fi
+exit $STATUS
@@ -27,11 +27,24 @@
  * The user commands and their syntax are:
  *
  *    ping <pin+> [<pin->]      Specify the GPIO pins to be used.
+ *    district <n> <pin+> [<pin->]  Specify the GPIO pins of an extra
+ *                              district, or remove it if <pin+> is 0.
  *    idle [0|1]                Disable or enable idle packets generation.
- *    send [-p] <byte> ...      Send the specified data packet.
+ *    refresh [0|1|clear]       Disable, enable or clear the decoder refresh.
+ *    chain [0|1]               Disable or enable the chain transmit mode.
+ *    notify [0|1]              Disable or enable pigpio wave notifications.
+ *    send [-p|-e|-b|-d<n>] <byte> ...  Send the specified data packet.
  *                                  -p: this is a programming command.
+ *                                  -e: this is an emergency packet.
+ *                                  -b: this is a background packet.
+ *                                  -d<n>: send on district n.
  *    debug [0|1]               Enable/disable debug mode (default: enable)
  *    silent [0|1]              Enable/disable silent mode (default: enable)
+ *    stats                     Report statistics.
+ *    trace [0|1]               Report the latency of each packet.
+ *    binary                    Switch the command channel to binary frames.
+ *    weight <n>                Set the round robin weight of this client.
+ *    sleep <seconds>           Pause reading this client's commands.
  *
  * When the program starts, debug and silent modes are disabled, idle mode
  * is enabled.
@@ -42,61 +55,335 @@
  *
  * The format of status message is as follow:
  *
- *    ('#' | '*' | '!' | '$') ' ' <timestamp> ' ' <text message>
+ *    ('#' | '*' | '!' | '$' | '=') ' ' <timestamp> ' ' <text message>
  *
  * First character '#': the transmiter is idle.
  * First character '*': the transmiter is busy.
  * First character '!': this is an error message.
  * First character '$': this is a debug message.
+ * First character '=': this is a statistics report.
  *
  * The timestamp is in format <seconds> '.' <milliseconds>
  *
  * The text portion is meant to be shown to an end user.
  *
- * In its current form, pidcc takes commands from standard input and sends
- * status messages to standard output.
+ * The status messages are buffered until the client reads them, and never
+ * delay the transmission (see pidcc_outbox.c).
+ *
+ * By default, pidcc takes commands from standard input and sends status
+ * messages to standard output. The --socket=PATH and --tcp=PORT options
+ * make pidcc also accept client connections: each client has its own
+ * queue, and gets the status messages related to its own commands. The
+ * --shm=NAME option creates a shared memory ring (see pidcc_shm.c), only
+ * accessible to the caller's group, or to the group named by the
+ * --shm-group=GROUP option. A client on the local socket gets the eventfd
+ * doorbell of that ring with the "doorbell" command: the descriptor comes
+ * with a "% doorbell" status line. Without a local socket, the ring is
+ * polled every 5 ms instead.
+ *
+ * The --metrics=PATH option writes the line usage and the queue depths
+ * (see pidcc_telemetry.c) to the specified file every 10 seconds, in the
+ * Prometheus text format (for the textfile collector).
+ *
+ * The --threads option moves the queues and the wave generation to a
+ * separate transmit thread, fed by the main thread through single
+ * producer, single consumer queues (see pidcc_spsc.c). The --threads=CPU
+ * form also pins the transmit thread to that CPU.
+ *
+ * The --realtime[=PRIORITY] option runs the transmitter (the transmit
+ * thread, or the whole program if single threaded) with the SCHED_FIFO
+ * policy, and locks all the memory. The --cpu=CPU option pins the
+ * transmitter to that CPU. In all cases, how late the event loop wakes
+ * up after its timer expired is measured, and reported by stats.
+ *
+ * The district command adds outputs, each with its own GPIO pins, that
+ * are driven from the same waves as the main output (district 0, set
+ * with the pin command). The packets sent to an extra district bypass
+ * the client queues and go to pidcc_district.c, which has its own queue
+ * for each district. There is no refresh of the extra districts, and an
+ * emergency stop sent to an extra district does not cut the transmission
+ * in progress. A power off applies to all the districts. A packet sent to
+ * a district that has no pins is rejected.
+ *
+ * The timing parameters that depend on the hardware come from a tuning
+ * profile (see pidcc_tuning.c), PIDCC_TUNING_PATH by default, or the one
+ * given with the --tuning=PATH option.
+ *
+ * When built for simulation, the --virtual option runs pidcc on a virtual
+ * clock (see pidcc_clock.c): the time moves forward to the next event
+ * whenever pidcc would wait, and the program exits at the end of its
+ * standard input. A script then runs as fast as the computer allows,
+ * with exactly the same output on every run.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
-#include <sys/select.h>
-
-#include <pigpio.h> // Raspberry Pi OS only, not on regular Debian.
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 
+#include "pidcc_packet.h"
+#include "pidcc_encode.h"
+#include "pidcc_district.h"
 #include "pidcc_wave.h"
+#include "pidcc_schedule.h"
+#include "pidcc_refresh.h"
+#include "pidcc_server.h"
+#include "pidcc_shm.h"
+#include "pidcc_spsc.h"
+#include "pidcc_clock.h"
+#include "pidcc_latency.h"
+#include "pidcc_telemetry.h"
+#include "pidcc_outbox.h"
+#include "pidcc_tuning.h"
+
+static int DccEpoll = -1;
+static int DccTimer = -1;
+static int DccNotify = -1;
+
+static const char *DccSocketPath = 0;
+static int DccTcpPort = 0;
+static int DccSocketListener = -1;
+static int DccTcpListener = -1;
+
+// In threaded mode, the main thread reads and parses the commands from
+// the clients, and writes the status back, while a transmit thread runs
+// the queues and the transmitter. The two threads exchange requests and
+// status lines through lock-free queues.
+//
+static int DccThreaded = 0;
+static int DccTransmitCpu = -1;
+static int DccInputEpoll = -1; // Same as DccEpoll, unless threaded.
 
-int DccCommandChannel = 0;
+static __thread int DccIngesting = 0; // This thread reads the clients.
 
 #define DCCMAXDATALENGTH 16
 typedef struct {
    short length;
    short programming;
+   unsigned int sequence; // From the client, for completion reports.
+   long long received;    // When parsed from the client's input.
+   long long queued;
    unsigned char data[DCCMAXDATALENGTH];
 } DccCommand;
 
-static int DccQueueProducer = 0;
-static int DccQueueConsumer = 0;
-static DccCommand DccQueue[128];
+// The queue is split in lanes, by decreasing priority. A lane is served
+// only when all the lanes above it are empty.
+//
+#define DCCLANEEMERGENCY  0
+#define DCCLANEOPERATIONS 1
+#define DCCLANEPROGRAMMING 2 // Includes power off.
+#define DCCLANEBACKGROUND 3
+#define DCCLANES          4
+
+static const char *DccLaneNames[DCCLANES] = {
+   "emergency", "operations", "programming", "background"
+};
+
+#define DCCQUEUESIZE 128
+
+// The lanes belong to the transmit side. The indexes are also read by
+// the main thread, when it looks for a free client slot (see pidcc_open):
+// they are stored atomically.
+//
+typedef struct {
+   int producer;
+   int consumer;
+   DccCommand commands[DCCQUEUESIZE];
+} DccLane;
+
+// The binary protocol frames, all integers are little endian:
+//
+//    frame:  <length:16> <sequence:32> <packet>*
+//    packet: <flags:8> <length:8> <data>*
+//
+// The frame length covers everything after the length field itself.
+// A frame with no packet returns the command channel to text mode.
+//
+#define DCCFRAMEMAX 4096
+
+#define DCCFRAMEPROGRAMMING 0x01
+#define DCCFRAMEEMERGENCY   0x02
+#define DCCFRAMEBACKGROUND  0x04
+#define DCCFRAMEDISTRICT    0x30 // District number, 0 to 3.
+#define DCCFRAMEDISTRICTSHIFT 4
+
+// Each client has its own input buffer and its own queue. The first
+// client is the standard input and output, the others are connections
+// accepted on the sockets.
+//
+// The clients are served in weighted round robin: within a lane, each
+// client moves up to <weight> packets to the transmitter before the next
+// client's turn. A client flooding PiDCC with packets cannot delay the
+// packets from the other clients by more than one turn.
+//
+#define DCCMAXCLIENTS 16
+
+typedef struct {
+   int input;  // -1 when not reading.
+   int output; // -1 when disconnected.
+   int binary; // Command channel carries binary frames (main thread).
+   int framed; // The last request came from a frame (transmit side).
+   int shared; // The shared memory ring, not a connection.
+   int weight;
+   int credit;
+   int accepted; // Current frame.
+   const char *rejected;
+   int trace;    // Report each packet when complete.
+   int paused;   // Input on hold (sleep command) until resume.
+   int held;     // Input on hold until the client reads its status.
+   long long resume;
+   unsigned int delivered; // Requests sent to the transmit side.
+   unsigned int applied;   // Requests done, written by the transmit side.
+   int cursor;
+   char buffer[DCCFRAMEMAX+3];
+   DccLane queue[DCCLANES];
+} DccClient;
+
+static DccClient DccClients[DCCMAXCLIENTS];
+static DccClient *DccConsole = DccClients;
+static __thread DccClient *DccCurrent = DccClients; // Where status goes.
+static int DccServed = 0;
+
+static const char *DccShmName = 0;
+static const char *DccShmGroup = 0;
+static DccClient *DccShared = 0;
+
+#define DCCSHMPOLL 5000 // Without a local socket (no doorbell), in microseconds.
+
+#define DCCOUTBOXPOLL 10000 // Retry period for the status not yet read.
+
+static const char *DccMetricsPath = 0;
+static long long DccMetricsNext = 0;
+static const char *DccMetricsError = 0;
+
+#define DCCMETRICSPERIOD 10000000 // Metrics export period, in microseconds.
+
+// In real-time mode, the thread that runs the transmitter is scheduled
+// with SCHED_FIFO, and all the memory is locked.
+//
+static int DccRealtime = 0; // The SCHED_FIFO priority, 0 if not real-time.
+
+static const char *DccTuningPath = 0; // Default: PIDCC_TUNING_PATH, if any.
+
+#define DCCREALTIMEPRIORITY 50
+#define DCCSTACKPREFAULT (256*1024) // Stack the event loop may ever use.
+
+// A timed wakeup later than this is reported as a warning, at most once
+// per second. By then, the next segment may have been linked too late.
+//
+#define DCCLATEWARNING 1000 // Microseconds.
+
+static long DccLate = 0;
+static long DccLateReported = 0;
+static long long DccLateWarned = 0;
+
+// A command from a client, parsed and ready for the transmit side.
+//
+#define DCCREQUESTOPEN     1 // A new client.
+#define DCCREQUESTPACKET   2 // A send command, or a packet from a frame.
+#define DCCREQUESTFRAME    3 // The end of a frame.
+#define DCCREQUESTCOMMAND  4 // Any other text command.
+
+typedef struct {
+   short type;
+   short client;
+   short lane;
+   short district;
+   short length;
+   int inframe;
+   unsigned int sequence;
+   long long received;
+   char text[256]; // Packet data, command line or frame error.
+} DccRequest;
+
+typedef struct {
+   short client;
+   short length;
+   char line[320];
+} DccStatusLine;
+
+static PidccSpsc DccRequests; // Main thread to transmit thread.
+static PidccSpsc DccStatus;   // Transmit thread to main thread.
+
+static long DccCoalesced = 0;
+
+static long long DccReceived = 0; // When the packet being queued was read.
 
 static int Debug = 0;
 static int Silent = 0;
 static int ActiveIdle = 1;
 
 static int pidcc_next (int cursor) {
-   if (++cursor >= 128) return 0;
+   if (++cursor >= DCCQUEUESIZE) return 0;
    return cursor;
 }
 
-static void pidcc_status (char category, const char *text) {
+static int pidcc_full (void) {
+   int lane;
+   for (lane = 0; lane < DCCLANES; ++lane) {
+      DccLane *queue = DccCurrent->queue + lane;
+      if (pidcc_next (queue->producer) == queue->consumer) return 1;
+   }
+   return 0;
+}
+
+static void pidcc_write (DccClient *client, const char *line, int length) {
+
+   if (DccThreaded && !DccIngesting) {
+      // Hand the line to the main thread. Never wait: drop the line if
+      // the main thread is that late.
+      DccStatusLine *status = pidcc_spsc_slot (&DccStatus);
+      if (!status) return;
+      if (length >= (int)sizeof(status->line)) length = sizeof(status->line)-1;
+      memcpy (status->line, line, length);
+      status->line[length] = 0;
+      status->length = length;
+      status->client = client - DccClients;
+      pidcc_spsc_publish (&DccStatus);
+      return;
+   }
+   if (client->output < 0) return;
+
+   // Never block: the status waits until the client reads it.
+   pidcc_outbox_append (client - DccClients, line, length);
+}
+
+static void pidcc_format (char *line, int size,
+                          char category, const char *text) {
    struct timeval now;
-   gettimeofday (&now, 0);
+   pidcc_clock_timeofday (&now);
    long long sec = (long long)(now.tv_sec);
    int usec = (int)(now.tv_usec);
-   printf ("%c %lld.%06d %s\n", category, sec, usec, text);
-   fflush (stdout);
+   snprintf (line, size, "%c %lld.%06d %s\n", category, sec, usec, text);
+}
+
+static void pidcc_status (char category, const char *text) {
+   char line[1024];
+   pidcc_format (line, sizeof(line), category, text);
+   pidcc_write (DccCurrent, line, strlen(line));
+}
+
+static void pidcc_broadcast (char category, const char *text) {
+   char line[1024];
+   pidcc_format (line, sizeof(line), category, text);
+   int length = strlen(line);
+   int i;
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      pidcc_write (DccClients + i, line, length);
+   }
 }
 
 static void pidcc_error (const char *text) {
@@ -105,12 +392,12 @@ static void pidcc_error (const char *text) {
 
 static void pidcc_idle (const char *text) {
    if (!text) text = "idle";
-   pidcc_status ('#', text);
+   pidcc_broadcast ('#', text);
 }
 
 static void pidcc_busy (const char *text) {
    if (!text) text = "busy";
-   if (pidcc_next (DccQueueProducer) == DccQueueConsumer)
+   if (pidcc_full ())
       pidcc_status ('*', text); // Queue full, stop accepting commands
    else
       pidcc_status ('%', text); // Busy but still accepting commands.
@@ -121,43 +408,321 @@ static void pidcc_debug (const char *text) {
    pidcc_status ('$', text);
 }
 
-static const char *pidcc_enqueue (const unsigned char *data,
-                                  int length, int programming) {
+static void pidcc_report (const char *text) {
+   pidcc_status ('=', text);
+}
 
-   if (length > DCCMAXDATALENGTH) return "data too long";
+// A packet that supersedes a packet still waiting in the same lane takes
+// its place: a throttle sending a new speed for every knob tick then uses
+// one slot per locomotive, not one slot per tick. Programming sequences
+// and emergency packets are never coalesced.
+//
+static int pidcc_coalesce (int lane, const unsigned char *data, int length,
+                           unsigned int sequence) {
 
-   int cursor = DccQueueProducer;
-   DccQueueProducer = pidcc_next (DccQueueProducer);
-   if (DccQueueProducer == DccQueueConsumer) {
-      // Queue is full: backtrack and forget this command.
-      DccQueueProducer = cursor;
-      return "transmitter queue full";
+   if ((lane != DCCLANEOPERATIONS) && (lane != DCCLANEBACKGROUND)) return 0;
+
+   DccLane *queue = DccCurrent->queue + lane;
+   int cursor;
+   for (cursor = queue->consumer;
+        cursor != queue->producer; cursor = pidcc_next (cursor)) {
+      DccCommand *command = queue->commands + cursor;
+      if (pidcc_packet_supersedes (data, length,
+                                   command->data, command->length)) {
+         memcpy (command->data, data, length);
+         command->length = (short)length;
+         command->sequence = sequence;
+         command->received = DccReceived;
+         command->queued = pidcc_clock_now ();
+         DccCoalesced += 1;
+         return 1;
+      }
    }
+   return 0;
+}
+
+static const char *pidcc_enqueue (int lane, const unsigned char *data,
+                                  int length, int programming,
+                                  unsigned int sequence) {
+
+   if (length > DCCMAXDATALENGTH) return "data too long";
+
+   if (pidcc_coalesce (lane, data, length, sequence)) return 0;
 
-   if (length > 0) memcpy (DccQueue[cursor].data, data, length);
-   DccQueue[cursor].length = (short)length;
-   DccQueue[cursor].programming = (short)programming;
+   DccLane *queue = DccCurrent->queue + lane;
+   int cursor = queue->producer;
+   int next = pidcc_next (cursor);
+   if (next == queue->consumer) return "transmitter queue full";
+
+   if (length > 0) memcpy (queue->commands[cursor].data, data, length);
+   queue->commands[cursor].length = (short)length;
+   queue->commands[cursor].programming = (short)programming;
+   queue->commands[cursor].sequence = sequence;
+   queue->commands[cursor].received = DccReceived;
+   queue->commands[cursor].queued = pidcc_clock_now ();
+   __atomic_store_n (&queue->producer, next, __ATOMIC_RELAXED);
    return 0;
 }
 
+static int pidcc_waiting (const DccClient *client, int lane) {
+   return client->queue[lane].producer != client->queue[lane].consumer;
+}
+
+// Main thread side: the client slot can be reused once the transmit side
+// has applied all its requests and sent all the packets it had queued.
+//
+static int pidcc_drained (DccClient *client) {
+   if (__atomic_load_n (&client->applied, __ATOMIC_ACQUIRE) != client->delivered)
+      return 0;
+   int lane;
+   for (lane = 0; lane < DCCLANES; ++lane) {
+      DccLane *queue = client->queue + lane;
+      if (__atomic_load_n (&queue->producer, __ATOMIC_RELAXED) !=
+          __atomic_load_n (&queue->consumer, __ATOMIC_RELAXED)) return 0;
+   }
+   return 1;
+}
+
+// Return the highest priority lane that is not empty, or -1.
+//
+static int pidcc_lane (void) {
+   int lane;
+   for (lane = 0; lane < DCCLANES; ++lane) {
+      int i;
+      for (i = 0; i < DCCMAXCLIENTS; ++i) {
+         if (pidcc_waiting (DccClients + i, lane)) return lane;
+      }
+   }
+   return -1;
+}
+
+// Return the client to be served next in the specified lane. The lane
+// must not be empty.
+//
+static DccClient *pidcc_serving (int lane) {
+   int i;
+   for (i = 0; i <= DCCMAXCLIENTS; ++i) {
+      DccClient *client = DccClients + DccServed;
+      if ((client->credit > 0) && pidcc_waiting (client, lane)) return client;
+      DccServed = (DccServed + 1) % DCCMAXCLIENTS;
+      DccClients[DccServed].credit = DccClients[DccServed].weight;
+   }
+   return DccConsole; // Not reached if the lane is not empty.
+}
+
+static DccClient *DccOwner = DccClients; // Of the last dequeued packet.
+static unsigned int DccOwnerSequence = 0;
+static long long DccOwnerReceived = 0;
+static long long DccOwnerQueued = 0;
+
 static int pidcc_dequeue (unsigned char **data, int *programming) {
 
-   if (DccQueueProducer == DccQueueConsumer) return -1; // Queue is empty.
+   int lane = pidcc_lane ();
+   if (lane < 0) return -1; // Queue is empty.
 
-   int cursor = DccQueueConsumer;
-   DccQueueConsumer = pidcc_next (DccQueueConsumer);
+   DccClient *client = pidcc_serving (lane);
+   DccLane *queue = client->queue + lane;
+   int cursor = queue->consumer;
+   __atomic_store_n (&queue->consumer, pidcc_next (cursor), __ATOMIC_RELAXED);
+   client->credit -= 1;
+   DccOwner = client;
+   DccOwnerSequence = queue->commands[cursor].sequence;
+   DccOwnerReceived = queue->commands[cursor].received;
+   DccOwnerQueued = queue->commands[cursor].queued;
 
    if (!data) return -1; // Queue purge.
 
-   *data = DccQueue[cursor].data;
-   *programming = DccQueue[cursor].programming;
-   return DccQueue[cursor].length;
+   *data = queue->commands[cursor].data;
+   *programming = queue->commands[cursor].programming;
+   return queue->commands[cursor].length;
+}
+
+// Return the number of packets waiting in a lane, for all clients.
+//
+static int pidcc_depth (int lane) {
+   int depth = 0;
+   int i;
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      const DccLane *queue = DccClients[i].queue + lane;
+      depth += (queue->producer - queue->consumer + DCCQUEUESIZE) % DCCQUEUESIZE;
+   }
+   return depth;
+}
+
+static void pidcc_gauges (void) {
+   int lane;
+   for (lane = 0; lane < DCCLANES; ++lane)
+      pidcc_telemetry_queue (DccLaneNames[lane], pidcc_depth (lane));
+   pidcc_telemetry_queue ("scheduler", pidcc_schedule_pending ());
+}
+
+static int pidcc_pending (void) {
+   return pidcc_lane () >= 0;
+}
+
+static DccCommand *pidcc_peek (void) {
+   int lane = pidcc_lane ();
+   if (lane < 0) return 0;
+   DccLane *queue = pidcc_serving (lane)->queue + lane;
+   return queue->commands + queue->consumer;
+}
+
+static int pidcc_poweroff_next (void) {
+   DccCommand *next = pidcc_peek ();
+   if (!next) return 0;
+   return next->length == 0;
+}
+
+static int pidcc_programming_next (void) {
+   DccCommand *next = pidcc_peek ();
+   if (!next) return 0;
+   return next->programming;
+}
+
+// Discard the queued packets that an emergency stop makes obsolete.
+//
+static void pidcc_purge (DccLane *queue,
+                         const unsigned char *data, int length) {
+
+   int kept = queue->consumer;
+   int cursor;
+
+   for (cursor = queue->consumer;
+        cursor != queue->producer; cursor = pidcc_next (cursor)) {
+      DccCommand *command = queue->commands + cursor;
+      if (pidcc_packet_stops (data, length, command->data, command->length))
+         continue;
+      if (kept != cursor) queue->commands[kept] = *command;
+      kept = pidcc_next (kept);
+   }
+   __atomic_store_n (&queue->producer, kept, __ATOMIC_RELAXED);
+}
+
+// An emergency stop goes straight to the track: cut short the transmission
+// of the packets it makes obsolete and make sure that nothing scheduled
+// after the emergency stop restarts the locomotive, whichever client
+// queued it.
+//
+static const char *pidcc_emergency (const unsigned char *data, int length,
+                                    unsigned int sequence) {
+
+   const char *error =
+      pidcc_enqueue (DCCLANEEMERGENCY, data, length, 0, sequence);
+   if (error) return error;
+
+   int i;
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      pidcc_purge (DccClients[i].queue + DCCLANEOPERATIONS, data, length);
+      pidcc_purge (DccClients[i].queue + DCCLANEBACKGROUND, data, length);
+   }
+   pidcc_wave_abort (data, length);
+   return 0;
+}
+
+// The packets for an extra district go straight to its own queue.
+//
+static const char *pidcc_divert (int district, int lane,
+                                 const unsigned char *data, int length) {
+
+   if (!pidcc_wave_configured (district)) return "district has no pins";
+
+   if ((lane == DCCLANEEMERGENCY) ||
+       ((lane != DCCLANEPROGRAMMING) && pidcc_packet_emergency (data, length)))
+      return pidcc_district_urgent (district, data, length);
+
+   return pidcc_district_add (district, lane == DCCLANEPROGRAMMING,
+                              data, length);
+}
+
+static const char *pidcc_submit (int district, int lane,
+                                 const unsigned char *data, int length,
+                                 unsigned int sequence) {
+
+   if (district) return pidcc_divert (district, lane, data, length);
+
+   int programming = (lane == DCCLANEPROGRAMMING);
+
+   if ((!programming) && pidcc_packet_emergency (data, length))
+      lane = DCCLANEEMERGENCY;
+
+   if (lane == DCCLANEEMERGENCY)
+      return pidcc_emergency (data, length, sequence);
+
+   return pidcc_enqueue (lane, data, length, programming, sequence);
+}
+
+static int pidcc_room (int lane) {
+   DccLane *queue = DccCurrent->queue + lane;
+   return pidcc_next (queue->producer) != queue->consumer;
+}
+
+// Take the packets published in the shared memory ring. A packet that
+// does not fit in the queue stays in the ring until the next call.
+//
+static void pidcc_shared (void) {
+
+   if (!DccShared) return;
+   DccCurrent = DccShared;
+
+   const PidccShmSlot *slot;
+   while ((slot = pidcc_shm_next ())) {
+
+      int lane = DCCLANEOPERATIONS;
+      if (slot->flags & PIDCC_SHM_PROGRAMMING) lane = DCCLANEPROGRAMMING;
+      else if (slot->flags & PIDCC_SHM_EMERGENCY) lane = DCCLANEEMERGENCY;
+      else if (slot->flags & PIDCC_SHM_BACKGROUND) lane = DCCLANEBACKGROUND;
+
+      int length = slot->length;
+      if ((length < 2) || (length > DCCMAXDATALENGTH)) {
+         pidcc_shm_consume (0);
+         continue;
+      }
+      if (!pidcc_room (lane)) break;
+
+      DccReceived = pidcc_clock_now ();
+      const char *error = pidcc_submit (0, lane, slot->data, length,
+                                        slot->sequence);
+      pidcc_shm_consume (error == 0);
+   }
+   DccCurrent = DccConsole;
 }
 
 static int valid_gpio (int gpio) {
     return (gpio > 0) && (gpio <= 26); // Specific to Raspberry Pi.
 }
 
+static void pidcc_poll (int epoll, int fd) {
+   struct epoll_event event;
+   event.events = EPOLLIN;
+   event.data.fd = fd;
+   epoll_ctl (epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void pidcc_listen (int fd) {
+   pidcc_poll (DccEpoll, fd);
+}
+
+static void pidcc_attach (int fd) {
+   pidcc_poll (DccInputEpoll, fd);
+}
+
+static void pidcc_notify (int enable) {
+
+   if (enable) {
+      if (DccNotify < 0) {
+         DccNotify = eventfd (0, EFD_NONBLOCK);
+         if (DccNotify < 0) {
+            pidcc_error ("cannot create eventfd");
+            return;
+         }
+         pidcc_listen (DccNotify);
+      }
+      pidcc_wave_notify (DccNotify);
+   } else {
+      pidcc_wave_notify (-1);
+   }
+}
+
 static void pidcc_execute (char *command) {
 
    int count;
@@ -177,35 +742,6 @@ static void pidcc_execute (char *command) {
       }
    }
 
-   if (!strcasecmp (words[0], "send")) {
-      int programming = 0;
-      for (i = 1; i < count; ++i) {
-          const char *word = words[i];
-          if (word[0] != '-') break;
-          if (word[1] == 'p') programming = 1;
-      }
-      int length = 0;
-      unsigned char data[DCCMAXDATALENGTH];
-      for (; i < count; ++i) {
-         if (length >= DCCMAXDATALENGTH) {
-            pidcc_error ("packet data too long");
-            return;
-         }
-         data[length++] = strtol (words[i], 0, 0);
-      }
-      if (length < 2) {
-         pidcc_error ("missing packet data");
-         return;
-      }
-      const char *error = pidcc_enqueue (data, length, programming);
-      if (error) {
-         if (!Silent) pidcc_error (error);
-      } else {
-          pidcc_busy ("command queued");
-      }
-      return;
-   }
-
    if (!strcasecmp (words[0], "poweroff")) {
       if (count < 2) {
          pidcc_error ("missing power off duration");
@@ -217,7 +753,7 @@ static void pidcc_execute (char *command) {
          return;
       }
       if (duration > 60) duration = 60;
-      const char *error = pidcc_enqueue (0, 0, duration);
+      const char *error = pidcc_enqueue (DCCLANEPROGRAMMING, 0, 0, duration, 0);
       if (error) {
          if (!Silent) pidcc_error (error);
       } else {
@@ -248,7 +784,32 @@ static void pidcc_execute (char *command) {
               return;
           }
       }
-      const char *error = pidcc_wave_initialize (gpioa, gpiob, Debug);
+      const char *error =
+         pidcc_wave_initialize (gpioa, gpiob, Debug ? pidcc_debug : 0);
+      if (error) pidcc_error (error);
+      return;
+   }
+
+   if (!strcasecmp (words[0], "district")) {
+      if (count < 3) {
+         pidcc_error ("missing district or pin");
+         return;
+      }
+      int district = atoi (words[1]);
+      int gpioa = atoi (words[2]);
+      if ((gpioa != 0) && !valid_gpio(gpioa)) {
+          pidcc_error ("invalid GPIO A pin");
+          return;
+      }
+      int gpiob = 0;
+      if ((count > 3) && gpioa) {
+          gpiob = atoi (words[3]);
+          if (!valid_gpio(gpiob)) {
+              pidcc_error ("invalid GPIO B pin");
+              return;
+          }
+      }
+      const char *error = pidcc_wave_district (district, gpioa, gpiob);
       if (error) pidcc_error (error);
       return;
    }
@@ -265,6 +826,153 @@ static void pidcc_execute (char *command) {
       return;
    }
 
+   if (!strcasecmp (words[0], "chain")) {
+      const char *error =
+         pidcc_wave_chain ((count < 2) ? 1 : atoi (words[1]));
+      if (error) pidcc_error (error);
+      return;
+   }
+
+   if (!strcasecmp (words[0], "notify")) {
+      if (count < 2) pidcc_notify (1);
+      else pidcc_notify (atoi (words[1]));
+      return;
+   }
+
+   if (!strcasecmp (words[0], "stats")) {
+      char text[256];
+      long hits, misses, evictions;
+      pidcc_wave_cache_statistics (&hits, &misses, &evictions);
+      snprintf (text, sizeof(text),
+                "wave cache: %ld hits, %ld misses, %ld evictions",
+                hits, misses, evictions);
+      pidcc_report (text);
+      snprintf (text, sizeof(text),
+                "refresh table: %d packets", pidcc_refresh_count ());
+      pidcc_report (text);
+      snprintf (text, sizeof(text),
+                "coalesced: %ld queued, %ld scheduled",
+                DccCoalesced, pidcc_schedule_coalesced ());
+      pidcc_report (text);
+
+      int stage;
+      const char *name;
+      long samples;
+      long long p50, p90, p99, max;
+      for (stage = 0; stage < PIDCC_LATENCY_WAKEUP; ++stage) {
+         name = pidcc_latency_statistics (stage, &samples,
+                                          &p50, &p90, &p99, &max);
+         if (!name) break;
+         snprintf (text, sizeof(text),
+                   "latency %s: %ld packets, p50 %lld, p90 %lld, p99 %lld, "
+                   "max %lld (usec)", name, samples, p50, p90, p99, max);
+         pidcc_report (text);
+      }
+      snprintf (text, sizeof(text),
+                "latency: %ld packets replaced or discarded",
+                pidcc_latency_dropped ());
+      pidcc_report (text);
+
+      int cursor = snprintf (text, sizeof(text), "tuning:");
+      for (stage = 0; ; ++stage) {
+         name = pidcc_tuning_name (stage);
+         if (!name) break;
+         cursor += snprintf (text+cursor, sizeof(text)-cursor, "%s %s %d",
+                             stage ? "," : "", name, pidcc_tuning_get (stage));
+      }
+      snprintf (text+cursor, sizeof(text)-cursor, " (usec)");
+      pidcc_report (text);
+
+      pidcc_latency_statistics (PIDCC_LATENCY_WAKEUP, &samples,
+                                &p50, &p90, &p99, &max);
+      snprintf (text, sizeof(text),
+                "wakeup: %ld timed wakeups, late by p50 %lld, p90 %lld, "
+                "p99 %lld, max %lld (usec), %ld over %d usec",
+                samples, p50, p90, p99, max, DccLate, DCCLATEWARNING);
+      pidcc_report (text);
+
+      long long elapsed = pidcc_telemetry_elapsed ();
+      if (elapsed > 0) {
+         long long usec;
+         long transmissions;
+         int cursor = snprintf (text, sizeof(text), "line: %lld.%06d seconds",
+                                elapsed / 1000000, (int)(elapsed % 1000000));
+         for (stage = 0; ; ++stage) {
+            name = pidcc_telemetry_usage (stage, &usec, &transmissions);
+            if (!name) break;
+            cursor += snprintf (text+cursor, sizeof(text)-cursor,
+                                ", %s %.1f%%", name, (usec * 100.0) / elapsed);
+         }
+         pidcc_report (text);
+
+         char decoder[64];
+         for (stage = 0; stage < 8; ++stage) {
+            if (!pidcc_telemetry_decoder (stage, decoder, sizeof(decoder),
+                                          &usec, &transmissions)) break;
+            snprintf (text, sizeof(text),
+                      "decoder %s: %ld transmissions, %.1f%% of the line",
+                      decoder, transmissions, (usec * 100.0) / elapsed);
+            pidcc_report (text);
+         }
+      }
+      pidcc_gauges ();
+      cursor = snprintf (text, sizeof(text), "queue depth:");
+      for (stage = 0; stage < DCCLANES; ++stage) {
+         cursor += snprintf (text+cursor, sizeof(text)-cursor, " %s %d,",
+                             DccLaneNames[stage], pidcc_depth (stage));
+      }
+      snprintf (text+cursor, sizeof(text)-cursor, " scheduler %d",
+                pidcc_schedule_pending ());
+      pidcc_report (text);
+
+      for (stage = 1; stage < PIDCC_DISTRICTS; ++stage) {
+         int pending;
+         long sent;
+         pidcc_district_statistics (stage, &pending, &sent);
+         if ((pending <= 0) && (sent <= 0)) continue;
+         snprintf (text, sizeof(text),
+                   "district %d: %ld packets sent, %d pending",
+                   stage, sent, pending);
+         pidcc_report (text);
+      }
+
+      long dropped;
+      cursor = snprintf (text, sizeof(text),
+                         "status: %ld lines coalesced, dropped",
+                         pidcc_outbox_coalesced ());
+      for (stage = 0; ; ++stage) {
+         name = pidcc_outbox_dropped (stage, &dropped);
+         if (!name) break;
+         cursor += snprintf (text+cursor, sizeof(text)-cursor,
+                             "%s %s %ld", stage ? "," : "", name, dropped);
+      }
+      pidcc_report (text);
+      return;
+   }
+
+   if (!strcasecmp (words[0], "trace")) {
+      if (count < 2) DccCurrent->trace = 1;
+      else DccCurrent->trace = atoi (words[1]);
+      return;
+   }
+
+   if (!strcasecmp (words[0], "refresh")) {
+      if (count < 2) pidcc_refresh_enable (1);
+      else if (!strcasecmp (words[1], "clear")) pidcc_refresh_clear ();
+      else pidcc_refresh_enable (atoi (words[1]));
+      return;
+   }
+
+   if (!strcasecmp (words[0], "weight")) {
+      int weight = (count < 2) ? 1 : atoi (words[1]);
+      if ((weight < 1) || (weight > DCCQUEUESIZE)) {
+         pidcc_error ("invalid weight");
+         return;
+      }
+      DccCurrent->weight = weight;
+      return;
+   }
+
    if (!strcasecmp (words[0], "idle")) {
       if (count < 2) ActiveIdle = 1;
       else ActiveIdle = atoi (words[1]);
@@ -274,49 +982,441 @@ static void pidcc_execute (char *command) {
    pidcc_error ("unknown command");
 }
 
-static void pidcc_input (void) {
+// Execute a parsed request on the transmit side. This runs in the
+// transmit thread when threaded, and directly otherwise.
+//
+static void pidcc_apply (const DccRequest *request) {
+
+   char text[320];
+   DccClient *client = DccClients + request->client;
+   DccClient *previous = DccCurrent;
+   DccCurrent = client;
 
-   static int  CommandCursor = 0;
-   static char Command[1024];
+   switch (request->type) {
+
+   case DCCREQUESTOPEN:
+      client->framed = 0;
+      client->weight = 1;
+      client->credit = 0;
+      client->trace = 0;
+      client->accepted = 0;
+      client->rejected = 0;
+      break;
+
+   case DCCREQUESTPACKET: {
+      DccReceived = request->received;
+      client->framed = request->inframe;
+      const char *error = pidcc_submit (request->district, request->lane,
+                                        (const unsigned char *)request->text,
+                                        request->length, request->sequence);
+      if (request->inframe) {
+         if (!error) client->accepted += 1;
+         else if (!client->rejected) client->rejected = error;
+      } else if (error) {
+         if (!Silent) pidcc_error (error);
+      } else {
+         pidcc_busy ("command queued");
+      }
+      break;
+   }
 
-   int length = read (DccCommandChannel,
-                       Command+CommandCursor, sizeof(Command)-CommandCursor-1);
+   case DCCREQUESTFRAME: {
+      // One acknowledgement for the whole frame.
+      client->framed = (request->length >= 0);
+      if (request->length < 0) {
+         snprintf (text, sizeof(text), "frame %u: text mode", request->sequence);
+         pidcc_busy (text);
+         break;
+      }
+      const char *error = client->rejected;
+      if (!error && request->text[0]) error = request->text;
+      if (error) {
+         snprintf (text, sizeof(text),
+                   "frame %u: %d of %d packets accepted, %s",
+                   request->sequence, client->accepted, request->length, error);
+         pidcc_error (text);
+      } else {
+         snprintf (text, sizeof(text), "frame %u: %d packets accepted",
+                   request->sequence, client->accepted);
+         pidcc_busy (text);
+      }
+      client->accepted = 0;
+      client->rejected = 0;
+      break;
+   }
+
+   case DCCREQUESTCOMMAND:
+      strncpy (text, request->text, sizeof(text));
+      text[sizeof(text)-1] = 0;
+      pidcc_execute (text);
+      break;
+   }
+   DccCurrent = previous;
+
+   // Tell the main thread (see pidcc_drained).
+   __atomic_store_n (&client->applied, client->applied + 1, __ATOMIC_RELEASE);
+}
+
+static void pidcc_deliver (DccRequest *request) {
+
+   request->received = pidcc_clock_now ();
+   DccClients[request->client].delivered += 1;
+
+   if (!DccThreaded) {
+      pidcc_apply (request);
+      return;
+   }
+   // The transmit thread is behind: wait, which pushes back on the clients.
+   DccRequest *slot;
+   while (!(slot = pidcc_spsc_slot (&DccRequests))) usleep (1000);
+   *slot = *request;
+   pidcc_spsc_publish (&DccRequests);
+}
+
+static void pidcc_send (DccClient *client, char *command) {
+
+   int count;
+   char *words[100];
+
+   words[0] = command;
+   count = 1;
+
+   int i;
+   for (i = 0; command[i] > 0; ++i) {
+      if (command[i] == ' ') {
+         words[count++] = command + i + 1;
+         command[i] = 0;
+         if (count >= 100) break;
+      }
+   }
+
+   int lane = DCCLANEOPERATIONS;
+   int district = 0;
+   for (i = 1; i < count; ++i) {
+       const char *word = words[i];
+       if (word[0] != '-') break;
+       switch (word[1]) {
+       case 'p': lane = DCCLANEPROGRAMMING; break;
+       case 'e': lane = DCCLANEEMERGENCY; break;
+       case 'b': lane = DCCLANEBACKGROUND; break;
+       case 'd': district = atoi (word + 2); break;
+       }
+   }
+   if ((district < 0) || (district >= PIDCC_DISTRICTS)) {
+      pidcc_error ("invalid district");
+      return;
+   }
+   DccRequest request;
+   int length = 0;
+   for (; i < count; ++i) {
+      if (length >= DCCMAXDATALENGTH) {
+         pidcc_error ("packet data too long");
+         return;
+      }
+      request.text[length++] = strtol (words[i], 0, 0);
+   }
+   if (length < 2) {
+      pidcc_error ("missing packet data");
+      return;
+   }
+   request.type = DCCREQUESTPACKET;
+   request.client = client - DccClients;
+   request.lane = lane;
+   request.district = district;
+   request.length = length;
+   request.inframe = 0;
+   request.sequence = 0;
+   pidcc_deliver (&request);
+}
+
+static void pidcc_unlisten (int fd);
+
+// Give a local client the doorbell of the shared memory ring. The status
+// lines already waiting are flushed first, so that the line carrying the
+// descriptor is not reordered with them.
+//
+static void pidcc_doorbell (DccClient *client) {
+
+   if (!DccShared) {
+      pidcc_error ("no shared memory");
+      return;
+   }
+   if (pidcc_outbox_flush (client - DccClients) != 0) {
+      pidcc_error ("status pending, retry");
+      return;
+   }
+   char line[128];
+   pidcc_format (line, sizeof(line), '%', "doorbell");
+   const char *error = pidcc_server_pass (client->output,
+                                          pidcc_shm_doorbell (),
+                                          line, strlen(line));
+   if (error) pidcc_error (error);
+}
+
+// Parse a text command. The send and binary commands are decoded here,
+// all other commands are rare enough to be passed as is.
+//
+static void pidcc_command (DccClient *client, char *command) {
+
+   if (command[0] == 0) return; // ignore empty commands.
+
+   int length = strcspn (command, " ");
+
+   if ((length == 4) && (!strncasecmp (command, "send", 4))) {
+      pidcc_send (client, command);
+      return;
+   }
+   if ((length == 6) && (!strncasecmp (command, "binary", 6))) {
+      client->binary = 1;
+      return;
+   }
+   if ((length == 5) && (!strncasecmp (command, "sleep", 5))) {
+      double seconds = atof (command + 5);
+      if (seconds <= 0) return;
+      client->paused = 1;
+      client->resume = pidcc_clock_now () + (long long)(seconds * 1000000);
+      pidcc_unlisten (client->input);
+      return;
+   }
+   if ((length == 8) && (!strncasecmp (command, "doorbell", 8))) {
+      pidcc_doorbell (client);
+      return;
+   }
+
+   DccRequest request;
+   if (strlen (command) >= sizeof(request.text)) {
+      pidcc_error ("command too long");
+      return;
+   }
+   request.type = DCCREQUESTCOMMAND;
+   request.client = client - DccClients;
+   strcpy (request.text, command);
+   pidcc_deliver (&request);
+}
+
+static void pidcc_frame (DccClient *client,
+                         const unsigned char *frame, int length) {
+
+   if (length < 4) {
+      pidcc_error ("invalid frame");
+      return;
+   }
+   DccRequest request;
+   request.client = client - DccClients;
+   request.sequence = frame[0] + (frame[1] << 8) +
+                      (frame[2] << 16) + ((unsigned int)frame[3] << 24);
+
+   if (length == 4) {
+      client->binary = 0;
+      request.type = DCCREQUESTFRAME;
+      request.length = -1;
+      pidcc_deliver (&request);
+      return;
+   }
+
+   int count = 0;
+   const char *error = 0;
+
+   int cursor = 4;
+   while (cursor < length) {
+      if (cursor + 2 > length) {
+         error = "truncated frame";
+         break;
+      }
+      int flags = frame[cursor];
+      int size = frame[cursor+1];
+      const unsigned char *data = frame + cursor + 2;
+      cursor += 2 + size;
+      if (cursor > length) {
+         error = "truncated frame";
+         break;
+      }
+      count += 1;
+
+      if ((size < 2) || (size > DCCMAXDATALENGTH)) {
+         if (!error) error = (size < 2) ? "missing packet data"
+                                        : "data too long";
+         continue;
+      }
+      request.type = DCCREQUESTPACKET;
+      request.lane = DCCLANEOPERATIONS;
+      if (flags & DCCFRAMEPROGRAMMING) request.lane = DCCLANEPROGRAMMING;
+      else if (flags & DCCFRAMEEMERGENCY) request.lane = DCCLANEEMERGENCY;
+      else if (flags & DCCFRAMEBACKGROUND) request.lane = DCCLANEBACKGROUND;
+      request.district = (flags & DCCFRAMEDISTRICT) >> DCCFRAMEDISTRICTSHIFT;
+      request.length = size;
+      request.inframe = 1;
+      memcpy (request.text, data, size);
+      pidcc_deliver (&request);
+   }
+
+   request.type = DCCREQUESTFRAME;
+   request.length = count;
+   request.text[0] = 0;
+   if (error) strcpy (request.text, error);
+   pidcc_deliver (&request);
+}
+
+static void pidcc_unlisten (int fd) {
+   epoll_ctl (DccInputEpoll, EPOLL_CTL_DEL, fd, 0);
+}
+
+static void pidcc_open (int fd) {
+
+   int i;
+   for (i = 1; i < DCCMAXCLIENTS; ++i) {
+      DccClient *client = DccClients + i;
+      if ((client->output >= 0) || client->shared) continue;
+      if (!pidcc_drained (client)) continue;
+      client->input = fd;
+      client->output = fd;
+      client->binary = 0;
+      client->cursor = 0;
+      client->paused = 0;
+      client->held = 0;
+      pidcc_outbox_open (i, fd);
+      pidcc_attach (fd);
+
+      DccRequest request;
+      request.type = DCCREQUESTOPEN;
+      request.client = i;
+      pidcc_deliver (&request);
+      return;
+   }
+   static const char full[] = "! 0.000000 too many clients\n";
+   send (fd, full, sizeof(full)-1, MSG_DONTWAIT | MSG_NOSIGNAL);
+   close (fd);
+}
+
+// The client is gone. The packets it queued are still transmitted (a
+// script may send a few commands and disconnect right away), even if its
+// slot is reused. The console keeps its output, for the status of the
+// other clients' packets.
+//
+static void pidcc_close (DccClient *client) {
+
+   pidcc_unlisten (client->input);
+   if (client != DccConsole) {
+      close (client->input);
+      pidcc_outbox_close (client - DccClients);
+      client->output = -1;
+      client->binary = 0;
+   }
+   client->input = -1;
+   client->cursor = 0;
+   client->paused = 0;
+   client->held = 0;
+
+   // A virtual time session ends with its script.
+   if ((client == DccConsole) && pidcc_clock_isvirtual ()) {
+      pidcc_outbox_finish (0);
+      exit (0);
+   }
+}
+
+static void pidcc_parse (DccClient *client);
+
+// Stop reading a client that does not read its status: its commands
+// would only add to the status waiting. See pidcc_flush().
+//
+static int pidcc_hold (DccClient *client) {
+
+   if (!client->held) {
+      if (!pidcc_outbox_congested (client - DccClients)) return 0;
+      client->held = 1;
+      pidcc_unlisten (client->input);
+   }
+   return 1;
+}
+
+static void pidcc_input (DccClient *client) {
+
+   char *buffer = client->buffer;
+
+   int length = read (client->input, buffer + client->cursor,
+                      sizeof(client->buffer) - client->cursor - 1);
 
    if (length <= 0) {
-      CommandCursor = 0; // Erase everything on error.
+      if ((length < 0) && (errno == EAGAIN)) return;
+      pidcc_close (client);
       return;
    }
-   CommandCursor += length;
-   Command[CommandCursor] = 0; // Force string terminator.
+   client->cursor += length;
+   buffer[client->cursor] = 0; // Force string terminator.
+
+   pidcc_parse (client);
+}
+
+// Execute the complete commands or frames received so far. This stops
+// at a sleep command, or when the client's status is piling up, leaving
+// the rest in the buffer until resumed.
+//
+static void pidcc_parse (DccClient *client) {
 
-   char *start = Command;
+   char *buffer = client->buffer;
+
+   char *start = buffer;
+   char *end = buffer + client->cursor;
    for (;;) {
-      if (*start == 0) {
-         CommandCursor = 0;
+      if (start >= end) {
+         client->cursor = 0;
          return;
       }
-      char *eol = strchr (start, '\n');
-      if (!eol) {
-         if (start == Command) return;
-         size_t leftover = CommandCursor - (start - Command);
-         if (leftover > sizeof(Command)) {
-            CommandCursor = 0; // Erase everything in inconsistant situations.
+      if (client->paused) break;
+      if (pidcc_hold (client)) break;
+      char *next;
+      if (client->binary) {
+         if (end - start < 2) break; // Incomplete length.
+         int size = (unsigned char)start[0] + ((unsigned char)start[1] << 8);
+         if (size > DCCFRAMEMAX) {
+            pidcc_error ("frame too long, back to text mode");
+            client->binary = 0;
+            client->cursor = 0;
+            return;
+         }
+         if (end - start < size + 2) break; // Incomplete frame.
+         pidcc_frame (client, (unsigned char *)start + 2, size);
+         next = start + size + 2;
+      } else {
+         if (*start == 0) {
+            client->cursor = 0;
             return;
          }
-         memmove (Command, start, leftover);
-         CommandCursor = leftover;
-         return; // Incomplete command.
+         char *eol = memchr (start, '\n', end - start);
+         if (!eol) break; // Incomplete command.
+         *eol = 0;
+         pidcc_command (client, start);
+         next = eol + 1;
+         // Skip \r if any, but not the start of a binary frame.
+         if (!client->binary) {
+            while ((next < end) && (*next > 0) && (*next <= ' ')) next += 1;
+         }
+      }
+      start = next;
+   }
+
+   // Keep the incomplete command or frame for the next read.
+   if (start == buffer) {
+      if (client->cursor >= (int)sizeof(client->buffer) - 1) {
+         client->cursor = 0; // Erase everything in inconsistant situations.
       }
-      *eol = 0;
-      pidcc_execute (start);
-      start = eol + 1;
-      while ((*start > 0) && (*start <= ' ')) start += 1; // Skip \r if any.
+      return;
    }
+   size_t leftover = end - start;
+   memmove (buffer, start, leftover);
+   client->cursor = leftover;
+}
+
+static void pidcc_monotonic (struct timeval *now) {
+    long long usec = pidcc_clock_now ();
+    now->tv_sec = usec / 1000000;
+    now->tv_usec = usec % 1000000;
 }
 
 static void pidcc_delay (struct timeval *end, int usec) {
-    end->tv_usec += usec;
-    if (end->tv_usec > 1000000) {
+    end->tv_sec += usec / 1000000;
+    end->tv_usec += usec % 1000000;
+    if (end->tv_usec >= 1000000) {
        end->tv_usec -= 1000000;
        end->tv_sec += 1;
     }
@@ -330,11 +1430,274 @@ static int pidcc_after (const struct timeval *now, const struct timeval *end) {
     return 0;
 }
 
+static int pidcc_until (const struct timeval *now, const struct timeval *end) {
+    if (pidcc_after (now, end)) return 0;
+    return ((end->tv_sec - now->tv_sec) * 1000000)
+           + (end->tv_usec - now->tv_usec);
+}
+
+// Handle activity on the client side: new connections, commands, and
+// (in threaded mode) the status lines from the transmit thread.
+//
+static void pidcc_dispatch (int fd) {
+
+   if ((fd == DccSocketListener) || (fd == DccTcpListener)) {
+      int client = pidcc_server_accept (fd);
+      if (client >= 0) pidcc_open (client);
+      return;
+   }
+
+   if (DccThreaded && (fd == pidcc_spsc_doorbell (&DccStatus))) {
+      pidcc_spsc_answer (&DccStatus);
+      DccStatusLine *status;
+      while ((status = pidcc_spsc_next (&DccStatus))) {
+         pidcc_write (DccClients + status->client, status->line, status->length);
+         pidcc_spsc_release (&DccStatus);
+      }
+      return;
+   }
+
+   int i;
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      DccClient *client = DccClients + i;
+      if ((client->output < 0) || (client->input != fd)) continue;
+      DccCurrent = client;
+      pidcc_debug ("received input");
+      pidcc_input (client);
+      break;
+   }
+   DccCurrent = DccConsole;
+}
+
+// Resume the clients paused by a sleep command, once their time has come.
+// Return how many microseconds until the next one resumes, 0 if a client
+// was resumed, or -1 if no client is paused.
+//
+static long long pidcc_resume (void) {
+
+   long long now = pidcc_clock_now ();
+   long long next = -1;
+
+   int i;
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      DccClient *client = DccClients + i;
+      if (!client->paused) continue;
+      if (client->resume > now) {
+         if ((next < 0) || (client->resume - now < next))
+            next = client->resume - now;
+         continue;
+      }
+      client->paused = 0;
+      DccCurrent = client;
+      pidcc_parse (client);
+      if ((!client->paused) && (!client->held) && (client->input >= 0))
+         pidcc_attach (client->input);
+      next = 0;
+   }
+   DccCurrent = DccConsole;
+   return next;
+}
+
+// Account for how late the event loop woke up after its timer expired:
+// this is the scheduling latency of the transmitter.
+//
+static void pidcc_late (long long deadline) {
+
+   long long now = pidcc_clock_now ();
+   long long late = now - deadline;
+
+   pidcc_latency_wakeup (late);
+   if (late < DCCLATEWARNING) return;
+
+   DccLate += 1;
+   if (now < DccLateWarned + 1000000) return;
+
+   char text[256];
+   snprintf (text, sizeof(text),
+             "woke up %lld usec late, %ld wakeups over %d usec since the "
+             "last warning", late, DccLate - DccLateReported, DCCLATEWARNING);
+   DccClient *previous = DccCurrent;
+   DccCurrent = DccConsole;
+   pidcc_error (text);
+   DccCurrent = previous;
+   DccLateReported = DccLate;
+   DccLateWarned = now;
+}
+
+// Write the status that the clients were slow to read, and resume
+// reading the clients that caught up. A client that lost an error message
+// is not reading at all: disconnect it. Return the time until the next
+// attempt, in microseconds, or -1 if there is nothing left to write.
+//
+static int pidcc_flush (void) {
+
+   int next = -1;
+   int i;
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      DccClient *client = DccClients + i;
+      if (client->output < 0) continue;
+
+      int waiting = pidcc_outbox_flush (i);
+      if (waiting < 0) {
+         if (client != DccConsole) {
+            pidcc_close (client);
+            continue;
+         }
+         waiting = 0;
+      }
+      if (waiting > 0) next = DCCOUTBOXPOLL;
+
+      if (client->held && (!pidcc_outbox_congested (i))) {
+         client->held = 0;
+         DccCurrent = client;
+         pidcc_parse (client);
+         if ((!client->paused) && (!client->held) && (client->input >= 0))
+            pidcc_attach (client->input);
+      }
+   }
+   DccCurrent = DccConsole;
+   return next;
+}
+
+static void pidcc_wait (int usec) {
+
+   // In threaded mode, the clients belong to the ingest thread.
+   if (!DccThreaded) {
+      long long resume = pidcc_resume ();
+      if ((resume >= 0) && (resume < usec)) usec = (int)resume;
+      int flush = pidcc_flush ();
+      if ((flush >= 0) && (flush < usec)) usec = flush;
+   }
+
+   struct epoll_event events[DCCMAXCLIENTS+4];
+   int count;
+   long long deadline = -1;
+
+   if (pidcc_clock_isvirtual ()) {
+      // The time stands still while the script is being read, whatever
+      // the speed of the writer: it only moves forward when the console
+      // is paused by a sleep command, or gone.
+      int reading = (DccConsole->input >= 0) &&
+                    (!DccConsole->paused) && (!DccConsole->held);
+      count = epoll_wait (DccEpoll, events, DCCMAXCLIENTS+4, reading ? -1 : 0);
+      if (count <= 0) {
+         pidcc_clock_advance ((usec > 0) ? usec : 1);
+         return;
+      }
+   } else {
+      struct itimerspec timer;
+      timer.it_interval.tv_sec = 0;
+      timer.it_interval.tv_nsec = 0;
+      timer.it_value.tv_sec = usec / 1000000;
+      timer.it_value.tv_nsec = ((usec % 1000000) * 1000) + 1; // Never 0.
+      timerfd_settime (DccTimer, 0, &timer, 0);
+      deadline = pidcc_clock_now () + usec;
+
+      count = epoll_wait (DccEpoll, events, DCCMAXCLIENTS+4, -1);
+   }
+   pidcc_debug ("waking up");
+
+   int i;
+   uint64_t value;
+   for (i = 0; i < count; ++i) {
+      int fd = events[i].data.fd;
+      if ((fd == DccTimer) || (fd == DccNotify)) {
+         if (read (fd, &value, sizeof(value)) < 0) continue;
+         if ((fd == DccTimer) && (deadline >= 0)) pidcc_late (deadline);
+      } else if (DccShared && (fd == pidcc_shm_doorbell ())) {
+         pidcc_shm_answer (); // The ring is checked on every iteration.
+      } else if (DccThreaded && (fd == pidcc_spsc_doorbell (&DccRequests))) {
+         pidcc_spsc_answer (&DccRequests);
+         DccRequest *request;
+         while ((request = pidcc_spsc_next (&DccRequests))) {
+            pidcc_apply (request);
+            pidcc_spsc_release (&DccRequests);
+         }
+      } else {
+         pidcc_dispatch (fd);
+      }
+   }
+}
+
+// The main thread's loop in threaded mode: only deal with the clients.
+//
+static void pidcc_ingestLoop (void) {
+
+   struct epoll_event events[DCCMAXCLIENTS+4];
+
+   for (;;) {
+      long long resume = pidcc_resume ();
+      int flush = pidcc_flush ();
+      if ((flush >= 0) && ((resume < 0) || (flush < resume))) resume = flush;
+      int timeout = (resume < 0) ? -1 : (int)((resume + 999) / 1000);
+      int count = epoll_wait (DccInputEpoll, events, DCCMAXCLIENTS+4, timeout);
+      int i;
+      for (i = 0; i < count; ++i) pidcc_dispatch (events[i].data.fd);
+   }
+}
+
+// Write the metrics file, when due. Return the time until the next one,
+// in microseconds, or -1 if there is no metrics file.
+//
+static int pidcc_metrics (void) {
+
+   if (!DccMetricsPath) return -1;
+
+   long long now = pidcc_clock_now ();
+   if (now >= DccMetricsNext) {
+      pidcc_gauges ();
+      const char *error = pidcc_telemetry_export (DccMetricsPath);
+      if (error && (error != DccMetricsError)) {
+         DccCurrent = DccConsole;
+         pidcc_error (error); // Only once, not every period.
+      }
+      DccMetricsError = error;
+      DccMetricsNext = now + DCCMETRICSPERIOD;
+   }
+   return (int)(DccMetricsNext - now);
+}
+
+// Follow the packet just dequeued until it is on the track. This covers
+// the packets from the clients only, not the refresh or IDLE packets.
+//
+static unsigned int pidcc_follow (const unsigned char *data, int length) {
+   return pidcc_latency_open (DccOwner - DccClients, data, length,
+                              DccOwnerReceived, DccOwnerQueued);
+}
+
+// Report the packets that completed, to the clients that asked for it.
+//
+static void pidcc_traced (void) {
+
+   const PidccLatency *packet;
+   DccClient *previous = DccCurrent;
+
+   while ((packet = pidcc_latency_completed ())) {
+      DccClient *client = DccClients + packet->owner;
+      if (!client->trace) continue;
+
+      char text[256];
+      int cursor = snprintf (text, sizeof(text), "packet");
+      int i;
+      for (i = 0; i < packet->length; ++i)
+         cursor += snprintf (text+cursor, sizeof(text)-cursor,
+                             " %02x", packet->data[i]);
+      snprintf (text+cursor, sizeof(text)-cursor,
+                ": queue %lld, build %d, track %lld, total %lld, "
+                "repeat %lld (usec)",
+                packet->scheduled - packet->received, packet->building,
+                packet->started - packet->scheduled,
+                packet->started - packet->received,
+                packet->ended - packet->started);
+      DccCurrent = client;
+      pidcc_report (text);
+   }
+   DccCurrent = previous;
+}
+
 static void pidcc_eventLoop (void) {
 
-   const struct timeval idletimeout = {1, 0};
-   const struct timeval busytimeout = {0, 2000};
-   const struct timeval pausetimeout = {0, 5000};
+   const int idletimeout = 1000000; // Nothing to do, just check.
 
    int busy = 0; // Detect changes of state.
    int userpacket = 0;
@@ -342,13 +1705,11 @@ static void pidcc_eventLoop (void) {
 
    struct timeval deadline = {0, 0};
    struct timeval pauseend = {0, 0};
-   struct timeval timeout = idletimeout;
 
    for (;;) {
-      fd_set read;
 
-      FD_ZERO(&read);
-      FD_SET(DccCommandChannel, &read);
+      int idle = 0;
+      int timeout = idletimeout;
 
       switch (pidcc_wave_state()) {
 
@@ -356,111 +1717,327 @@ static void pidcc_eventLoop (void) {
 
          if (!busy) pidcc_busy ("Starting");
          busy = 1;
-         timeout = powercycle ? idletimeout : busytimeout;
          break;
 
       case PIDCC_TRANSMITTING:
 
          if (!busy) pidcc_busy ("Transmitting");
          busy = 1;
-         timeout = powercycle ? idletimeout : busytimeout;
          break;
 
       case PIDCC_IDLE:
 
          // Defaults, unless a new packet is transmitted.
-         timeout = idletimeout;
          powercycle = 0;
 
          deadline.tv_usec = 0;
 
-         unsigned char *data;
-         int programming;
-         int length = pidcc_dequeue (&data, &programming);
-         if (length > 0) {
-            const char *error = pidcc_wave_send (programming, data, length);
-            if (error) {
-               pidcc_error (error);
-               deadline.tv_sec = 0;
-               deadline.tv_usec = 0;
-            } else {
-               gettimeofday (&deadline, 0);
-               pidcc_delay (&deadline, pidcc_wave_microseconds ());
-               pidcc_busy ("transmitting..");
-               timeout = busytimeout;
-            }
-            userpacket = 1;
-            busy = 1;
-         } else if (length == 0) {
-            const char *error = pidcc_wave_off (programming);
-            if (error) {
-                pidcc_error (error);
-                deadline.tv_sec = 0;
-                deadline.tv_usec = 0;
-            } else {
-                gettimeofday (&deadline, 0);
-                pidcc_delay (&deadline, programming * 1000000);
-                pidcc_busy ("transmitting..");
-                timeout = idletimeout;
-                powercycle = 1;
-            }
-            userpacket = 1;
-            busy = 1;
+         struct timeval now;
+         pidcc_monotonic (&now);
+
+         if (pidcc_pending () || pidcc_schedule_pending ()) {
+            idle = 1; // The queue is served below.
          } else if (busy) {
             if (userpacket) pidcc_idle (0);
             if (ActiveIdle) {
                if (userpacket) {
-                  gettimeofday (&pauseend, 0);
-                  pidcc_delay (&pauseend, 15000); // Time from end to start
+                  pauseend = now;
+                  pidcc_delay (&pauseend, // Time from end to start
+                               pidcc_tuning_get (PIDCC_TUNING_IDLEGAP));
                }
-               timeout = pausetimeout;
+               timeout = pidcc_until (&now, &pauseend);
             }
             userpacket = 0;
             busy = 0;
          } else if (ActiveIdle) {
-            struct timeval now;
-            gettimeofday (&now, 0);
             if (pidcc_after (&now, &pauseend)) {
-               pidcc_wave_idle ();
+               // Refresh packets are sent back to back, IDLE packets
+               // are only needed from time to time.
                pauseend = now;
-               pidcc_delay (&pauseend, 25000); // Time from start to start
-               timeout = busytimeout;
+               if (!pidcc_schedule_idle ())
+                  pidcc_delay (&pauseend, // Time from start to start
+                               pidcc_tuning_get (PIDCC_TUNING_IDLEPERIOD));
                busy = 1;
             } else {
-               timeout = pausetimeout;
+               timeout = pidcc_until (&now, &pauseend);
             }
          }
       }
 
+      pidcc_shared ();
+
+      // Move the queued packets to the scheduler, which decides in which
+      // order their repeats are transmitted. A power off only starts after
+      // all the previous packets have been sent.
+      //
+      while ((!powercycle) && pidcc_pending ()) {
+
+         unsigned char *data;
+         int programming;
+
+         // Report to the client that queued the packet.
+         DccCurrent = pidcc_serving (pidcc_lane ());
+
+         if (pidcc_poweroff_next ()) {
+            if ((!idle) || pidcc_schedule_pending ()) break;
+            pidcc_dequeue (&data, &programming);
+            const char *error = pidcc_wave_off (programming);
+            if (error) {
+                pidcc_error (error);
+            } else {
+                pidcc_clock_timeofday (&deadline);
+                pidcc_delay (&deadline, programming * 1000000);
+                pidcc_busy ("transmitting..");
+                powercycle = 1;
+                idle = 0;
+            }
+         } else if (pidcc_lane () == DCCLANEEMERGENCY) {
+            int length = pidcc_dequeue (&data, &programming);
+            const char *error =
+               pidcc_schedule_urgent (data, length, pidcc_follow (data, length));
+            if (error) {
+               pidcc_error (error);
+            } else {
+               if (DccOwner == DccShared) pidcc_shm_complete (DccOwnerSequence);
+               if (!DccOwner->framed) pidcc_busy ("transmitting..");
+               idle = 0;
+            }
+         } else {
+            if (!pidcc_schedule_room (pidcc_programming_next ())) break;
+            int length = pidcc_dequeue (&data, &programming);
+            const char *error =
+               pidcc_schedule_add (programming, data, length,
+                                   pidcc_follow (data, length));
+            if (error) {
+               pidcc_error (error);
+            } else {
+               if (DccOwner == DccShared) pidcc_shm_complete (DccOwnerSequence);
+               if (!DccOwner->framed) pidcc_busy ("transmitting..");
+               idle = 0;
+            }
+         }
+         userpacket = 1;
+         busy = 1;
+      }
+      DccCurrent = DccOwner;
+
+      pidcc_traced ();
+
+      // Keep the transmit ring filled, so that the next packet is ready
+      // when the current one ends.
+      //
+      if (pidcc_schedule_pending ()) {
+         const char *error = pidcc_schedule_transmit ();
+         if (error) pidcc_error (error);
+         pidcc_clock_timeofday (&deadline);
+         pidcc_delay (&deadline, pidcc_wave_microseconds ());
+      }
+
+      // Wake up exactly when the wave module expects the next transition.
+      int wakeup = pidcc_wave_wakeup ();
+      if ((wakeup >= 0) && (wakeup < timeout)) timeout = wakeup;
+
+      // The clients ring the doorbell of the shared memory ring, but
+      // they can only get it through the local socket.
+      if (DccShared && (DccSocketListener < 0) && (timeout > DCCSHMPOLL))
+         timeout = DCCSHMPOLL;
+
+      int metrics = pidcc_metrics ();
+      if ((metrics >= 0) && (metrics < timeout)) timeout = metrics;
+
       if (Debug) {
          char text[1024];
          if (deadline.tv_usec) {
-            snprintf (text, sizeof(text), "waiting for %lld.%06d seconds, transmission ends at %lld.%06d...",
-                      (long long)(timeout.tv_sec), (int)(timeout.tv_usec),
+            snprintf (text, sizeof(text), "waiting for %d.%06d seconds, transmission ends at %lld.%06d...",
+                      timeout / 1000000, timeout % 1000000,
                       (long long)(deadline.tv_sec), (int)(deadline.tv_usec));
          } else {
-            snprintf (text, sizeof(text), "waiting for %lld.%06d seconds...",
-                      (long long)(timeout.tv_sec), (int)(timeout.tv_usec));
+            snprintf (text, sizeof(text), "waiting for %d.%06d seconds...",
+                      timeout / 1000000, timeout % 1000000);
          }
          pidcc_debug (text);
       }
-      int status = select (DccCommandChannel+1, &read, 0, 0, &timeout);
-      pidcc_debug ("waking up");
-      if (status > 0) {
-         if (FD_ISSET(DccCommandChannel, &read)) {
-            pidcc_debug ("received input");
-            pidcc_input ();
-         }
-      }
+      DccCurrent = DccConsole;
+      pidcc_wait (timeout);
    }
 }
 
+// Lock all the memory, present and future: a page fault in the event loop
+// is a late wakeup. The static buffers, i.e. most of pidcc, are faulted
+// in by the lock itself.
+//
+static void pidcc_lock (void) {
+   if (mlockall (MCL_CURRENT | MCL_FUTURE))
+      pidcc_error ("cannot lock the memory");
+}
 
-int main (int argc, const char **argv) {
+static int pidcc_prefault (void) {
+   volatile char stack[DCCSTACKPREFAULT];
+   int i;
+   for (i = 0; i < DCCSTACKPREFAULT; i += 4096) stack[i] = 0;
+   return stack[0];
+}
+
+// Move the calling thread, which is about to run the transmitter, to its
+// CPU and to its real-time priority, if any. The threads started later
+// by pigpio inherit both.
+//
+static void pidcc_realtime (void) {
+
+   if (DccTransmitCpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO (&cpus);
+      CPU_SET (DccTransmitCpu, &cpus);
+      if (pthread_setaffinity_np (pthread_self (), sizeof(cpus), &cpus))
+         pidcc_error ("cannot pin the transmit thread");
+   }
+   if (!DccRealtime) return;
 
-   // TBD: decode argument, setup communications.
+   struct sched_param parameters;
+   memset (&parameters, 0, sizeof(parameters));
+   parameters.sched_priority = DccRealtime;
+   if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &parameters))
+      pidcc_error ("cannot set the real-time priority");
+   pidcc_prefault ();
+}
 
-   nice (-20);
+static void *pidcc_transmitThread (void *context) {
+   pidcc_realtime ();
    pidcc_eventLoop ();
+   return 0;
 }
 
+int main (int argc, const char **argv) {
+
+   int i;
+   for (i = 1; i < argc; ++i) {
+      if (!strncmp (argv[i], "--socket=", 9)) {
+         DccSocketPath = argv[i] + 9;
+      } else if (!strncmp (argv[i], "--tcp=", 6)) {
+         DccTcpPort = atoi (argv[i] + 6);
+      } else if (!strncmp (argv[i], "--shm=", 6)) {
+         DccShmName = argv[i] + 6;
+      } else if (!strncmp (argv[i], "--shm-group=", 12)) {
+         DccShmGroup = argv[i] + 12;
+      } else if (!strncmp (argv[i], "--metrics=", 10)) {
+         DccMetricsPath = argv[i] + 10;
+      } else if (!strcmp (argv[i], "--threads")) {
+         DccThreaded = 1;
+      } else if (!strncmp (argv[i], "--threads=", 10)) {
+         DccThreaded = 1;
+         DccTransmitCpu = atoi (argv[i] + 10);
+      } else if (!strncmp (argv[i], "--tuning=", 9)) {
+         DccTuningPath = argv[i] + 9;
+      } else if (!strncmp (argv[i], "--cpu=", 6)) {
+         DccTransmitCpu = atoi (argv[i] + 6);
+      } else if (!strcmp (argv[i], "--realtime")) {
+         DccRealtime = DCCREALTIMEPRIORITY;
+      } else if (!strncmp (argv[i], "--realtime=", 11)) {
+         DccRealtime = atoi (argv[i] + 11);
+         if ((DccRealtime < sched_get_priority_min (SCHED_FIFO)) ||
+             (DccRealtime > sched_get_priority_max (SCHED_FIFO))) {
+            fprintf (stderr, "invalid real-time priority %s\n", argv[i] + 11);
+            return 1;
+         }
+#ifdef PIDCC_SIMULATION
+      } else if (!strcmp (argv[i], "--virtual")) {
+         pidcc_clock_virtual ();
+#endif
+      } else {
+         fprintf (stderr, "usage: pidcc [--socket=PATH] [--tcp=PORT] "
+                          "[--shm=NAME] [--shm-group=GROUP] "
+                          "[--metrics=PATH] [--threads[=CPU]] "
+                          "[--cpu=CPU] [--realtime[=PRIORITY]] "
+                          "[--tuning=PATH]"
+#ifdef PIDCC_SIMULATION
+                          " [--virtual]"
+#endif
+                          "\n");
+         return 1;
+      }
+   }
+   if (DccThreaded && pidcc_clock_isvirtual ()) {
+      fprintf (stderr, "virtual time requires a single thread\n");
+      return 1;
+   }
+
+   for (i = 0; i < DCCMAXCLIENTS; ++i) {
+      DccClients[i].input = -1;
+      DccClients[i].output = -1;
+   }
+   DccConsole->input = 0;
+   DccConsole->output = 1;
+   DccConsole->weight = 1;
+   pidcc_outbox_open (0, DccConsole->output);
+
+   // The default tuning profile is optional, an explicit one is not.
+   if (DccTuningPath || (access (PIDCC_TUNING_PATH, R_OK) == 0)) {
+      const char *path = DccTuningPath ? DccTuningPath : PIDCC_TUNING_PATH;
+      const char *error = pidcc_tuning_load (path);
+      if (error) pidcc_error (error);
+   }
+
+   DccIngesting = 1;
+
+   DccEpoll = epoll_create1 (0);
+   DccTimer = timerfd_create (CLOCK_MONOTONIC, 0);
+   DccInputEpoll = DccThreaded ? epoll_create1 (0) : DccEpoll;
+   if ((DccEpoll < 0) || (DccTimer < 0) || (DccInputEpoll < 0)) {
+      pidcc_error ("cannot create the event loop");
+      return 1;
+   }
+   pidcc_listen (DccTimer);
+   pidcc_attach (DccConsole->input);
+
+   if (DccSocketPath) {
+      const char *error = pidcc_server_unix (DccSocketPath, &DccSocketListener);
+      if (error) pidcc_error (error);
+      else pidcc_attach (DccSocketListener);
+   }
+   if (DccTcpPort) {
+      const char *error = pidcc_server_tcp (DccTcpPort, &DccTcpListener);
+      if (error) pidcc_error (error);
+      else pidcc_attach (DccTcpListener);
+   }
+   if (DccShmName) {
+      const char *error = pidcc_shm_open (DccShmName, DccShmGroup);
+      if (error) {
+         pidcc_error (error);
+      } else {
+         DccShared = DccClients + DCCMAXCLIENTS - 1;
+         DccShared->shared = 1;
+         DccShared->weight = 1;
+         pidcc_listen (pidcc_shm_doorbell ());
+      }
+   }
+
+   nice (-20); // Inherited by the transmit thread.
+   if (DccRealtime) pidcc_lock ();
+
+   if (!DccThreaded) {
+      pidcc_realtime ();
+      pidcc_eventLoop ();
+      return 0;
+   }
+
+   const char *error =
+      pidcc_spsc_create (&DccRequests, 1024, sizeof(DccRequest));
+   if (!error)
+      error = pidcc_spsc_create (&DccStatus, 256, sizeof(DccStatusLine));
+   if (error) {
+      pidcc_error (error);
+      return 1;
+   }
+   pidcc_listen (pidcc_spsc_doorbell (&DccRequests));
+   pidcc_attach (pidcc_spsc_doorbell (&DccStatus));
+
+   pthread_t transmit;
+   if (pthread_create (&transmit, 0, pidcc_transmitThread, 0)) {
+      pidcc_error ("cannot start the transmit thread");
+      return 1;
+   }
+   pidcc_ingestLoop ();
+   return 0;
+}
+
+
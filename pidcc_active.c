@@ -0,0 +1,246 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_active.c - The active packets of a district, and their order.
+ *
+ * This module holds the packets whose repeats are being transmitted on
+ * one district, and decides in which order these repeats go out. It is
+ * used by pidcc_schedule.c for district 0 and by pidcc_district.c for the
+ * extra districts, so that both follow the same rules:
+ *
+ * - The packets are kept in queue order, urgent packets first.
+ *
+ * - The repeats of packets sent to different decoders are interleaved,
+ *   in round robin order, and a separator is only needed when the same
+ *   decoder comes up twice in a row.
+ *
+ * - A packet is only transmitted once all previous packets to the same
+ *   decoder have been fully transmitted.
+ *
+ * - Programming packets are never interleaved: they are sent one at a
+ *   time, in queue order. The packets after a programming packet wait
+ *   until it has been fully transmitted.
+ *
+ * - Urgent packets do not wait, not even for the separator: the decoder
+ *   might miss the first repeat, but not the next ones.
+ *
+ * The caller decides how many packets a queue may hold (at most
+ * PIDCC_ACTIVESIZE, plus PIDCC_ACTIVEURGENT urgent ones) and what happens
+ * to the packets that are removed.
+ *
+ * void pidcc_active_clear (PidccActive *queue);
+ *
+ *    Discard all the packets, and forget the last transmission.
+ *
+ * int pidcc_active_superseded (const PidccActive *queue,
+ *                              const unsigned char *data, int length);
+ *
+ *    Return the index of the active operations packet that the new packet
+ *    supersedes (same decoder, same class, see pidcc_packet.c), or -1.
+ *
+ * int pidcc_active_obsolete (const PidccActive *queue,
+ *                            const unsigned char *data, int length);
+ *
+ *    Return the index of the last active operations packet that the
+ *    emergency stop makes obsolete, or -1.
+ *
+ * int pidcc_active_append (PidccActive *queue);
+ *
+ *    Add an entry at the end of the queue. Return its index, or -1 if
+ *    the queue is full.
+ *
+ * int pidcc_active_insert (PidccActive *queue);
+ *
+ *    Add an entry after the urgent packets already active, using the room
+ *    reserved for urgent packets if needed. Return its index, or -1 if the
+ *    queue is full.
+ *
+ * void pidcc_active_fill (PidccActive *queue, int index,
+ *                         int programming, int urgent,
+ *                         const unsigned char *data, int length,
+ *                         unsigned int trace);
+ *
+ *    Set the packet at that index, with a full repeat count. The caller
+ *    has checked that the data fits in PIDCC_ACTIVEDATA bytes.
+ *
+ * int pidcc_active_select (const PidccActive *queue, int *gap);
+ *
+ *    Return the index of the packet to transmit next, or -1 if there is
+ *    nothing to send. Set gap if a separator must come first.
+ *
+ * int pidcc_active_sent (PidccActive *queue, int index, int repeat);
+ *
+ *    Record the transmission of repeats of that packet. Return 1 if the
+ *    packet has been fully transmitted: the caller must then remove it.
+ *
+ * void pidcc_active_remove (PidccActive *queue, int index);
+ *
+ *    Remove the packet at that index.
+ */
+#include <string.h>
+
+#include "pidcc_packet.h"
+#include "pidcc_active.h"
+
+
+void pidcc_active_clear (PidccActive *queue) {
+   queue->count = 0;
+   queue->cursor = 0;
+   queue->last = PIDCC_NOADDRESS;
+}
+
+int pidcc_active_superseded (const PidccActive *queue,
+                             const unsigned char *data, int length) {
+   int i;
+   for (i = 0; i < queue->count; ++i) {
+      const PidccActivePacket *active = queue->packets + i;
+      if (active->urgent || active->programming) continue;
+      if (pidcc_packet_supersedes (data, length,
+                                   active->data, active->length)) return i;
+   }
+   return -1;
+}
+
+int pidcc_active_obsolete (const PidccActive *queue,
+                           const unsigned char *data, int length) {
+   int i;
+   for (i = queue->count - 1; i >= 0; --i) {
+      const PidccActivePacket *active = queue->packets + i;
+      if (active->urgent || active->programming) continue;
+      if (pidcc_packet_stops (data, length, active->data, active->length))
+         return i;
+   }
+   return -1;
+}
+
+int pidcc_active_append (PidccActive *queue) {
+   if (queue->count >= PIDCC_ACTIVESIZE) return -1;
+   return queue->count++;
+}
+
+int pidcc_active_insert (PidccActive *queue) {
+
+   if (queue->count >= PIDCC_ACTIVESIZE+PIDCC_ACTIVEURGENT) return -1;
+
+   int index = 0;
+   while ((index < queue->count) && queue->packets[index].urgent) index++;
+   if (index < queue->count) {
+      memmove (queue->packets + index + 1, queue->packets + index,
+               (queue->count - index) * sizeof(PidccActivePacket));
+   }
+   queue->count += 1;
+   if (queue->cursor >= index) queue->cursor += 1;
+   return index;
+}
+
+void pidcc_active_fill (PidccActive *queue, int index,
+                        int programming, int urgent,
+                        const unsigned char *data, int length,
+                        unsigned int trace) {
+
+   PidccActivePacket *packet = queue->packets + index;
+
+   packet->address = pidcc_packet_address (data, length);
+   packet->programming = programming;
+   packet->urgent = urgent;
+   packet->remaining = programming ? 6 : 3; // As per the DCC standard.
+   packet->staged = 0;
+   packet->trace = trace;
+   packet->length = length;
+   memcpy (packet->data, data, length);
+}
+
+// A packet is eligible for transmission if it is the oldest active
+// packet for its decoder.
+//
+static int pidcc_active_eligible (const PidccActive *queue, int index) {
+
+   int address = queue->packets[index].address;
+   if (address == PIDCC_NOADDRESS) return 1;
+
+   int i;
+   for (i = 0; i < index; ++i) {
+      if (queue->packets[i].address == address) return 0;
+   }
+   return 1;
+}
+
+int pidcc_active_select (const PidccActive *queue, int *gap) {
+
+   if (queue->count <= 0) return -1;
+
+   const PidccActivePacket *first = queue->packets;
+   int repeated = (first->address != PIDCC_NOADDRESS) &&
+                  (first->address == queue->last);
+   if (first->urgent) {
+      *gap = repeated && (first->remaining < 3);
+      return 0;
+   }
+   if (first->programming) {
+      *gap = repeated;
+      return 0;
+   }
+
+   // Round robin up to the first programming packet, favoring the packets
+   // that do not need a separator.
+   int count = 1;
+   while ((count < queue->count) && !queue->packets[count].programming) count++;
+
+   int i;
+   int fallback = -1;
+   for (i = 0; i < count; ++i) {
+      int index = (queue->cursor + i) % count;
+      if (!pidcc_active_eligible (queue, index)) continue;
+      int address = queue->packets[index].address;
+      if ((address == PIDCC_NOADDRESS) || (address != queue->last)) {
+         *gap = 0;
+         return index;
+      }
+      if (fallback < 0) fallback = index;
+   }
+   *gap = 1;
+   return fallback;
+}
+
+int pidcc_active_sent (PidccActive *queue, int index, int repeat) {
+
+   PidccActivePacket *packet = queue->packets + index;
+
+   queue->last = packet->address;
+   queue->cursor = index + 1;
+
+   packet->remaining -= repeat;
+   if (packet->remaining <= 0) return 1;
+
+   if (queue->cursor >= queue->count) queue->cursor = 0;
+   return 0;
+}
+
+void pidcc_active_remove (PidccActive *queue, int index) {
+
+   queue->count -= 1;
+   if (index < queue->count) {
+      memmove (queue->packets + index, queue->packets + index + 1,
+               (queue->count - index) * sizeof(PidccActivePacket));
+   }
+   if (queue->cursor > index) queue->cursor -= 1;
+   if (queue->cursor >= queue->count) queue->cursor = 0;
+}
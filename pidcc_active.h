@@ -0,0 +1,65 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_active.h - The active packets of a district, and their order.
+ */
+#define PIDCC_ACTIVEDATA 16
+
+// Enough to interleave the packets of a busy layout, plus extra room
+// reserved for urgent packets.
+#define PIDCC_ACTIVESIZE   16
+#define PIDCC_ACTIVEURGENT 4
+
+typedef struct {
+   int address;
+   int programming;
+   int urgent;
+   int remaining;
+   int staged;         // Used by pidcc_schedule.c only.
+   unsigned int trace; // See pidcc_latency.c, 0 if none.
+   int length;
+   unsigned char data[PIDCC_ACTIVEDATA];
+} PidccActivePacket;
+
+typedef struct {
+   PidccActivePacket packets[PIDCC_ACTIVESIZE+PIDCC_ACTIVEURGENT];
+   int count;
+   int cursor; // For round robin.
+   int last;   // Address of the last transmission.
+} PidccActive;
+
+void pidcc_active_clear (PidccActive *queue);
+
+int pidcc_active_superseded (const PidccActive *queue,
+                             const unsigned char *data, int length);
+int pidcc_active_obsolete (const PidccActive *queue,
+                           const unsigned char *data, int length);
+
+int pidcc_active_append (PidccActive *queue);
+int pidcc_active_insert (PidccActive *queue);
+void pidcc_active_fill (PidccActive *queue, int index,
+                        int programming, int urgent,
+                        const unsigned char *data, int length,
+                        unsigned int trace);
+
+int pidcc_active_select (const PidccActive *queue, int *gap);
+int pidcc_active_sent (PidccActive *queue, int index, int repeat);
+void pidcc_active_remove (PidccActive *queue, int index);
@@ -0,0 +1,89 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_clock.c - The time source, real or virtual.
+ *
+ * All the timing decisions in pidcc, and in the simulated backend, are
+ * based on this module. By default this is the system clock. In virtual
+ * mode, time only moves forward when the event loop would otherwise wait:
+ * the wait returns immediately, as if the timeout had expired. This makes
+ * a simulated session run as fast as the computer allows, with the same
+ * results every time.
+ *
+ * long long pidcc_clock_now (void);
+ *
+ *    Return the current time in microseconds (CLOCK_MONOTONIC when real).
+ *
+ * void pidcc_clock_timeofday (struct timeval *now);
+ *
+ *    Return the current time of day, for timestamps. In virtual mode,
+ *    this is the same as pidcc_clock_now(), starting at 0.
+ *
+ * void pidcc_clock_virtual (void);
+ *
+ *    Switch to virtual time, starting at 0. There is no way back.
+ *
+ * int pidcc_clock_isvirtual (void);
+ *
+ *    Return 1 in virtual mode, 0 otherwise.
+ *
+ * void pidcc_clock_advance (long long usec);
+ *
+ *    Move the virtual time forward. This has no effect on real time.
+ */
+#include <time.h>
+
+#include "pidcc_clock.h"
+
+static int DccClockVirtual = 0;
+static long long DccClockNow = 0;
+
+long long pidcc_clock_now (void) {
+
+   if (DccClockVirtual) return DccClockNow;
+
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return ((long long)(now.tv_sec) * 1000000) + (now.tv_nsec / 1000);
+}
+
+void pidcc_clock_timeofday (struct timeval *now) {
+
+   if (DccClockVirtual) {
+      now->tv_sec = DccClockNow / 1000000;
+      now->tv_usec = DccClockNow % 1000000;
+      return;
+   }
+   gettimeofday (now, 0);
+}
+
+void pidcc_clock_virtual (void) {
+   DccClockVirtual = 1;
+   DccClockNow = 0;
+}
+
+int pidcc_clock_isvirtual (void) {
+   return DccClockVirtual;
+}
+
+void pidcc_clock_advance (long long usec) {
+   if (DccClockVirtual && (usec > 0)) DccClockNow += usec;
+}
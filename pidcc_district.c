@@ -0,0 +1,194 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_district.c - A module that queues the packets of the extra districts.
+ *
+ * A district is a separate booster output, driven by its own pair of GPIO
+ * pins. District 0 is the main output: its packets go through the command
+ * queues, pidcc_schedule.c and pidcc_refresh.c as usual. The packets for
+ * districts 1 to PIDCC_DISTRICTS-1 are queued here instead, and the wave
+ * module pulls their bits whenever it builds the wave of a transmission
+ * (see pidcc_wave.c, MULTIPLE DISTRICTS): all the districts transmit at
+ * the same time, from the same pigpio wave.
+ *
+ * Each extra district has its own queue of active packets, served by the
+ * same code as district 0 (see pidcc_active.c): the repeats of packets
+ * sent to different decoders are interleaved, and a separator is only
+ * inserted when the same decoder comes up twice in a row. Programming
+ * packets are never interleaved: they are sent one at a time, in queue
+ * order. There is no refresh of the extra districts.
+ *
+ * const char *pidcc_district_add (int district, int programming,
+ *                                 const unsigned char *data, int length);
+ *
+ *    Add a packet to be transmitted on the specified district. An
+ *    operations packet that supersedes an active packet replaces it.
+ *    Return 0 on success, or an error message on failure.
+ *
+ * const char *pidcc_district_urgent (int district,
+ *                                    const unsigned char *data, int length);
+ *
+ *    Add a packet to be transmitted before any other on that district,
+ *    typically an emergency stop. The active packets that it makes
+ *    obsolete are discarded.
+ *
+ * int pidcc_district_pending (void);
+ *
+ *    Return the number of active packets, for all the extra districts.
+ *
+ * int pidcc_district_next (int district, PidccEncoded *encoded);
+ *
+ *    Encode the next transmission for that district: one repeat of a
+ *    packet, or a 5 ms separator (25 "0" bits). Return 1 if something
+ *    was encoded, 0 if the district has nothing to transmit.
+ *
+ * void pidcc_district_clear (int district);
+ *
+ *    Discard all the packets of that district.
+ *
+ * void pidcc_district_statistics (int district, int *pending, long *sent);
+ *
+ *    Return the number of active packets for that district, and the number
+ *    of packets fully transmitted since the program started.
+ */
+#include "pidcc_packet.h"
+#include "pidcc_encode.h"
+#include "pidcc_active.h"
+#include "pidcc_district.h"
+
+typedef struct {
+   PidccActive queue;
+   long sent;
+} DccDistrict;
+
+static DccDistrict DccDistricts[PIDCC_DISTRICTS];
+static int DccDistrictsReady = 0;
+
+
+static DccDistrict *pidcc_district_get (int district) {
+
+   if ((district <= 0) || (district >= PIDCC_DISTRICTS)) return 0;
+
+   if (!DccDistrictsReady) {
+      int i;
+      for (i = 0; i < PIDCC_DISTRICTS; ++i) {
+         pidcc_active_clear (&DccDistricts[i].queue);
+      }
+      DccDistrictsReady = 1;
+   }
+   return DccDistricts + district;
+}
+
+const char *pidcc_district_add (int district, int programming,
+                                const unsigned char *data, int length) {
+
+   DccDistrict *state = pidcc_district_get (district);
+   if (!state) return "invalid district";
+   if (length > PIDCC_ACTIVEDATA) return "data too long";
+
+   int index = -1;
+   if (!programming)
+      index = pidcc_active_superseded (&state->queue, data, length);
+   if (index < 0) {
+      index = pidcc_active_append (&state->queue);
+      if (index < 0) return "district queue full";
+   }
+   pidcc_active_fill (&state->queue, index, programming, 0, data, length, 0);
+   return 0;
+}
+
+const char *pidcc_district_urgent (int district,
+                                   const unsigned char *data, int length) {
+
+   DccDistrict *state = pidcc_district_get (district);
+   if (!state) return "invalid district";
+   if (length > PIDCC_ACTIVEDATA) return "data too long";
+
+   int index;
+   while ((index = pidcc_active_obsolete (&state->queue, data, length)) >= 0)
+      pidcc_active_remove (&state->queue, index);
+
+   index = pidcc_active_insert (&state->queue);
+   if (index < 0) return "district queue full";
+
+   pidcc_active_fill (&state->queue, index, 0, 1, data, length, 0);
+   return 0;
+}
+
+int pidcc_district_pending (void) {
+   int total = 0;
+   int i;
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) total += DccDistricts[i].queue.count;
+   return total;
+}
+
+int pidcc_district_next (int district, PidccEncoded *encoded) {
+
+   DccDistrict *state = pidcc_district_get (district);
+   if (!state) return 0;
+
+   PidccActive *queue = &state->queue;
+   for (;;) {
+      int gap;
+      int index = pidcc_active_select (queue, &gap);
+      if (index < 0) {
+         queue->last = PIDCC_NOADDRESS;
+         return 0;
+      }
+      if (gap) {
+         encoded->runs[0].bit = 0;
+         encoded->runs[0].count = 25; // 5 ms, see pidcc_wave.c.
+         encoded->count = 1;
+         queue->last = PIDCC_NOADDRESS;
+         return 1;
+      }
+      PidccActivePacket *packet = queue->packets + index;
+      if (pidcc_encode_packet (encoded, packet->programming,
+                               packet->data, packet->length)) {
+         pidcc_active_remove (queue, index); // Cannot be sent.
+         continue;
+      }
+      if (pidcc_active_sent (queue, index, 1)) {
+         pidcc_active_remove (queue, index);
+         state->sent += 1;
+      }
+      return 1;
+   }
+}
+
+void pidcc_district_clear (int district) {
+
+   DccDistrict *state = pidcc_district_get (district);
+   if (state) pidcc_active_clear (&state->queue);
+}
+
+void pidcc_district_statistics (int district, int *pending, long *sent) {
+
+   DccDistrict *state = pidcc_district_get (district);
+   if (!state) {
+      *pending = 0;
+      *sent = 0;
+      return;
+   }
+   *pending = state->queue.count;
+   *sent = state->sent;
+}
@@ -0,0 +1,36 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_district.h - A module that queues the packets of the extra districts.
+ */
+#define PIDCC_DISTRICTS 4 // Including district 0, the main output.
+
+const char *pidcc_district_add (int district, int programming,
+                                const unsigned char *data, int length);
+const char *pidcc_district_urgent (int district,
+                                   const unsigned char *data, int length);
+
+int pidcc_district_pending (void);
+int pidcc_district_next (int district, PidccEncoded *encoded);
+
+void pidcc_district_clear (int district);
+void pidcc_district_statistics (int district, int *pending, long *sent);
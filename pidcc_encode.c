@@ -0,0 +1,153 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_encode.c - A module that encodes DCC packets into bit runs.
+ *
+ * This module converts the data bytes of a DCC packet into the sequence
+ * of bits transmitted on the track: preamble, start bits, data bytes,
+ * error detection byte and stop bit. The result is a list of runs, each
+ * run being a number of consecutive identical bits, independent of how
+ * the signal is actually generated. The wave module converts the runs into
+ * pigpio pulses, and other consumers (simulation, traces) can use them
+ * as is. A bit "1" is two half periods of PIDCC_BIT1_USEC microseconds,
+ * a bit "0" two half periods of PIDCC_BIT0_USEC microseconds.
+ *
+ * Each byte, with its start bit, is expanded through a precomputed table
+ * of runs, instead of one bit at a time.
+ *
+ * const char *pidcc_encode_packet (PidccEncoded *encoded, int programming,
+ *                                  const unsigned char *data, int length);
+ *
+ *    Encode the packet. A programming packet gets a 20 bits preamble,
+ *    other packets get 15 bits (the DCC standard requires 14).
+ *
+ *    Return 0 on success, an error message on failure.
+ *
+ * int pidcc_encode_preamble (int programming);
+ *
+ *    Return the number of preamble bits, always the first run.
+ *
+ * int pidcc_encode_microseconds (const PidccEncoded *encoded);
+ *
+ *    Return the time it takes to transmit the encoded packet.
+ */
+#include <string.h>
+
+#include "pidcc_encode.h"
+
+#define DCCMAXDATA 16
+
+// The runs for a start bit followed by each possible byte value.
+// There are at most 9 runs for 9 bits.
+//
+typedef struct {
+   int count;
+   PidccRun runs[9];
+} DccByteRuns;
+
+static DccByteRuns DccByteTable[256];
+static int DccByteTableReady = 0;
+
+static void pidcc_encode_initialize (void) {
+
+   int value;
+   for (value = 0; value < 256; ++value) {
+      DccByteRuns *entry = DccByteTable + value;
+      entry->count = 1;
+      entry->runs[0].bit = 0; // Start bit.
+      entry->runs[0].count = 1;
+      int mask;
+      for (mask = 0x80; mask > 0; mask >>= 1) {
+         int bit = (value & mask) ? 1 : 0;
+         PidccRun *last = entry->runs + entry->count - 1;
+         if (last->bit == bit) {
+            last->count += 1;
+         } else {
+            last[1].bit = bit;
+            last[1].count = 1;
+            entry->count += 1;
+         }
+      }
+   }
+   DccByteTableReady = 1;
+}
+
+static void pidcc_encode_byte (PidccEncoded *encoded, unsigned char byte) {
+
+   const DccByteRuns *entry = DccByteTable + byte;
+   const PidccRun *runs = entry->runs;
+   int count = entry->count;
+
+   // The start bit is a "0": merge it with the previous run if that one
+   // ends with a "0" too.
+   PidccRun *last = encoded->runs + encoded->count - 1;
+   if (last->bit == 0) {
+      last->count += runs[0].count;
+      runs += 1;
+      count -= 1;
+   }
+   memcpy (last + 1, runs, count * sizeof(PidccRun));
+   encoded->count += count;
+}
+
+const char *pidcc_encode_packet (PidccEncoded *encoded, int programming,
+                                 const unsigned char *data, int length) {
+
+   if (length > DCCMAXDATA) return "DCC packet too long";
+   if (!DccByteTableReady) pidcc_encode_initialize ();
+
+   encoded->runs[0].bit = 1;
+   encoded->runs[0].count = pidcc_encode_preamble (programming);
+   encoded->count = 1;
+
+   unsigned char detect = 0;
+   int i;
+   for (i = 0; i < length; ++i) {
+      pidcc_encode_byte (encoded, data[i]);
+      detect ^= data[i];
+   }
+   pidcc_encode_byte (encoded, detect);
+
+   // Stop bit.
+   PidccRun *last = encoded->runs + encoded->count - 1;
+   if (last->bit == 1) {
+      last->count += 1;
+   } else {
+      last[1].bit = 1;
+      last[1].count = 1;
+      encoded->count += 1;
+   }
+   return 0;
+}
+
+int pidcc_encode_preamble (int programming) {
+   return programming ? 20 : 15;
+}
+
+int pidcc_encode_microseconds (const PidccEncoded *encoded) {
+   int i;
+   int total = 0;
+   for (i = 0; i < encoded->count; ++i) {
+      const PidccRun *run = encoded->runs + i;
+      total += 2 * run->count * (run->bit ? PIDCC_BIT1_USEC : PIDCC_BIT0_USEC);
+   }
+   return total;
+}
@@ -0,0 +1,46 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_encode.h - A module that encodes DCC packets into bit runs.
+ */
+#define PIDCC_BIT1_USEC 58  // Half period of a bit "1".
+#define PIDCC_BIT0_USEC 100 // Half period of a bit "0".
+
+// Enough for a 20 bits preamble, 16 data bytes and the error detection
+// byte, each with its start bit, and the stop bit.
+#define PIDCC_MAXRUNS (1+(9*17)+1)
+
+typedef struct {
+   unsigned char bit;
+   unsigned char count;
+} PidccRun;
+
+typedef struct {
+   int count;
+   PidccRun runs[PIDCC_MAXRUNS];
+} PidccEncoded;
+
+const char *pidcc_encode_packet (PidccEncoded *encoded, int programming,
+                                 const unsigned char *data, int length);
+
+int pidcc_encode_preamble (int programming);
+int pidcc_encode_microseconds (const PidccEncoded *encoded);
+
@@ -0,0 +1,339 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_latency.c - Follow each packet from the client to the track.
+ *
+ * This module records when each packet sent by a client reaches each step
+ * of its way to the track: received from the client, queued, moved to the
+ * scheduler, its wave built, its first bit on the track and the end of
+ * its last repeat. The times come from the other modules, as the packet
+ * goes through them, and are in microseconds (see pidcc_clock.c).
+ *
+ * When a packet is complete, the time spent in each stage is accumulated
+ * in a log-linear histogram (16 buckets per power of 2, i.e. a precision
+ * better than 7%, HDR style), and the packet record is made available to
+ * the caller for per-packet reports:
+ *
+ *    queue    From received to scheduled (client queue).
+ *    build    The time spent building the wave (0 if in the cache).
+ *    track    From scheduled to the first bit on the track.
+ *    total    From received to the first bit on the track.
+ *    repeat   From the first bit to the end of the last repeat.
+ *
+ * The same kind of histogram is kept for the event loop itself:
+ *
+ *    wakeup   How late the event loop woke up after its timer expired.
+ *
+ * Packets are identified by a non-zero ID. An ID of 0 is ignored by all
+ * functions: this is used for the refresh and IDLE packets.
+ *
+ * unsigned int pidcc_latency_open (int owner,
+ *                                  const unsigned char *data, int length,
+ *                                  long long received, long long queued);
+ *
+ *    Start following a packet that is moved to the scheduler. The owner
+ *    is an opaque value for the caller. Return the packet ID.
+ *
+ * void pidcc_latency_built (unsigned int id, long long start);
+ *
+ *    The wave for this packet is ready. The wave build (or cache lookup)
+ *    started at the specified time. Only the first call counts.
+ *
+ * int pidcc_latency_pending (unsigned int id, int segments);
+ *
+ *    That many transmissions of the packet were submitted to the transmit
+ *    ring. Return how many were submitted before, or -1 if the packet is
+ *    not followed.
+ *
+ * void pidcc_latency_started (unsigned int id, long long start);
+ *
+ *    A transmission of the packet started. Only the first call counts.
+ *
+ * void pidcc_latency_ended (unsigned int id, long long end);
+ *
+ *    A transmission of the packet ended, or was discarded.
+ *
+ * void pidcc_latency_submitted (unsigned int id);
+ *
+ *    The last repeat of the packet was submitted: the packet is complete
+ *    when all its pending transmissions have ended.
+ *
+ * void pidcc_latency_drop (unsigned int id);
+ *
+ *    Stop following this packet, which was replaced by a more recent
+ *    packet or discarded.
+ *
+ * void pidcc_latency_wakeup (long long late);
+ *
+ *    The event loop woke up that many microseconds after its deadline.
+ *
+ * const PidccLatency *pidcc_latency_completed (void);
+ *
+ *    Return the next completed packet, or 0 if there is none. The record
+ *    is valid until the next call.
+ *
+ * const char *pidcc_latency_statistics (int stage, long *count,
+ *                                       long long *p50, long long *p90,
+ *                                       long long *p99, long long *max);
+ *
+ *    Return the name of the specified stage (see PIDCC_LATENCY_QUEUE,
+ *    etc.) and its percentiles since the program started, or 0 if the
+ *    stage is not valid.
+ *
+ * long pidcc_latency_dropped (void);
+ *
+ *    Return how many packets were dropped before completion.
+ */
+#include <string.h>
+
+#include "pidcc_clock.h"
+#include "pidcc_latency.h"
+
+// Enough for all the packets in the scheduler and in the transmit ring,
+// and the completed packets not yet reported.
+#define DCCLATENCYSIZE 256
+
+static PidccLatency DccLatency[DCCLATENCYSIZE];
+static unsigned int DccLatencyNext = 1;
+
+#define DCCLATENCYDONE 64
+
+static unsigned int DccLatencyDone[DCCLATENCYDONE];
+static int DccLatencyDoneProducer = 0;
+static int DccLatencyDoneConsumer = 0;
+
+static long DccLatencyDropped = 0;
+
+// Values below 32 have their own bucket, larger values share a bucket
+// with the values that have the same 5 most significant bits.
+//
+#define DCCHISTOSUB     16
+#define DCCHISTOBUCKETS (DCCHISTOSUB * 40)
+
+typedef struct {
+   long count;
+   long long max;
+   long buckets[DCCHISTOBUCKETS];
+} DccHistogram;
+
+static DccHistogram DccHistograms[PIDCC_LATENCY_STAGES];
+
+static const char *DccLatencyNames[PIDCC_LATENCY_STAGES] = {
+   "queue", "build", "track", "total", "repeat", "wakeup"
+};
+
+static int pidcc_latency_bucket (long long value) {
+
+   if (value < 2 * DCCHISTOSUB) return (int)value;
+
+   int shift = 0;
+   while ((value >> shift) >= 2 * DCCHISTOSUB) shift += 1;
+   int index = ((shift + 1) * DCCHISTOSUB) + ((value >> shift) - DCCHISTOSUB);
+   if (index >= DCCHISTOBUCKETS) index = DCCHISTOBUCKETS - 1;
+   return index;
+}
+
+// Return the highest value that falls in the bucket.
+//
+static long long pidcc_latency_value (int index) {
+
+   if (index < 2 * DCCHISTOSUB) return index;
+
+   int shift = (index / DCCHISTOSUB) - 1;
+   long long base = (long long)(DCCHISTOSUB + (index % DCCHISTOSUB)) << shift;
+   return base + (1LL << shift) - 1;
+}
+
+static void pidcc_latency_record (int stage, long long value) {
+
+   DccHistogram *histogram = DccHistograms + stage;
+   if (value < 0) value = 0;
+   histogram->buckets[pidcc_latency_bucket (value)] += 1;
+   histogram->count += 1;
+   if (value > histogram->max) histogram->max = value;
+}
+
+static PidccLatency *pidcc_latency_find (unsigned int id) {
+
+   if (!id) return 0;
+   PidccLatency *record = DccLatency + (id % DCCLATENCYSIZE);
+   if (record->id != id) return 0;
+   return record;
+}
+
+unsigned int pidcc_latency_open (int owner,
+                                 const unsigned char *data, int length,
+                                 long long received, long long queued) {
+
+   unsigned int id = DccLatencyNext++;
+   if (!DccLatencyNext) DccLatencyNext = 1;
+
+   PidccLatency *record = DccLatency + (id % DCCLATENCYSIZE);
+   if (record->id) DccLatencyDropped += 1; // Lost track of that one.
+
+   memset (record, 0, sizeof(PidccLatency));
+   record->id = id;
+   record->owner = owner;
+   if (length > (int)sizeof(record->data)) length = sizeof(record->data);
+   memcpy (record->data, data, length);
+   record->length = length;
+   record->received = received;
+   record->queued = queued;
+   record->scheduled = pidcc_clock_now ();
+   record->built = -1; // Times can be 0 in virtual time.
+   record->started = -1;
+   return id;
+}
+
+void pidcc_latency_built (unsigned int id, long long start) {
+
+   PidccLatency *record = pidcc_latency_find (id);
+   if ((!record) || (record->built >= 0)) return;
+   record->built = pidcc_clock_now ();
+   record->building = (int)(record->built - start);
+}
+
+int pidcc_latency_pending (unsigned int id, int segments) {
+
+   PidccLatency *record = pidcc_latency_find (id);
+   if (!record) return -1;
+   int transmissions = record->transmissions;
+   record->pending += segments;
+   record->transmissions += segments;
+   return transmissions;
+}
+
+void pidcc_latency_started (unsigned int id, long long start) {
+
+   PidccLatency *record = pidcc_latency_find (id);
+   if ((!record) || (record->started >= 0)) return;
+   record->started = start;
+}
+
+static void pidcc_latency_complete (PidccLatency *record) {
+
+   if (record->started < 0) {
+      // Never reached the track (all its transmissions were aborted).
+      pidcc_latency_drop (record->id);
+      return;
+   }
+   pidcc_latency_record (PIDCC_LATENCY_QUEUE,
+                         record->scheduled - record->received);
+   pidcc_latency_record (PIDCC_LATENCY_BUILD, record->building);
+   pidcc_latency_record (PIDCC_LATENCY_TRACK,
+                         record->started - record->scheduled);
+   pidcc_latency_record (PIDCC_LATENCY_TOTAL,
+                         record->started - record->received);
+   pidcc_latency_record (PIDCC_LATENCY_REPEAT,
+                         record->ended - record->started);
+
+   int next = (DccLatencyDoneProducer + 1) % DCCLATENCYDONE;
+   if (next == DccLatencyDoneConsumer) {
+      // Nobody reads the completed packets: forget the oldest.
+      DccLatency[DccLatencyDone[DccLatencyDoneConsumer] % DCCLATENCYSIZE].id = 0;
+      DccLatencyDoneConsumer = (DccLatencyDoneConsumer + 1) % DCCLATENCYDONE;
+   }
+   DccLatencyDone[DccLatencyDoneProducer] = record->id;
+   DccLatencyDoneProducer = next;
+   record->pending = -1; // Completed, waiting to be reported.
+}
+
+void pidcc_latency_ended (unsigned int id, long long end) {
+
+   PidccLatency *record = pidcc_latency_find (id);
+   if ((!record) || (record->pending <= 0)) return;
+   record->ended = end;
+   record->pending -= 1;
+   if (record->submitted && (record->pending == 0))
+      pidcc_latency_complete (record);
+}
+
+void pidcc_latency_submitted (unsigned int id) {
+
+   PidccLatency *record = pidcc_latency_find (id);
+   if ((!record) || (record->pending < 0)) return;
+   record->submitted = 1;
+   if (record->pending == 0) pidcc_latency_complete (record);
+}
+
+void pidcc_latency_drop (unsigned int id) {
+
+   PidccLatency *record = pidcc_latency_find (id);
+   if ((!record) || (record->pending < 0)) return;
+   record->id = 0;
+   DccLatencyDropped += 1;
+}
+
+void pidcc_latency_wakeup (long long late) {
+   pidcc_latency_record (PIDCC_LATENCY_WAKEUP, late);
+}
+
+const PidccLatency *pidcc_latency_completed (void) {
+
+   static PidccLatency completed;
+
+   while (DccLatencyDoneConsumer != DccLatencyDoneProducer) {
+      unsigned int id = DccLatencyDone[DccLatencyDoneConsumer];
+      DccLatencyDoneConsumer = (DccLatencyDoneConsumer + 1) % DCCLATENCYDONE;
+      PidccLatency *record = pidcc_latency_find (id);
+      if (!record) continue;
+      completed = *record;
+      record->id = 0;
+      return &completed;
+   }
+   return 0;
+}
+
+const char *pidcc_latency_statistics (int stage, long *count,
+                                      long long *p50, long long *p90,
+                                      long long *p99, long long *max) {
+
+   if ((stage < 0) || (stage >= PIDCC_LATENCY_STAGES)) return 0;
+
+   DccHistogram *histogram = DccHistograms + stage;
+   long long *percentiles[3] = {p50, p90, p99};
+   long thresholds[3];
+   thresholds[0] = (histogram->count * 50 + 99) / 100;
+   thresholds[1] = (histogram->count * 90 + 99) / 100;
+   thresholds[2] = (histogram->count * 99 + 99) / 100;
+
+   *count = histogram->count;
+   *max = histogram->max;
+   *p50 = *p90 = *p99 = 0;
+
+   long cumulated = 0;
+   int found = 0;
+   int i;
+   for (i = 0; (i < DCCHISTOBUCKETS) && (found < 3); ++i) {
+      cumulated += histogram->buckets[i];
+      while ((found < 3) && (cumulated >= thresholds[found])
+                         && (thresholds[found] > 0)) {
+         long long value = pidcc_latency_value (i);
+         *(percentiles[found++]) = (value > *max) ? *max : value;
+      }
+   }
+   return DccLatencyNames[stage];
+}
+
+long pidcc_latency_dropped (void) {
+   return DccLatencyDropped;
+}
@@ -0,0 +1,68 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_latency.h - Follow each packet from the client to the track.
+ */
+#define PIDCC_LATENCY_QUEUE  0
+#define PIDCC_LATENCY_BUILD  1
+#define PIDCC_LATENCY_TRACK  2
+#define PIDCC_LATENCY_TOTAL  3
+#define PIDCC_LATENCY_REPEAT 4
+#define PIDCC_LATENCY_WAKEUP 5
+#define PIDCC_LATENCY_STAGES 6
+
+typedef struct {
+   unsigned int id;
+   int owner;
+   int length;
+   unsigned char data[16];
+   long long received;
+   long long queued;
+   long long scheduled;
+   long long built;
+   long long started;
+   long long ended;
+   int building;
+   int pending;
+   int transmissions;
+   int submitted;
+} PidccLatency;
+
+unsigned int pidcc_latency_open (int owner,
+                                 const unsigned char *data, int length,
+                                 long long received, long long queued);
+
+void pidcc_latency_built (unsigned int id, long long start);
+int pidcc_latency_pending (unsigned int id, int segments);
+void pidcc_latency_started (unsigned int id, long long start);
+void pidcc_latency_ended (unsigned int id, long long end);
+void pidcc_latency_submitted (unsigned int id);
+void pidcc_latency_drop (unsigned int id);
+
+void pidcc_latency_wakeup (long long late);
+
+const PidccLatency *pidcc_latency_completed (void);
+
+const char *pidcc_latency_statistics (int stage, long *count,
+                                      long long *p50, long long *p90,
+                                      long long *p99, long long *max);
+long pidcc_latency_dropped (void);
+
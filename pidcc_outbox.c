@@ -0,0 +1,374 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_outbox.c - Buffer the status lines until the clients read them.
+ *
+ * A client that reads its status slowly, or not at all, must never delay
+ * the event loop, and with it the DCC signal. Each client (channel) has a
+ * fixed size ring of status lines, written to the client with non-blocking
+ * writes, first when the line is added and then each time the event loop
+ * calls pidcc_outbox_flush(), until the client has read everything.
+ *
+ * When the client falls behind, a state line ('#', '%' or '*') identical
+ * to the previous line still waiting in the ring replaces it: only the
+ * timestamp changes. When the ring fills up, the new lines are dropped,
+ * by severity: the debug lines first, then the state lines, then the
+ * reports. An error line is never dropped for a lesser line: the waiting
+ * lines of lower severity are discarded to make room for it. Only an error
+ * that finds the ring full of errors is lost, and the channel is then
+ * reported as broken, so that the caller can disconnect the client.
+ *
+ * void pidcc_outbox_open (int channel, int fd);
+ *
+ *    Start sending the status lines of this channel to the specified file
+ *    descriptor. Any line left over from a previous client is discarded.
+ *    The descriptor's flags are never changed: it may be shared with the
+ *    parent process (e.g. the standard output). A socket is written with
+ *    MSG_DONTWAIT, anything else only when poll() reports it writable,
+ *    PIPE_BUF bytes at a time.
+ *
+ * void pidcc_outbox_close (int channel);
+ *
+ *    Discard the lines waiting, and stop writing on this channel.
+ *
+ * void pidcc_outbox_append (int channel, const char *line, int length);
+ *
+ *    Add one status line, including its end of line. The severity of the
+ *    line comes from its first character (see pidcc.c).
+ *
+ * int pidcc_outbox_flush (int channel);
+ *
+ *    Write as much as the client accepts without waiting. Return the
+ *    number of bytes still waiting, or -1 if an error line was lost since
+ *    the last call.
+ *
+ * void pidcc_outbox_finish (int channel);
+ *
+ *    Write everything still waiting, waiting for the client if needed (but
+ *    not forever). This is meant to be used on exit only.
+ *
+ * int pidcc_outbox_congested (int channel);
+ *
+ *    Return 1 if the ring is more than half full, i.e. the client should
+ *    not be given more to answer until it reads its status, 0 otherwise.
+ *
+ * long pidcc_outbox_coalesced (void);
+ *
+ *    Return how many state lines were replaced by an identical one.
+ *
+ * const char *pidcc_outbox_dropped (int severity, long *count);
+ *
+ *    Return the name of the specified severity (see PIDCC_OUTBOX_DEBUG,
+ *    etc.) and how many lines of that severity were dropped, or 0 if the
+ *    severity is not valid.
+ */
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "pidcc_outbox.h"
+
+#define DCCOUTBOXCHANNELS 16 // As many as pidcc.c has clients.
+
+#define DCCOUTBOXSIZE 16384 // Bytes, a few hundred status lines.
+
+#define DCCOUTBOXLINE 1024 // Longest line that can be coalesced.
+
+typedef struct {
+   int fd; // -1 when closed.
+   int socket;
+   int broken;
+   int producer;
+   int consumer;
+   int last; // Start of the last line, -1 once it is being written.
+   char ring[DCCOUTBOXSIZE];
+} DccOutbox;
+
+static DccOutbox DccOutboxes[DCCOUTBOXCHANNELS];
+
+static int DccOutboxInitialized = 0;
+
+// How much of the ring each severity may fill.
+static const int DccOutboxLimit[PIDCC_OUTBOX_SEVERITIES] = {
+   DCCOUTBOXSIZE / 2, (DCCOUTBOXSIZE * 3) / 4, (DCCOUTBOXSIZE * 7) / 8,
+   DCCOUTBOXSIZE - 1
+};
+
+static const char *DccOutboxNames[PIDCC_OUTBOX_SEVERITIES] = {
+   "debug", "state", "report", "error"
+};
+
+static long DccOutboxDropped[PIDCC_OUTBOX_SEVERITIES];
+static long DccOutboxCoalesced = 0;
+
+
+static DccOutbox *pidcc_outbox_get (int channel) {
+
+   if (!DccOutboxInitialized) {
+      int i;
+      for (i = 0; i < DCCOUTBOXCHANNELS; ++i) DccOutboxes[i].fd = -1;
+      DccOutboxInitialized = 1;
+   }
+   if ((channel < 0) || (channel >= DCCOUTBOXCHANNELS)) return 0;
+   return DccOutboxes + channel;
+}
+
+static int pidcc_outbox_severity (char category) {
+   switch (category) {
+      case '!': return PIDCC_OUTBOX_ERROR;
+      case '=': return PIDCC_OUTBOX_REPORT;
+      case '$': return PIDCC_OUTBOX_DEBUG;
+   }
+   return PIDCC_OUTBOX_STATE;
+}
+
+static int pidcc_outbox_used (const DccOutbox *box) {
+   return (box->producer - box->consumer + DCCOUTBOXSIZE) % DCCOUTBOXSIZE;
+}
+
+static void pidcc_outbox_put (DccOutbox *box, const char *data, int length) {
+
+   int split = DCCOUTBOXSIZE - box->producer;
+   if (split > length) split = length;
+   memcpy (box->ring + box->producer, data, split);
+   memcpy (box->ring, data + split, length - split);
+   box->producer = (box->producer + length) % DCCOUTBOXSIZE;
+}
+
+static void pidcc_outbox_copy (const DccOutbox *box,
+                               int from, int length, char *data) {
+
+   int split = DCCOUTBOXSIZE - from;
+   if (split > length) split = length;
+   memcpy (data, box->ring + from, split);
+   memcpy (data + split, box->ring, length - split);
+}
+
+// The text of a status line, i.e. what follows the timestamp.
+//
+static const char *pidcc_outbox_text (const char *line, int length) {
+
+   const char *end = line + length;
+   const char *cursor = memchr (line, ' ', length);
+   if (cursor) cursor = memchr (cursor + 1, ' ', end - cursor - 1);
+   return cursor ? cursor : line;
+}
+
+// Return 1 if the new line repeats the last line still waiting, which is
+// then removed to be replaced.
+//
+static int pidcc_outbox_coalesce (DccOutbox *box,
+                                  const char *line, int length) {
+
+   if (box->last < 0) return 0;
+   if (pidcc_outbox_severity (line[0]) != PIDCC_OUTBOX_STATE) return 0;
+
+   char last[DCCOUTBOXLINE];
+   int size = (box->producer - box->last + DCCOUTBOXSIZE) % DCCOUTBOXSIZE;
+   if (size > (int)sizeof(last)) return 0;
+   pidcc_outbox_copy (box, box->last, size, last);
+   if (last[0] != line[0]) return 0;
+
+   const char *text = pidcc_outbox_text (line, length);
+   const char *lasttext = pidcc_outbox_text (last, size);
+   int textlength = line + length - text;
+   if (textlength != last + size - lasttext) return 0;
+   if (memcmp (text, lasttext, textlength)) return 0;
+
+   box->producer = box->last;
+   box->last = -1;
+   DccOutboxCoalesced += 1;
+   return 1;
+}
+
+// Make room for an error line: discard every waiting line that is not an
+// error, except the first one, which might be partly written already.
+//
+static void pidcc_outbox_evict (DccOutbox *box) {
+
+   static char linear[DCCOUTBOXSIZE];
+
+   int used = pidcc_outbox_used (box);
+   pidcc_outbox_copy (box, box->consumer, used, linear);
+
+   char *eol = memchr (linear, '\n', used);
+   int length = eol ? (eol - linear + 1) : used;
+   int cursor = length;
+
+   while (cursor < used) {
+      char *line = linear + cursor;
+      eol = memchr (line, '\n', used - cursor);
+      int size = eol ? (eol - line + 1) : (used - cursor);
+      int severity = pidcc_outbox_severity (line[0]);
+      if (severity == PIDCC_OUTBOX_ERROR) {
+         memmove (linear + length, line, size);
+         length += size;
+      } else {
+         DccOutboxDropped[severity] += 1;
+      }
+      cursor += size;
+   }
+   box->producer = box->consumer;
+   pidcc_outbox_put (box, linear, length);
+   box->last = -1;
+}
+
+// A pipe that polls writable accepts PIPE_BUF bytes without blocking.
+//
+static int pidcc_outbox_writable (int fd) {
+   struct pollfd writable;
+   writable.fd = fd;
+   writable.events = POLLOUT;
+   return (poll (&writable, 1, 0) > 0) && (writable.revents & POLLOUT);
+}
+
+void pidcc_outbox_open (int channel, int fd) {
+
+   DccOutbox *box = pidcc_outbox_get (channel);
+   if (!box) return;
+
+   struct stat status;
+   box->socket = (fstat (fd, &status) == 0) && S_ISSOCK(status.st_mode);
+   box->fd = fd;
+   box->broken = 0;
+   box->producer = box->consumer = 0;
+   box->last = -1;
+}
+
+void pidcc_outbox_close (int channel) {
+
+   DccOutbox *box = pidcc_outbox_get (channel);
+   if (!box) return;
+
+   box->fd = -1;
+   box->broken = 0;
+   box->producer = box->consumer = 0;
+   box->last = -1;
+}
+
+void pidcc_outbox_append (int channel, const char *line, int length) {
+
+   DccOutbox *box = pidcc_outbox_get (channel);
+   if ((!box) || (box->fd < 0) || (length <= 0)) return;
+
+   pidcc_outbox_coalesce (box, line, length);
+
+   int severity = pidcc_outbox_severity (line[0]);
+   int used = pidcc_outbox_used (box);
+
+   if (used + length > DccOutboxLimit[severity]) {
+      if (severity == PIDCC_OUTBOX_ERROR) {
+         pidcc_outbox_evict (box);
+         used = pidcc_outbox_used (box);
+      }
+      if (used + length > DccOutboxLimit[severity]) {
+         DccOutboxDropped[severity] += 1;
+         if (severity == PIDCC_OUTBOX_ERROR) box->broken = 1;
+         return;
+      }
+   }
+   box->last = box->producer;
+   pidcc_outbox_put (box, line, length);
+
+   // When the client keeps up, it gets its status right away.
+   if (used == 0) pidcc_outbox_flush (channel);
+}
+
+int pidcc_outbox_flush (int channel) {
+
+   DccOutbox *box = pidcc_outbox_get (channel);
+   if ((!box) || (box->fd < 0)) return 0;
+
+   while (box->consumer != box->producer) {
+      int end = (box->producer > box->consumer) ? box->producer
+                                                : DCCOUTBOXSIZE;
+      int length = end - box->consumer;
+      const char *data = box->ring + box->consumer;
+      int written;
+      if (box->socket) {
+         written = send (box->fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+      } else {
+         if (!pidcc_outbox_writable (box->fd)) break;
+         if (length > PIPE_BUF) length = PIPE_BUF;
+         written = write (box->fd, data, length);
+      }
+
+      if (written < 0) {
+         if (errno == EINTR) continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+         // The client is gone, its status will never be read.
+         box->consumer = box->producer;
+         break;
+      }
+      if (box->last >= 0) {
+         int distance =
+            (box->last - box->consumer + DCCOUTBOXSIZE) % DCCOUTBOXSIZE;
+         if (distance < written) box->last = -1;
+      }
+      box->consumer = (box->consumer + written) % DCCOUTBOXSIZE;
+      if (written < length) break; // The client cannot take more for now.
+   }
+   if (box->consumer == box->producer) box->last = -1;
+
+   if (box->broken) {
+      box->broken = 0;
+      return -1;
+   }
+   return pidcc_outbox_used (box);
+}
+
+void pidcc_outbox_finish (int channel) {
+
+   DccOutbox *box = pidcc_outbox_get (channel);
+   if ((!box) || (box->fd < 0)) return;
+
+   int attempts;
+   for (attempts = 0; attempts < 20; ++attempts) {
+      pidcc_outbox_flush (channel);
+      if (box->consumer == box->producer) return;
+      struct pollfd writable;
+      writable.fd = box->fd;
+      writable.events = POLLOUT;
+      poll (&writable, 1, 100);
+   }
+}
+
+int pidcc_outbox_congested (int channel) {
+
+   DccOutbox *box = pidcc_outbox_get (channel);
+   if (!box) return 0;
+   return pidcc_outbox_used (box) > DCCOUTBOXSIZE / 2;
+}
+
+long pidcc_outbox_coalesced (void) {
+   return DccOutboxCoalesced;
+}
+
+const char *pidcc_outbox_dropped (int severity, long *count) {
+
+   if ((severity < 0) || (severity >= PIDCC_OUTBOX_SEVERITIES)) return 0;
+   *count = DccOutboxDropped[severity];
+   return DccOutboxNames[severity];
+}
@@ -0,0 +1,40 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_outbox.h - Buffer the status lines until the clients read them.
+ */
+#define PIDCC_OUTBOX_DEBUG      0
+#define PIDCC_OUTBOX_STATE      1
+#define PIDCC_OUTBOX_REPORT     2
+#define PIDCC_OUTBOX_ERROR      3
+#define PIDCC_OUTBOX_SEVERITIES 4
+
+void pidcc_outbox_open (int channel, int fd);
+void pidcc_outbox_close (int channel);
+
+void pidcc_outbox_append (int channel, const char *line, int length);
+int  pidcc_outbox_flush (int channel);
+void pidcc_outbox_finish (int channel);
+
+int  pidcc_outbox_congested (int channel);
+
+long pidcc_outbox_coalesced (void);
+const char *pidcc_outbox_dropped (int severity, long *count);
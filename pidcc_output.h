@@ -0,0 +1,34 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_output.h - Select the backend that generates the signal.
+ *
+ * The wave module is written against the pigpio API. When built with
+ * PIDCC_SIMULATION defined, the same API is provided by pidcc_sim.c,
+ * which simulates the transmission in process, so that pidcc can run,
+ * and be tested or profiled, on a computer other than a Raspberry Pi.
+ */
+#ifdef PIDCC_SIMULATION
+#include "pidcc_sim.h"
+#else
+#include <pigpio.h> // Raspberry Pi OS only, not on regular Debian.
+#endif
+
@@ -0,0 +1,172 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_packet.c - A module that decodes the DCC packet headers.
+ *
+ * PiDCC does not need to understand the DCC packets in general, but some
+ * transmission decisions depend on which decoder a packet is sent to.
+ * This module decodes just enough of a packet for that purpose, as
+ * described in encoding.md.
+ *
+ * int pidcc_packet_address (const unsigned char *data, int length);
+ *
+ *    Return a value that identifies the decoder targeted by this packet,
+ *    PIDCC_BROADCAST for the broadcast address, or PIDCC_NOADDRESS for
+ *    the idle packet and the reserved ranges. Short locomotive addresses,
+ *    long locomotive addresses and accessory addresses are mapped to
+ *    separate ranges, so that they never collide.
+ *
+ * int pidcc_packet_class (const unsigned char *data, int length);
+ *
+ *    Return the kind of a packet: PIDCC_CLASS_SPEED for a speed and
+ *    direction instruction, one of the PIDCC_CLASS_Fx_Fy values for a
+ *    function group instruction, PIDCC_CLASS_RESET for a broadcast reset,
+ *    PIDCC_CLASS_ASPECT + n for the aspect of signal head n of an extended
+ *    accessory decoder, PIDCC_CLASS_ACCESSORY + n for output pair n of a
+ *    basic accessory decoder (activation and deactivation are separate
+ *    classes), or PIDCC_CLASS_OTHER. Two packets to the same decoder with
+ *    the same class (other than PIDCC_CLASS_OTHER and PIDCC_CLASS_RESET)
+ *    supersede each other: only the most recent one matters.
+ *
+ * int pidcc_packet_supersedes (const unsigned char *data, int length,
+ *                              const unsigned char *old, int oldlength);
+ *
+ *    Return 1 if the new packet replaces the old one, i.e. they are sent
+ *    to the same decoder and have the same class, 0 otherwise. Broadcast
+ *    packets never replace anything.
+ *
+ * int pidcc_packet_emergency (const unsigned char *data, int length);
+ *
+ *    Return 1 if this is an emergency stop packet, either to one decoder
+ *    or broadcast, 0 otherwise.
+ *
+ * int pidcc_packet_stops (const unsigned char *stop, int stoplength,
+ *                         const unsigned char *data, int length);
+ *
+ *    Return 1 if the emergency stop packet makes the other packet obsolete,
+ *    i.e. the other packet is a speed packet to the same decoder, or any
+ *    speed packet if the emergency stop is a broadcast. Sending that other
+ *    packet after the emergency stop would restart the locomotive.
+ */
+#include "pidcc_packet.h"
+
+int pidcc_packet_address (const unsigned char *data, int length) {
+
+   if (length < 1) return PIDCC_NOADDRESS;
+
+   unsigned char first = data[0];
+
+   if (first == 0) return PIDCC_BROADCAST;
+
+   if (first < 0x80) return first; // 7 bit address.
+
+   if (length < 2) return PIDCC_NOADDRESS;
+
+   if (first < 0xc0) {
+      // Accessory decoder: the 3 most significant bits of the address are
+      // in the second byte, in ones complement (10AAAAAA 1AAA....).
+      int high = ((~data[1]) >> 4) & 0x07;
+      return PIDCC_ACCESSORYADDRESS + (high << 6) + (first & 0x3f);
+   }
+
+   if (first < 0xe8) { // 14 bit address.
+      return PIDCC_LONGADDRESS + ((first & 0x3f) << 8) + data[1];
+   }
+
+   return PIDCC_NOADDRESS; // Reserved, advanced extended or idle.
+}
+
+
+int pidcc_packet_class (const unsigned char *data, int length) {
+
+   int address = pidcc_packet_address (data, length);
+
+   if (address == PIDCC_BROADCAST) {
+      if ((length == 2) && (data[1] == 0)) return PIDCC_CLASS_RESET;
+   }
+   if (address == PIDCC_NOADDRESS) return PIDCC_CLASS_OTHER;
+
+   if (address >= PIDCC_ACCESSORYADDRESS) {
+      // Basic:    10AAAAAA 1AAACDDD
+      // Extended: 10AAAAAA 0AAA0AA1 XXXXXXXX
+      if (data[1] & 0x80) {
+         if (length != 2) return PIDCC_CLASS_OTHER;
+         return PIDCC_CLASS_ACCESSORY + ((data[1] >> 1) & 0x07);
+      }
+      if ((length != 3) || ((data[1] & 0x09) != 0x01)) return PIDCC_CLASS_OTHER;
+      return PIDCC_CLASS_ASPECT + ((data[1] >> 1) & 0x03);
+   }
+
+   int i = (address >= PIDCC_LONGADDRESS) ? 2 : 1;
+   if (i >= length) return PIDCC_CLASS_OTHER;
+
+   unsigned char instruction = data[i];
+
+   if ((instruction & 0xc0) == 0x40) return PIDCC_CLASS_SPEED; // 14/28 steps.
+   if ((instruction == 0x3f) && (i + 1 < length)) return PIDCC_CLASS_SPEED;
+
+   if ((instruction & 0xe0) == 0x80) return PIDCC_CLASS_F0_F4;
+   if ((instruction & 0xf0) == 0xb0) return PIDCC_CLASS_F5_F8;
+   if ((instruction & 0xf0) == 0xa0) return PIDCC_CLASS_F9_F12;
+
+   if (i + 1 < length) {
+      if (instruction == 0xde) return PIDCC_CLASS_F13_F20;
+      if (instruction == 0xdf) return PIDCC_CLASS_F21_F28;
+   }
+   return PIDCC_CLASS_OTHER;
+}
+
+// Return the speed instruction, or -1 if this is not a speed packet.
+//
+static int pidcc_packet_speed (const unsigned char *data, int length) {
+
+   if (pidcc_packet_class (data, length) != PIDCC_CLASS_SPEED) return -1;
+
+   int i = (pidcc_packet_address (data, length) >= PIDCC_LONGADDRESS) ? 2 : 1;
+   if (data[i] == 0x3f) return data[i+1] & 0x7f; // 128 steps.
+   return data[i] & 0x0f; // 14/28 steps, without the intermediate step bit.
+}
+
+int pidcc_packet_emergency (const unsigned char *data, int length) {
+   return pidcc_packet_speed (data, length) == 1; // Emergency stop step.
+}
+
+int pidcc_packet_supersedes (const unsigned char *data, int length,
+                             const unsigned char *old, int oldlength) {
+
+   int class = pidcc_packet_class (data, length);
+   if ((class == PIDCC_CLASS_OTHER) || (class == PIDCC_CLASS_RESET)) return 0;
+   if (class != pidcc_packet_class (old, oldlength)) return 0;
+
+   int address = pidcc_packet_address (data, length);
+   if (address == PIDCC_BROADCAST) return 0;
+   return address == pidcc_packet_address (old, oldlength);
+}
+
+int pidcc_packet_stops (const unsigned char *stop, int stoplength,
+                        const unsigned char *data, int length) {
+
+   if (pidcc_packet_class (data, length) != PIDCC_CLASS_SPEED) return 0;
+
+   int address = pidcc_packet_address (stop, stoplength);
+   if (address == PIDCC_BROADCAST) return 1;
+   return address == pidcc_packet_address (data, length);
+}
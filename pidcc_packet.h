@@ -0,0 +1,50 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_packet.h - A module that decodes the DCC packet headers.
+ */
+#define PIDCC_NOADDRESS -1
+#define PIDCC_BROADCAST 0
+
+// The ranges of pidcc_packet_address() above the short addresses.
+#define PIDCC_LONGADDRESS      0x10000
+#define PIDCC_ACCESSORYADDRESS 0x20000
+
+#define PIDCC_CLASS_OTHER      0
+#define PIDCC_CLASS_SPEED      1
+#define PIDCC_CLASS_F0_F4      2
+#define PIDCC_CLASS_F5_F8      3
+#define PIDCC_CLASS_F9_F12     4
+#define PIDCC_CLASS_F13_F20    5
+#define PIDCC_CLASS_F21_F28    6
+#define PIDCC_CLASS_RESET      7
+#define PIDCC_CLASS_ASPECT     8  // Up to 4 signal heads per decoder.
+#define PIDCC_CLASS_ACCESSORY  12 // Up to 8 outputs (and states) per decoder.
+
+int pidcc_packet_address (const unsigned char *data, int length);
+int pidcc_packet_class (const unsigned char *data, int length);
+
+int pidcc_packet_supersedes (const unsigned char *data, int length,
+                             const unsigned char *old, int oldlength);
+int pidcc_packet_emergency (const unsigned char *data, int length);
+int pidcc_packet_stops (const unsigned char *stop, int stoplength,
+                        const unsigned char *data, int length);
+
@@ -0,0 +1,179 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_refresh.c - A module that refreshes the state of the decoders.
+ *
+ * Decoders may stop a locomotive if they do not receive any packet for
+ * a while, and decoders that lost power (dirty track) forget their speed
+ * and functions. The DCC standard expects the command station to repeat
+ * the speed and function packets of every active locomotive.
+ *
+ * This module learns the most recent speed and function group packets
+ * sent to each locomotive decoder, and provides them back in turn when
+ * there is nothing else to transmit, in place of the IDLE packet. The
+ * client application does not need to repeat these packets itself.
+ *
+ * Each packet ages while waiting, speed packets twice as fast as function
+ * packets: the packet that waited the longest is sent next, and packets
+ * of the same age are served round robin.
+ *
+ * void pidcc_refresh_enable (int enable);
+ *
+ *    Enable or disable the refresh. Disabling the refresh does not clear
+ *    the table: the decoders keep being learned.
+ *
+ * void pidcc_refresh_clear (void);
+ *
+ *    Forget all decoders.
+ *
+ * void pidcc_refresh_learn (const unsigned char *data, int length);
+ *
+ *    Record a packet sent by the client application. Only speed and
+ *    function group packets are recorded, superseding any previous packet
+ *    of the same kind to the same decoder. A broadcast reset clears the
+ *    table, since all decoders return to their default state. A broadcast
+ *    speed packet (e.g. emergency stop) removes all the speed packets,
+ *    so that no locomotive is restarted by a refresh.
+ *
+ * int pidcc_refresh_next (const unsigned char **data);
+ *
+ *    Return the length of the next packet to refresh, or 0 if there is
+ *    none (empty table or refresh disabled).
+ *
+ * int pidcc_refresh_count (void);
+ *
+ *    Return the number of packets in the refresh table.
+ */
+#include <string.h>
+
+#include "pidcc_packet.h"
+#include "pidcc_refresh.h"
+
+#define DCCMAXDATA 16
+
+#define DCCREFRESHSIZE 64
+
+typedef struct {
+   int address;
+   int class;
+   int age;
+   int length;
+   unsigned char data[DCCMAXDATA];
+   unsigned long updated;
+} DccRefreshPacket;
+
+static DccRefreshPacket DccRefreshTable[DCCREFRESHSIZE];
+static int DccRefreshCount = 0;
+static int DccRefreshCursor = 0;
+static int DccRefreshEnabled = 1;
+
+static unsigned long DccRefreshSequence = 0;
+
+
+void pidcc_refresh_enable (int enable) {
+   DccRefreshEnabled = enable;
+}
+
+void pidcc_refresh_clear (void) {
+   DccRefreshCount = 0;
+   DccRefreshCursor = 0;
+}
+
+void pidcc_refresh_learn (const unsigned char *data, int length) {
+
+   if (length > DCCMAXDATA) return;
+
+   int class = pidcc_packet_class (data, length);
+   if ((class == PIDCC_CLASS_OTHER) || (class >= PIDCC_CLASS_ASPECT)) return;
+
+   if (class == PIDCC_CLASS_RESET) {
+      pidcc_refresh_clear ();
+      return;
+   }
+   int address = pidcc_packet_address (data, length);
+
+   int i;
+   if (address == PIDCC_BROADCAST) {
+      if (class != PIDCC_CLASS_SPEED) return;
+      int kept = 0;
+      for (i = 0; i < DccRefreshCount; ++i) {
+         if (DccRefreshTable[i].class == PIDCC_CLASS_SPEED) continue;
+         if (kept < i) DccRefreshTable[kept] = DccRefreshTable[i];
+         kept += 1;
+      }
+      DccRefreshCount = kept;
+      DccRefreshCursor = 0;
+      return;
+   }
+
+   DccRefreshPacket *packet = 0;
+   for (i = 0; i < DccRefreshCount; ++i) {
+      if ((DccRefreshTable[i].address == address) &&
+          (DccRefreshTable[i].class == class)) {
+         packet = DccRefreshTable + i;
+         break;
+      }
+   }
+   if (!packet) {
+      if (DccRefreshCount < DCCREFRESHSIZE) {
+         packet = DccRefreshTable + DccRefreshCount++;
+      } else {
+         // Table full: replace the packet that was updated the longest
+         // time ago, most likely a locomotive no longer in use.
+         packet = DccRefreshTable;
+         for (i = 1; i < DccRefreshCount; ++i) {
+            if (DccRefreshTable[i].updated < packet->updated)
+               packet = DccRefreshTable + i;
+         }
+      }
+      packet->address = address;
+      packet->class = class;
+   }
+   packet->age = 0; // Just transmitted.
+   packet->length = length;
+   memcpy (packet->data, data, length);
+   packet->updated = ++DccRefreshSequence;
+}
+
+int pidcc_refresh_next (const unsigned char **data) {
+
+   if ((!DccRefreshEnabled) || (DccRefreshCount <= 0)) return 0;
+
+   int i;
+   int selected = -1;
+   for (i = 0; i < DccRefreshCount; ++i) {
+      int index = (DccRefreshCursor + i) % DccRefreshCount;
+      DccRefreshPacket *packet = DccRefreshTable + index;
+      packet->age += (packet->class == PIDCC_CLASS_SPEED) ? 2 : 1;
+      if ((selected < 0) || (packet->age > DccRefreshTable[selected].age))
+         selected = index;
+   }
+   DccRefreshTable[selected].age = 0;
+   DccRefreshCursor = (selected + 1) % DccRefreshCount;
+
+   *data = DccRefreshTable[selected].data;
+   return DccRefreshTable[selected].length;
+}
+
+int pidcc_refresh_count (void) {
+   return DccRefreshCount;
+}
+
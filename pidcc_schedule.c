@@ -0,0 +1,259 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_schedule.c - A module that decides the order of transmissions.
+ *
+ * This module sits between the command queue and the wave module. It takes
+ * packets in the order they were queued, and decides in which order their
+ * repeats are transmitted.
+ *
+ * The DCC standard requires a 5 ms gap only between two packets sent to
+ * the same decoder. Instead of sending all the repeats of a packet back
+ * to back, with a 5 ms separator between each, this module interleaves the
+ * repeats of packets sent to different decoders, and only inserts the
+ * separator when the same decoder comes up twice in a row.
+ *
+ * The order of packets sent to the same decoder is preserved: a packet is
+ * only transmitted once all previous packets to the same decoder have been
+ * fully transmitted. Programming packets are never interleaved: they are
+ * sent one at a time, in queue order, as the programming sequences expect.
+ * These rules are implemented in pidcc_active.c, which the extra districts
+ * use as well (see pidcc_district.c).
+ *
+ * In chain mode, each packet is submitted with all its repeats at once.
+ *
+ * const char *pidcc_schedule_add (int programming,
+ *                                 const unsigned char *data, int length,
+ *                                 unsigned int trace);
+ *
+ *    Add a packet to be transmitted. Return 0 on success, or an error
+ *    message on failure. The trace is the packet ID in pidcc_latency.c,
+ *    or 0. A packet replaced or discarded is dropped from pidcc_latency.c.
+ *
+ * const char *pidcc_schedule_urgent (const unsigned char *data, int length,
+ *                                    unsigned int trace);
+ *
+ *    Add a packet to be transmitted before any other, typically an
+ *    emergency stop. This always succeeds, unless the scheduler is
+ *    flooded with urgent packets. The active packets that the emergency
+ *    stop makes obsolete are discarded.
+ *
+ *    An operations packet that supersedes an active packet (same decoder,
+ *    same class, see pidcc_packet.c) replaces it in place, and its repeat
+ *    count starts over.
+ *
+ * int pidcc_schedule_room (int programming);
+ *
+ *    Return 1 if a new packet of the specified type can be added, 0
+ *    otherwise.
+ *
+ * int pidcc_schedule_pending (void);
+ *
+ *    Return the number of packets not fully submitted to the wave module.
+ *
+ * const char *pidcc_schedule_transmit (void);
+ *
+ *    Submit as many transmissions as the wave module accepts. Return 0
+ *    on success, or an error message on failure. A packet that failed
+ *    is discarded.
+ *    The waves of the packets that must wait are built ahead of time,
+ *    one per call, while the transmitter is busy.
+ *
+ * long pidcc_schedule_coalesced (void);
+ *
+ *    Return how many packets replaced an active packet.
+ *
+ * int pidcc_schedule_idle (void);
+ *
+ *    Submit a refresh packet, or a DCC IDLE packet if there is nothing to
+ *    refresh. Return 1 if a refresh packet was submitted, 0 otherwise.
+ *    No refresh is sent after a programming packet, until the next
+ *    operations mode packet: a decoder in service mode must see only
+ *    service mode and reset packets.
+ */
+#include "pidcc_packet.h"
+#include "pidcc_wave.h"
+#include "pidcc_refresh.h"
+#include "pidcc_latency.h"
+#include "pidcc_active.h"
+#include "pidcc_schedule.h"
+
+// The active packets, see pidcc_active.c.
+static PidccActive DccScheduled = {.last = PIDCC_NOADDRESS};
+
+static int DccScheduleServiceMode = 0;
+
+static long DccScheduleCoalesced = 0;
+
+
+const char *pidcc_schedule_add (int programming,
+                                const unsigned char *data, int length,
+                                unsigned int trace) {
+
+   if (length > PIDCC_ACTIVEDATA) {
+      pidcc_latency_drop (trace);
+      return "data too long";
+   }
+
+   int index = -1;
+   if (!programming) {
+      index = pidcc_active_superseded (&DccScheduled, data, length);
+      if (index >= 0) {
+         pidcc_latency_drop (DccScheduled.packets[index].trace);
+         DccScheduleCoalesced += 1;
+      }
+   }
+   if (index < 0) {
+      if (pidcc_schedule_room (programming))
+         index = pidcc_active_append (&DccScheduled);
+      if (index < 0) {
+         pidcc_latency_drop (trace);
+         return "scheduler full";
+      }
+   }
+   pidcc_active_fill (&DccScheduled, index, programming, 0,
+                      data, length, trace);
+
+   DccScheduleServiceMode = programming;
+   if (!programming) pidcc_refresh_learn (data, length);
+   return 0;
+}
+
+const char *pidcc_schedule_urgent (const unsigned char *data, int length,
+                                   unsigned int trace) {
+
+   if (length > PIDCC_ACTIVEDATA) {
+      pidcc_latency_drop (trace);
+      return "data too long";
+   }
+
+   int index;
+   while ((index = pidcc_active_obsolete (&DccScheduled, data, length)) >= 0) {
+      pidcc_latency_drop (DccScheduled.packets[index].trace);
+      pidcc_active_remove (&DccScheduled, index);
+   }
+   index = pidcc_active_insert (&DccScheduled);
+   if (index < 0) {
+      pidcc_latency_drop (trace);
+      return "scheduler full";
+   }
+   pidcc_active_fill (&DccScheduled, index, 0, 1, data, length, trace);
+
+   DccScheduleServiceMode = 0;
+   pidcc_refresh_learn (data, length);
+   return 0;
+}
+
+int pidcc_schedule_room (int programming) {
+
+   if (DccScheduled.count >= PIDCC_ACTIVESIZE) return 0;
+
+   // Programming packets are sent alone.
+   if (programming) return (DccScheduled.count == 0);
+
+   int i;
+   for (i = 0; i < DccScheduled.count; ++i) {
+      if (DccScheduled.packets[i].programming) return 0;
+   }
+   return 1;
+}
+
+int pidcc_schedule_pending (void) {
+   return DccScheduled.count;
+}
+
+// While the transmitter is busy, build the waves of the packets that come
+// next, so that they are ready when there is room in the transmit ring.
+// Only one wave is built per call, to keep the event loop responsive.
+//
+static void pidcc_schedule_stage (void) {
+
+   int i;
+   for (i = 0; i < DccScheduled.count; ++i) {
+      PidccActivePacket *packet = DccScheduled.packets + i;
+      if (packet->staged) continue;
+      packet->staged = 1;
+      pidcc_wave_stage (packet->programming,
+                        packet->data, packet->length, packet->trace);
+      return;
+   }
+}
+
+const char *pidcc_schedule_transmit (void) {
+
+   while ((DccScheduled.count > 0) && pidcc_wave_ready ()) {
+
+      int gap;
+      int repeat = 1;
+      int index;
+
+      if (pidcc_wave_chaining ()) {
+         PidccActivePacket *first = DccScheduled.packets;
+         index = 0;
+         repeat = first->remaining;
+         gap = (first->address != PIDCC_NOADDRESS) &&
+               (first->address == DccScheduled.last) && (!first->urgent);
+      } else {
+         index = pidcc_active_select (&DccScheduled, &gap);
+         if (index < 0) break;
+      }
+      PidccActivePacket *packet = DccScheduled.packets + index;
+
+      const char *error = pidcc_wave_send (packet->programming,
+                                           packet->data, packet->length,
+                                           repeat, gap, packet->trace);
+      if (error) {
+         pidcc_latency_drop (packet->trace);
+         pidcc_active_remove (&DccScheduled, index);
+         return error;
+      }
+      if (pidcc_active_sent (&DccScheduled, index, repeat)) {
+         pidcc_latency_submitted (packet->trace);
+         pidcc_active_remove (&DccScheduled, index);
+      }
+   }
+   pidcc_schedule_stage ();
+   return 0;
+}
+
+long pidcc_schedule_coalesced (void) {
+   return DccScheduleCoalesced;
+}
+
+int pidcc_schedule_idle (void) {
+
+   if (!DccScheduleServiceMode) {
+      const unsigned char *data;
+      int length = pidcc_refresh_next (&data);
+      if (length > 0) {
+         int address = pidcc_packet_address (data, length);
+         int gap = (address == DccScheduled.last);
+         if (!pidcc_wave_send (0, data, length, 1, gap, 0)) {
+            DccScheduled.last = address;
+            return 1;
+         }
+      }
+   }
+   pidcc_wave_idle ();
+   DccScheduled.last = PIDCC_NOADDRESS;
+   return 0;
+}
+
@@ -0,0 +1,38 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_schedule.h - A module that decides the order of transmissions.
+ */
+const char *pidcc_schedule_add (int programming,
+                                const unsigned char *data, int length,
+                                unsigned int trace);
+const char *pidcc_schedule_urgent (const unsigned char *data, int length,
+                                   unsigned int trace);
+
+int pidcc_schedule_room (int programming);
+int pidcc_schedule_pending (void);
+
+const char *pidcc_schedule_transmit (void);
+
+long pidcc_schedule_coalesced (void);
+
+int pidcc_schedule_idle (void);
+
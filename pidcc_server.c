@@ -0,0 +1,161 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_server.c - A module that accepts client connections.
+ *
+ * By default PiDCC is controlled through its standard input and output,
+ * which limits it to a single client application. This module creates the
+ * sockets that let several client applications share the same transmitter.
+ * The clients use the same protocol as on the standard input and output.
+ *
+ * const char *pidcc_server_unix (const char *path, int *listener);
+ *
+ *    Listen on a local (Unix domain) socket with the specified path.
+ *    Any existing file with that name is removed first. Return 0 on
+ *    success, or an error message on failure.
+ *
+ *    Since pidcc typically runs as root, the socket is made accessible to
+ *    all users: access should be restricted using the permissions of the
+ *    directory that contains it.
+ *
+ * const char *pidcc_server_tcp (int port, int *listener);
+ *
+ *    Listen on the specified TCP port, for local connections only. Return
+ *    0 on success, or an error message on failure.
+ *
+ * int pidcc_server_accept (int listener);
+ *
+ *    Accept a new client connection. Return the socket of the new client,
+ *    or -1 on failure.
+ *
+ * const char *pidcc_server_pass (int client, int fd,
+ *                                const char *line, int length);
+ *
+ *    Send the specified line to a local client, together with a copy of
+ *    the descriptor fd. Never wait. Return 0 on success, or an error
+ *    message on failure (e.g. the client is not on a local socket).
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pidcc_server.h"
+
+#define DCCBACKLOG 8
+
+const char *pidcc_server_unix (const char *path, int *listener) {
+
+   struct sockaddr_un address;
+
+   if (strlen(path) >= sizeof(address.sun_path)) return "socket path too long";
+
+   memset (&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strcpy (address.sun_path, path);
+
+   int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) return "cannot create the local socket";
+
+   unlink (path); // Left over from a previous run.
+
+   if (bind (fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+      close (fd);
+      return "cannot bind the local socket";
+   }
+   chmod (path, 0666);
+
+   if (listen (fd, DCCBACKLOG) < 0) {
+      close (fd);
+      return "cannot listen on the local socket";
+   }
+   *listener = fd;
+   return 0;
+}
+
+const char *pidcc_server_tcp (int port, int *listener) {
+
+   struct sockaddr_in address;
+
+   if ((port <= 0) || (port > 65535)) return "invalid TCP port";
+
+   memset (&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   address.sin_port = htons (port);
+
+   int fd = socket (AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) return "cannot create the TCP socket";
+
+   int reuse = 1;
+   setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+   if (bind (fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+      close (fd);
+      return "cannot bind the TCP socket";
+   }
+   if (listen (fd, DCCBACKLOG) < 0) {
+      close (fd);
+      return "cannot listen on the TCP socket";
+   }
+   *listener = fd;
+   return 0;
+}
+
+int pidcc_server_accept (int listener) {
+   return accept (listener, 0, 0);
+}
+
+const char *pidcc_server_pass (int client, int fd,
+                               const char *line, int length) {
+
+   union {
+      char buffer[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+   } control;
+   struct iovec data;
+   struct msghdr message;
+
+   data.iov_base = (void *)line;
+   data.iov_len = length;
+
+   memset (&control, 0, sizeof(control));
+   memset (&message, 0, sizeof(message));
+   message.msg_iov = &data;
+   message.msg_iovlen = 1;
+   message.msg_control = control.buffer;
+   message.msg_controllen = sizeof(control.buffer);
+
+   struct cmsghdr *header = CMSG_FIRSTHDR (&message);
+   header->cmsg_level = SOL_SOCKET;
+   header->cmsg_type = SCM_RIGHTS;
+   header->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy (CMSG_DATA(header), &fd, sizeof(int));
+
+   if (sendmsg (client, &message, MSG_DONTWAIT | MSG_NOSIGNAL) != length)
+      return "cannot pass the descriptor (local socket only)";
+   return 0;
+}
@@ -0,0 +1,198 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_shm.c - The shared memory interface.
+ *
+ * A client application running on the same computer can submit packets
+ * without any system call, by writing them to a shared memory segment.
+ * The segment holds a single producer, single consumer, ring of packet
+ * slots: the client is the only one to write the slots and the head
+ * index, pidcc is the only one to write the tail index and the counters.
+ *
+ * To submit a packet, the client fills slot [head % slots], and then
+ * publishes it by storing head + 1 with release semantics, e.g.:
+ *
+ *    __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+ *
+ * The ring is full when head - tail equals the number of slots. The
+ * client may reuse a slot once tail has moved past it. The indexes are
+ * free running 32 bit counters.
+ *
+ * pidcc does not poll the ring: when it finds the ring empty, it sets
+ * the waiting flag and goes to sleep on an eventfd doorbell. After it
+ * has published a packet, the client must check that flag and, if set,
+ * ring the doorbell by writing an 8 byte value of 1 to it:
+ *
+ *    __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+ *    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+ *    if (ring->waiting) write (doorbell, &one, sizeof(one));
+ *
+ * The client gets the doorbell descriptor by sending the "doorbell"
+ * command on the local socket (see pidcc.c). The full fence pairs with
+ * the one pidcc issues between setting the flag and checking the head
+ * again, so that a packet is never left in the ring unnoticed.
+ *
+ * A packet that the queue cannot take yet remains in the ring, which
+ * gives the client a natural back pressure. pidcc counts the invalid packets, and reports how many
+ * packets were handed to the transmitter, as well as the sequence number
+ * of the last one.
+ *
+ * const char *pidcc_shm_open (const char *name, const char *group);
+ *
+ *    Create the shared memory segment with the specified name (see
+ *    shm_open), and initialize it. Return 0 on success, or an error
+ *    message on failure. The segment is only accessible to the owner and
+ *    to the members of the specified group (the caller's real group if
+ *    group is 0): pidcc is installed setuid root, so any user allowed
+ *    to write the segment can drive the track.
+ *
+ * int pidcc_shm_doorbell (void);
+ *
+ *    Return the eventfd that the client writes to when it published a
+ *    packet while pidcc was waiting, or -1 if there is no segment.
+ *
+ * void pidcc_shm_answer (void);
+ *
+ *    Clear the doorbell. The ring must then be checked again.
+ *
+ * const PidccShmSlot *pidcc_shm_next (void);
+ *
+ *    Return the next slot published by the client, or 0 if there is none.
+ *
+ * void pidcc_shm_consume (int valid);
+ *
+ *    Release the slot returned by pidcc_shm_next(). The valid parameter
+ *    is 0 if that packet was rejected.
+ *
+ * void pidcc_shm_complete (uint32_t sequence);
+ *
+ *    Report that a packet from the ring was handed to the transmitter.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "pidcc_shm.h"
+
+static PidccShmRing *DccShmRing = 0;
+static int DccShmDoorbell = -1;
+
+const char *pidcc_shm_open (const char *name, const char *group) {
+
+   gid_t gid = getgid ();
+   if (group) {
+      struct group *entry = getgrnam (group);
+      if (!entry) return "unknown shared memory group";
+      gid = entry->gr_gid;
+   }
+
+   // Remove any previous segment, which might have looser permissions.
+   shm_unlink (name);
+   int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   if (fd < 0) return "cannot create the shared memory";
+   if ((fchown (fd, -1, gid) < 0) || (fchmod (fd, 0660) < 0)) {
+      close (fd);
+      shm_unlink (name);
+      return "cannot set the shared memory permissions";
+   }
+
+   if (ftruncate (fd, sizeof(PidccShmRing)) < 0) {
+      close (fd);
+      shm_unlink (name);
+      return "cannot size the shared memory";
+   }
+   void *memory = mmap (0, sizeof(PidccShmRing),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close (fd);
+   if (memory == MAP_FAILED) {
+      shm_unlink (name);
+      return "cannot map the shared memory";
+   }
+
+   DccShmDoorbell = eventfd (0, EFD_NONBLOCK);
+   if (DccShmDoorbell < 0) {
+      munmap (memory, sizeof(PidccShmRing));
+      shm_unlink (name);
+      return "cannot create the shared memory doorbell";
+   }
+
+   DccShmRing = (PidccShmRing *)memory;
+   memset (DccShmRing, 0, sizeof(PidccShmRing));
+   DccShmRing->version = PIDCC_SHM_VERSION;
+   DccShmRing->slots = PIDCC_SHM_SLOTS;
+
+   // Tell clients that the segment is ready.
+   __atomic_store_n (&DccShmRing->magic, PIDCC_SHM_MAGIC, __ATOMIC_RELEASE);
+   return 0;
+}
+
+const PidccShmSlot *pidcc_shm_next (void) {
+
+   if (!DccShmRing) return 0;
+
+   uint32_t head = __atomic_load_n (&DccShmRing->head, __ATOMIC_ACQUIRE);
+   uint32_t tail = DccShmRing->tail;
+   if (head == tail) {
+      // Going to sleep: ask the client to ring the doorbell, and check
+      // again in case it published before it could see the request.
+      DccShmRing->waiting = 1;
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+      head = __atomic_load_n (&DccShmRing->head, __ATOMIC_ACQUIRE);
+      if (head == tail) return 0;
+   }
+   DccShmRing->waiting = 0;
+
+   // A confused client: do not read garbage, give up on its backlog.
+   if (head - tail > PIDCC_SHM_SLOTS) {
+      DccShmRing->rejected += head - tail;
+      __atomic_store_n (&DccShmRing->tail, head, __ATOMIC_RELEASE);
+      return 0;
+   }
+   return DccShmRing->slot + (tail % PIDCC_SHM_SLOTS);
+}
+
+int pidcc_shm_doorbell (void) {
+   return DccShmDoorbell;
+}
+
+void pidcc_shm_answer (void) {
+   uint64_t value;
+   if (DccShmDoorbell < 0) return;
+   if (read (DccShmDoorbell, &value, sizeof(value)) < 0) return;
+}
+
+void pidcc_shm_consume (int valid) {
+   if (!DccShmRing) return;
+   if (!valid) DccShmRing->rejected += 1;
+   __atomic_store_n (&DccShmRing->tail, DccShmRing->tail + 1, __ATOMIC_RELEASE);
+}
+
+void pidcc_shm_complete (uint32_t sequence) {
+   if (!DccShmRing) return;
+   DccShmRing->sequence = sequence;
+   __atomic_store_n (&DccShmRing->completed,
+                     DccShmRing->completed + 1, __ATOMIC_RELEASE);
+}
+
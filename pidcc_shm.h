@@ -0,0 +1,74 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_shm.h - The shared memory interface.
+ *
+ * This file defines the layout of the shared memory segment, and is meant
+ * to be included by client applications as well. See pidcc_shm.c for a
+ * description of the protocol.
+ */
+#include <stdint.h>
+
+#define PIDCC_SHM_MAGIC   0x43434450 // "PDCC"
+#define PIDCC_SHM_VERSION 2
+
+#define PIDCC_SHM_SLOTS   256 // Must be a power of 2.
+#define PIDCC_SHM_DATA    16
+
+// Same flags as the binary protocol.
+#define PIDCC_SHM_PROGRAMMING 0x01
+#define PIDCC_SHM_EMERGENCY   0x02
+#define PIDCC_SHM_BACKGROUND  0x04
+
+typedef struct {
+   uint32_t sequence;
+   uint8_t  flags;
+   uint8_t  length;
+   uint8_t  data[PIDCC_SHM_DATA];
+} PidccShmSlot;
+
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t slots;
+
+   // Written by the client only.
+   volatile uint32_t head;     // Next slot to be published.
+
+   // Written by pidcc only.
+   volatile uint32_t tail;     // Next slot to be consumed.
+   volatile uint32_t rejected; // Invalid packets.
+   volatile uint32_t completed; // Packets handed to the transmitter.
+   volatile uint32_t sequence; // Sequence of the last completed packet.
+   volatile uint32_t waiting;  // Ring the doorbell after publishing.
+
+   PidccShmSlot slot[PIDCC_SHM_SLOTS];
+} PidccShmRing;
+
+const char *pidcc_shm_open (const char *name, const char *group);
+
+int  pidcc_shm_doorbell (void);
+void pidcc_shm_answer (void);
+
+const PidccShmSlot *pidcc_shm_next (void);
+void pidcc_shm_consume (int valid);
+void pidcc_shm_complete (uint32_t sequence);
+
@@ -0,0 +1,483 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_sim.c - A simulation of the subset of pigpio used by pidcc.
+ *
+ * This module provides the pigpio functions that pidcc uses, without any
+ * hardware: the waves are kept in memory, and their transmission is
+ * computed from the clock, every time a function is called. This allows
+ * running pidcc, tstgpio, and their tests or benchmarks on any Linux
+ * computer (build with "make sim").
+ *
+ * The following pigpio behaviors are simulated:
+ *
+ * - Wave IDs and DMA control blocks are reused the pigpio way. A new wave
+ *   takes the resources of a deleted wave that needs exactly as many
+ *   control blocks, or else the ID and control blocks after the highest
+ *   wave. Deleting a wave only gives its resources back when every wave
+ *   above it is deleted too. A wave is refused when the control blocks
+ *   or the IDs are exhausted, even if deleted waves are lying below.
+ *
+ * - gpioWaveGetMicros(), gpioWaveGetPulses() and gpioWaveGetCbs() return
+ *   the values for the last wave built (the DMA control blocks are
+ *   estimated as 2 per pulse).
+ *
+ * - gpioWaveTxSend() in ONE_SHOT or REPEAT mode starts the wave
+ *   immediately. In ONE_SHOT_SYNC or REPEAT_SYNC mode, the wave starts at
+ *   the end of the wave currently transmitted, or immediately if idle. A
+ *   later SYNC wave replaces the one still waiting.
+ *
+ * - gpioWaveChain() starts immediately, and supports loops (nested),
+ *   delays and loop forever.
+ *
+ * - gpioWaveTxAt() returns the wave currently transmitted, and
+ *   gpioWaveTxBusy() whether anything is transmitted at all.
+ *
+ * The time comes from pidcc_clock.c, and can be virtual.
+ *
+ * The alert functions are registered but never called: there is no
+ * thread to detect the transitions in real time.
+ *
+ * If the environment variable PIDCC_SIM_TRACE is set when gpioInitialise()
+ * is called, every pulse transmitted is written to the file it names, one
+ * line per pulse:
+ *
+ *    <start> <gpioOn> <gpioOff> <usDelay>
+ *
+ * where start is in microseconds (see pidcc_clock.c), and gpioOn and gpioOff
+ * are hexadecimal bit masks. A pulse cut short (gpioWaveTxStop(), or a
+ * new wave started without SYNC) is written with its actual duration. The
+ * dccanalyze tool decodes this trace back into DCC packets.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pidcc_clock.h"
+#include "pidcc_sim.h"
+
+#define DCCSIMMAXPULSES 12000
+#define DCCSIMMAXCBS    25016
+#define DCCSIMMAXGPIO   53
+
+// The errors are negative, as in pigpio, but not pigpio's exact codes.
+#define DCCSIMBADPARAM   -1
+#define DCCSIMBADWAVE    -2
+#define DCCSIMBADCHAIN   -3
+#define DCCSIMNORESOURCE -4
+
+// Large enough for any chain: a chain is at most 600 entries, and pidcc
+// never loops more than a few hundred waves in total.
+#define DCCSIMPROGRAM 4096
+
+typedef struct {
+   int count; // -1 when deleted.
+   int micros;
+   int bottom; // First DMA control block.
+   int cbs;
+   gpioPulse_t *pulses;
+} DccSimWave;
+
+static DccSimWave DccSimWaves[PI_MAX_WAVES];
+static int DccSimWaveCount = 0; // IDs in use, deleted or not.
+static int DccSimTopCb = 0;     // Control blocks in use, deleted or not.
+
+static gpioPulse_t DccSimPending[DCCSIMMAXPULSES];
+static int DccSimPendingCount = 0;
+static int DccSimPendingMicros = 0;
+
+static int DccSimLastPulses = 0;
+static int DccSimLastMicros = 0;
+static int DccSimLastCbs = 0;
+
+// The transmission in progress is a "program": a sequence of waves, and
+// delays (as negative microseconds), that may end with a part repeated
+// forever.
+//
+static int DccSimProgram[DCCSIMPROGRAM];
+static int DccSimProgramCount = 0;
+static int DccSimForever = -1; // Where the forever part starts, if any.
+static int DccSimCursor = -1;  // -1 when idle.
+static long long DccSimStart;  // When the current entry started.
+
+static int DccSimChain[DCCSIMPROGRAM]; // A new chain, being decoded.
+
+static int DccSimNext = -1; // SYNC wave waiting for the current one to end.
+static int DccSimNextMode;
+
+static unsigned int DccSimLevels = 0;
+
+static FILE *DccSimTrace = 0;
+
+
+static long long pidcc_sim_now (void) {
+   return pidcc_clock_now ();
+}
+
+static int pidcc_sim_valid (unsigned wave) {
+   return (wave < PI_MAX_WAVES) && (DccSimWaves[wave].count >= 0);
+}
+
+static int pidcc_sim_duration (int entry) {
+   int micros = (entry < 0) ? -entry : DccSimWaves[entry].micros;
+   return (micros > 0) ? micros : 1; // Always move forward.
+}
+
+static void pidcc_sim_load (int wave, int mode, long long start) {
+   DccSimProgram[0] = wave;
+   DccSimProgramCount = 1;
+   DccSimForever = ((mode == PI_WAVE_MODE_REPEAT) ||
+                    (mode == PI_WAVE_MODE_REPEAT_SYNC)) ? 0 : -1;
+   DccSimCursor = 0;
+   DccSimStart = start;
+}
+
+// Write the pulses of a wave transmitted from start, up to the specified
+// time (the wave may have been interrupted).
+//
+static void pidcc_sim_record (int entry, long long start, long long until) {
+
+   if ((!DccSimTrace) || (entry < 0)) return; // Delays are not pulses.
+
+   const DccSimWave *wave = DccSimWaves + entry;
+   long long t = start;
+   int i;
+   for (i = 0; i < wave->count; ++i) {
+      if (t >= until) break;
+      const gpioPulse_t *pulse = wave->pulses + i;
+      long long delay = pulse->usDelay;
+      if (t + delay > until) delay = until - t;
+      fprintf (DccSimTrace, "%lld %x %x %lld\n",
+               t, pulse->gpioOn, pulse->gpioOff, delay);
+      t += pulse->usDelay;
+   }
+}
+
+// Move the transmission forward to the current time.
+//
+static void pidcc_sim_update (void) {
+
+   long long now = pidcc_sim_now ();
+
+   while (DccSimCursor >= 0) {
+
+      // Skip the whole cycles of a forever loop at once, unless all
+      // pulses must be traced.
+      if ((!DccSimTrace) && (DccSimNext < 0) && (DccSimForever >= 0) &&
+          (DccSimCursor == DccSimForever)) {
+         int i;
+         long long period = 0;
+         for (i = DccSimForever; i < DccSimProgramCount; ++i)
+            period += pidcc_sim_duration (DccSimProgram[i]);
+         if (now - DccSimStart > period)
+            DccSimStart += ((now - DccSimStart) / period) * period;
+      }
+
+      long long end =
+         DccSimStart + pidcc_sim_duration (DccSimProgram[DccSimCursor]);
+      if (end > now) break;
+      pidcc_sim_record (DccSimProgram[DccSimCursor], DccSimStart, end);
+      DccSimStart = end;
+
+      if (DccSimNext >= 0) {
+         if (pidcc_sim_valid (DccSimNext)) {
+            pidcc_sim_load (DccSimNext, DccSimNextMode, end);
+         } else {
+            DccSimCursor = -1;
+         }
+         DccSimNext = -1;
+         continue;
+      }
+      if (++DccSimCursor >= DccSimProgramCount) {
+         DccSimCursor = DccSimForever; // Idle (-1) if no forever loop.
+      }
+   }
+   if (DccSimTrace) fflush (DccSimTrace);
+}
+
+// Stop the current transmission now, typically to start another one.
+//
+static void pidcc_sim_interrupt (void) {
+   pidcc_sim_update ();
+   if (DccSimCursor >= 0) {
+      pidcc_sim_record (DccSimProgram[DccSimCursor],
+                        DccSimStart, pidcc_sim_now ());
+   }
+   DccSimCursor = -1;
+   DccSimNext = -1;
+}
+
+int gpioInitialise (void) {
+   int i;
+   for (i = 0; i < PI_MAX_WAVES; ++i) {
+      DccSimWaves[i].count = -1;
+      DccSimWaves[i].pulses = 0;
+   }
+   DccSimWaveCount = 0;
+   DccSimTopCb = 0;
+   DccSimCursor = -1;
+   DccSimNext = -1;
+
+   const char *trace = getenv ("PIDCC_SIM_TRACE");
+   if (trace && (!DccSimTrace)) DccSimTrace = fopen (trace, "w");
+   return 79; // The pigpio version simulated.
+}
+
+void gpioTerminate (void) {
+   pidcc_sim_interrupt ();
+   gpioWaveClear ();
+   if (DccSimTrace) {
+      fclose (DccSimTrace);
+      DccSimTrace = 0;
+   }
+}
+
+int gpioSetMode (unsigned gpio, unsigned mode) {
+   if (gpio > DCCSIMMAXGPIO) return DCCSIMBADPARAM;
+   if (mode > PI_OUTPUT) return DCCSIMBADPARAM;
+   return 0;
+}
+
+int gpioWrite (unsigned gpio, unsigned level) {
+   if (gpio > DCCSIMMAXGPIO) return DCCSIMBADPARAM;
+   if (level) DccSimLevels |= (1 << gpio);
+   else DccSimLevels &= ~(1 << gpio);
+   return 0;
+}
+
+int gpioSetAlertFunc (unsigned gpio, gpioAlertFunc_t f) {
+   if (gpio > DCCSIMMAXGPIO) return DCCSIMBADPARAM;
+   return 0;
+}
+
+uint32_t gpioTick (void) {
+   return (uint32_t)pidcc_sim_now ();
+}
+
+int gpioWaveAddNew (void) {
+   DccSimPendingCount = 0;
+   DccSimPendingMicros = 0;
+   return 0;
+}
+
+int gpioWaveAddGeneric (unsigned count, gpioPulse_t *pulses) {
+
+   if (DccSimPendingCount + count > DCCSIMMAXPULSES) return DCCSIMNORESOURCE;
+
+   unsigned i;
+   for (i = 0; i < count; ++i) {
+      DccSimPending[DccSimPendingCount++] = pulses[i];
+      DccSimPendingMicros += pulses[i].usDelay;
+   }
+   return DccSimPendingCount;
+}
+
+int gpioWaveCreate (void) {
+
+   if (DccSimPendingCount <= 0) return DCCSIMBADPARAM;
+
+   int cbs = 2 * DccSimPendingCount;
+
+   // An exact fit with a deleted wave reuses its resources.
+   int wave;
+   for (wave = 0; wave < DccSimWaveCount; ++wave) {
+      if ((DccSimWaves[wave].count < 0) && (DccSimWaves[wave].cbs == cbs))
+         break;
+   }
+   if (wave >= DccSimWaveCount) {
+      if (DccSimTopCb + cbs > DCCSIMMAXCBS) return DCCSIMNORESOURCE;
+      if (DccSimWaveCount >= PI_MAX_WAVES) return DCCSIMNORESOURCE;
+      wave = DccSimWaveCount++;
+      DccSimWaves[wave].bottom = DccSimTopCb;
+      DccSimWaves[wave].cbs = cbs;
+      DccSimTopCb += cbs;
+   }
+
+   DccSimWave *created = DccSimWaves + wave;
+   created->pulses = malloc (DccSimPendingCount * sizeof(gpioPulse_t));
+   if (!created->pulses) return DCCSIMNORESOURCE;
+   memcpy (created->pulses, DccSimPending,
+           DccSimPendingCount * sizeof(gpioPulse_t));
+   created->count = DccSimPendingCount;
+   created->micros = DccSimPendingMicros;
+
+   DccSimLastPulses = DccSimPendingCount;
+   DccSimLastMicros = DccSimPendingMicros;
+   DccSimLastCbs = cbs;
+   DccSimPendingCount = 0;
+   DccSimPendingMicros = 0;
+   return wave;
+}
+
+int gpioWaveDelete (unsigned wave) {
+   if (!pidcc_sim_valid (wave)) return DCCSIMBADWAVE;
+   DccSimWave *deleted = DccSimWaves + wave;
+   free (deleted->pulses);
+   deleted->pulses = 0;
+   deleted->count = -1;
+
+   // Only the deleted waves at the top give their resources back.
+   if (wave == DccSimWaveCount - 1) {
+      while ((wave > 0) && (DccSimWaves[wave-1].count < 0)) --wave;
+      DccSimTopCb = DccSimWaves[wave].bottom;
+      DccSimWaveCount = wave;
+   }
+   return 0;
+}
+
+int gpioWaveClear (void) {
+   int i;
+   for (i = 0; i < PI_MAX_WAVES; ++i) {
+      if (DccSimWaves[i].count >= 0) gpioWaveDelete (i);
+   }
+   DccSimWaveCount = 0;
+   DccSimTopCb = 0;
+   DccSimPendingCount = 0;
+   DccSimPendingMicros = 0;
+   return 0;
+}
+
+int gpioWaveTxSend (unsigned wave, unsigned mode) {
+
+   if (!pidcc_sim_valid (wave)) return DCCSIMBADWAVE;
+   if (mode > PI_WAVE_MODE_REPEAT_SYNC) return DCCSIMBADPARAM;
+
+   pidcc_sim_update ();
+
+   if ((DccSimCursor >= 0) && ((mode == PI_WAVE_MODE_ONE_SHOT_SYNC) ||
+                               (mode == PI_WAVE_MODE_REPEAT_SYNC))) {
+      DccSimNext = wave;
+      DccSimNextMode = mode;
+   } else {
+      pidcc_sim_interrupt ();
+      pidcc_sim_load (wave, mode, pidcc_sim_now ());
+   }
+   return DccSimWaves[wave].cbs;
+}
+
+int gpioWaveChain (char *buf, unsigned length) {
+
+   int loops[20];
+   int depth = 0;
+   int count = 0;
+   int forever = -1;
+
+   unsigned i = 0;
+   while (i < length) {
+      unsigned char code = (unsigned char)buf[i++];
+      if (code != 255) {
+         if (!pidcc_sim_valid (code)) return DCCSIMBADWAVE;
+         if (count >= DCCSIMPROGRAM) return DCCSIMBADCHAIN;
+         DccSimChain[count++] = code;
+         continue;
+      }
+      if (i >= length) return DCCSIMBADCHAIN;
+      code = (unsigned char)buf[i++];
+      switch (code) {
+      case 0: // Loop start.
+         if (depth >= 20) return DCCSIMBADCHAIN;
+         loops[depth++] = count;
+         break;
+      case 1: { // Loop repeat.
+         if ((depth <= 0) || (i + 2 > length)) return DCCSIMBADCHAIN;
+         int repeat = (unsigned char)buf[i] + ((unsigned char)buf[i+1] << 8);
+         i += 2;
+         int start = loops[--depth];
+         int size = count - start;
+         if (repeat <= 0) {
+            count = start;
+            break;
+         }
+         if (count + (size * (repeat - 1)) > DCCSIMPROGRAM) return DCCSIMBADCHAIN;
+         int r;
+         for (r = 1; r < repeat; ++r) {
+            memcpy (DccSimChain + count, DccSimChain + start,
+                    size * sizeof(int));
+            count += size;
+         }
+         break;
+      }
+      case 2: { // Delay.
+         if (i + 2 > length) return DCCSIMBADCHAIN;
+         int delay = (unsigned char)buf[i] + ((unsigned char)buf[i+1] << 8);
+         i += 2;
+         if (count >= DCCSIMPROGRAM) return DCCSIMBADCHAIN;
+         if (delay > 0) DccSimChain[count++] = -delay;
+         break;
+      }
+      case 3: // Loop forever, must be last.
+         if ((depth <= 0) || (i < length)) return DCCSIMBADCHAIN;
+         forever = loops[--depth];
+         break;
+      default:
+         return DCCSIMBADCHAIN;
+      }
+   }
+   if (depth > 0) return DCCSIMBADCHAIN; // Missing repeat.
+   if (forever >= count) forever = -1; // Empty loop.
+
+   pidcc_sim_interrupt ();
+   memcpy (DccSimProgram, DccSimChain, count * sizeof(int));
+   DccSimProgramCount = count;
+   DccSimForever = forever;
+   DccSimNext = -1;
+   DccSimCursor = count ? 0 : -1;
+   DccSimStart = pidcc_sim_now ();
+   return 0;
+}
+
+int gpioWaveTxAt (void) {
+   pidcc_sim_update ();
+   if (DccSimCursor < 0) return PI_NO_TX_WAVE;
+   int entry = DccSimProgram[DccSimCursor];
+   return (entry >= 0) ? entry : PI_NO_TX_WAVE;
+}
+
+int gpioWaveTxBusy (void) {
+   pidcc_sim_update ();
+   return (DccSimCursor >= 0);
+}
+
+int gpioWaveTxStop (void) {
+   pidcc_sim_interrupt ();
+   return 0;
+}
+
+int gpioWaveGetMicros (void) {
+   return DccSimLastMicros;
+}
+
+int gpioWaveGetPulses (void) {
+   return DccSimLastPulses;
+}
+
+int gpioWaveGetCbs (void) {
+   return DccSimLastCbs;
+}
+
+int gpioWaveGetMaxPulses (void) {
+   return DCCSIMMAXPULSES;
+}
+
+int gpioWaveGetMaxCbs (void) {
+   return DCCSIMMAXCBS;
+}
+
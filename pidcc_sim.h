@@ -0,0 +1,72 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_sim.h - A simulation of the subset of pigpio used by pidcc.
+ */
+#include <stdint.h>
+
+typedef struct {
+   uint32_t gpioOn;
+   uint32_t gpioOff;
+   uint32_t usDelay;
+} gpioPulse_t;
+
+typedef void (*gpioAlertFunc_t) (int gpio, int level, uint32_t tick);
+
+#define PI_INPUT  0
+#define PI_OUTPUT 1
+
+#define PI_WAVE_MODE_ONE_SHOT      0
+#define PI_WAVE_MODE_REPEAT        1
+#define PI_WAVE_MODE_ONE_SHOT_SYNC 2
+#define PI_WAVE_MODE_REPEAT_SYNC   3
+
+#define PI_MAX_WAVES 250
+
+#define PI_WAVE_NOT_FOUND 9998
+#define PI_NO_TX_WAVE     9999
+
+int  gpioInitialise (void);
+void gpioTerminate (void);
+
+int gpioSetMode (unsigned gpio, unsigned mode);
+int gpioWrite (unsigned gpio, unsigned level);
+int gpioSetAlertFunc (unsigned gpio, gpioAlertFunc_t f);
+uint32_t gpioTick (void);
+
+int gpioWaveAddNew (void);
+int gpioWaveAddGeneric (unsigned count, gpioPulse_t *pulses);
+int gpioWaveCreate (void);
+int gpioWaveDelete (unsigned wave);
+int gpioWaveClear (void);
+
+int gpioWaveTxSend (unsigned wave, unsigned mode);
+int gpioWaveChain (char *buf, unsigned length);
+int gpioWaveTxAt (void);
+int gpioWaveTxBusy (void);
+int gpioWaveTxStop (void);
+
+int gpioWaveGetMicros (void);
+int gpioWaveGetPulses (void);
+int gpioWaveGetCbs (void);
+int gpioWaveGetMaxPulses (void);
+int gpioWaveGetMaxCbs (void);
+
@@ -0,0 +1,131 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_spsc.c - A lock-free queue between two threads.
+ *
+ * This module implements a bounded queue of fixed size items, with one
+ * producer thread and one consumer thread. The producer only writes the
+ * head index, the consumer only writes the tail index, and each index is
+ * published with release semantics after the item itself: no lock is
+ * needed.
+ *
+ * The consumer may sleep on an eventfd, the "doorbell", that the producer
+ * rings after publishing items. Ringing the doorbell never blocks.
+ *
+ * const char *pidcc_spsc_create (PidccSpsc *queue, int count, int size);
+ *
+ *    Initialize a queue of count items of the specified size. The count
+ *    is rounded up to a power of 2. Return 0 on success, or an error
+ *    message on failure.
+ *
+ * void *pidcc_spsc_slot (PidccSpsc *queue);
+ *
+ *    Producer side: return the next free item, or 0 if the queue is full.
+ *    The item is not visible to the consumer until published.
+ *
+ * void pidcc_spsc_publish (PidccSpsc *queue);
+ *
+ *    Producer side: make the item returned by pidcc_spsc_slot() visible
+ *    to the consumer, and ring the doorbell.
+ *
+ * void *pidcc_spsc_next (PidccSpsc *queue);
+ *
+ *    Consumer side: return the oldest published item, or 0 if the queue
+ *    is empty. The item remains valid until released.
+ *
+ * void pidcc_spsc_release (PidccSpsc *queue);
+ *
+ *    Consumer side: give the item returned by pidcc_spsc_next() back to
+ *    the producer.
+ *
+ * int pidcc_spsc_doorbell (PidccSpsc *queue);
+ *
+ *    Return the eventfd used as the doorbell, for use with epoll.
+ *
+ * void pidcc_spsc_answer (PidccSpsc *queue);
+ *
+ *    Consumer side: reset the doorbell, before consuming the items.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "pidcc_spsc.h"
+
+const char *pidcc_spsc_create (PidccSpsc *queue, int count, int size) {
+
+   unsigned int rounded = 1;
+   while (rounded < count) rounded <<= 1;
+
+   queue->items = calloc (rounded, size);
+   if (!queue->items) return "no memory for queue";
+
+   queue->doorbell = eventfd (0, EFD_NONBLOCK);
+   if (queue->doorbell < 0) {
+      free (queue->items);
+      queue->items = 0;
+      return "cannot create the queue doorbell";
+   }
+   queue->count = rounded;
+   queue->size = size;
+   queue->head = 0;
+   queue->tail = 0;
+   return 0;
+}
+
+void *pidcc_spsc_slot (PidccSpsc *queue) {
+
+   unsigned int tail = __atomic_load_n (&queue->tail, __ATOMIC_ACQUIRE);
+   if (queue->head - tail >= queue->count) return 0; // Full.
+
+   return queue->items + (queue->head & (queue->count - 1)) * queue->size;
+}
+
+void pidcc_spsc_publish (PidccSpsc *queue) {
+
+   __atomic_store_n (&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+
+   uint64_t one = 1;
+   if (write (queue->doorbell, &one, sizeof(one)) < 0) return;
+}
+
+void *pidcc_spsc_next (PidccSpsc *queue) {
+
+   unsigned int head = __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE);
+   if (head == queue->tail) return 0; // Empty.
+
+   return queue->items + (queue->tail & (queue->count - 1)) * queue->size;
+}
+
+void pidcc_spsc_release (PidccSpsc *queue) {
+   __atomic_store_n (&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+}
+
+int pidcc_spsc_doorbell (PidccSpsc *queue) {
+   return queue->doorbell;
+}
+
+void pidcc_spsc_answer (PidccSpsc *queue) {
+   uint64_t value;
+   if (read (queue->doorbell, &value, sizeof(value)) < 0) return;
+}
+
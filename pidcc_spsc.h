@@ -0,0 +1,43 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_spsc.h - A lock-free queue between two threads.
+ */
+typedef struct {
+   unsigned int count; // A power of 2.
+   unsigned int size;
+   unsigned int head;  // Written by the producer only.
+   unsigned int tail;  // Written by the consumer only.
+   unsigned char *items;
+   int doorbell;
+} PidccSpsc;
+
+const char *pidcc_spsc_create (PidccSpsc *queue, int count, int size);
+
+void *pidcc_spsc_slot (PidccSpsc *queue);
+void pidcc_spsc_publish (PidccSpsc *queue);
+
+void *pidcc_spsc_next (PidccSpsc *queue);
+void pidcc_spsc_release (PidccSpsc *queue);
+
+int  pidcc_spsc_doorbell (PidccSpsc *queue);
+void pidcc_spsc_answer (PidccSpsc *queue);
+
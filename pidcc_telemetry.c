@@ -0,0 +1,310 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_telemetry.c - Account for the time on the track.
+ *
+ * The track carries roughly 8 to 9 kbit/s, and this module keeps track of
+ * how that time is spent. The wave module reports every transmission when
+ * it ends, with its usage (see below) and how long it lasted. The time not
+ * accounted for by any transmission is the background signal (bit "0"
+ * fill). The time of the packets is also accumulated per decoder address,
+ * for the packets sent by the clients (including repeats) and the refresh
+ * packets.
+ *
+ *    packet      The first transmission of a packet sent by a client.
+ *    repeat      The other transmissions of the same packet.
+ *    separator   The 5 ms separators between packets to the same decoder.
+ *    refresh     The refresh packets (see pidcc_refresh.c).
+ *    idle        The DCC IDLE packets.
+ *    poweroff    The periods with the transmitter turned off.
+ *    background  The background signal, between transmissions.
+ *
+ * This module also keeps the queue depth gauges provided by the caller,
+ * and exports everything in the Prometheus text format, for the textfile
+ * collector of the node exporter.
+ *
+ * void pidcc_telemetry_start (void);
+ *
+ *    Start accounting, i.e. the track is now active. Only the first call
+ *    counts.
+ *
+ * void pidcc_telemetry_line (int usage, int address, long long usec);
+ *
+ *    Account for a transmission that lasted the specified time. The
+ *    address is the value returned by pidcc_packet_address(), and is
+ *    only used for packets.
+ *
+ * void pidcc_telemetry_queue (const char *name, int depth);
+ *
+ *    Set the current depth of the named queue. The name must be a static
+ *    string.
+ *
+ * const char *pidcc_telemetry_usage (int usage, long long *usec, long *count);
+ *
+ *    Return the name of the specified usage (see PIDCC_LINE_PACKET, etc.),
+ *    the time spent and the number of transmissions, or 0 if the usage is
+ *    not valid. The count for the background is always 0.
+ *
+ * long long pidcc_telemetry_elapsed (void);
+ *
+ *    Return the time since the start of accounting, in microseconds.
+ *
+ * int pidcc_telemetry_decoder (int index, char *name, int size,
+ *                              long long *usec, long *count);
+ *
+ *    Return the usage of the decoders, one per index, starting at 0, in
+ *    decreasing order of time spent. The name is the kind of decoder and
+ *    its address, e.g. "short 3", "long 1234" or "accessory 12" (all the
+ *    decoders beyond the capacity of the table are "other"). Return 0
+ *    once past the last decoder.
+ *
+ * const char *pidcc_telemetry_export (const char *path);
+ *
+ *    Write all the metrics to the specified file, atomically (a temporary
+ *    file is renamed). Return 0 on success, or an error message.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pidcc_clock.h"
+#include "pidcc_packet.h"
+#include "pidcc_telemetry.h"
+
+static long long DccTelemetryStart = -1;
+
+static long long DccLineTime[PIDCC_LINE_USAGES];
+static long DccLineCount[PIDCC_LINE_USAGES];
+
+static const char *DccLineNames[PIDCC_LINE_USAGES] = {
+   "packet", "repeat", "separator", "refresh", "idle", "poweroff",
+   "background"
+};
+
+// The decoders beyond the table capacity are accounted together, under
+// PIDCC_NOADDRESS.
+//
+#define DCCTELEMETRYDECODERS 128
+
+typedef struct {
+   int address;
+   long long usec;
+   long count;
+} DccDecoderUsage;
+
+static DccDecoderUsage DccDecoders[DCCTELEMETRYDECODERS];
+static int DccDecoderCount = 0;
+
+#define DCCTELEMETRYQUEUES 8
+
+typedef struct {
+   const char *name;
+   int depth;
+} DccQueueGauge;
+
+static DccQueueGauge DccQueues[DCCTELEMETRYQUEUES];
+static int DccQueueCount = 0;
+
+
+void pidcc_telemetry_start (void) {
+   if (DccTelemetryStart < 0) DccTelemetryStart = pidcc_clock_now ();
+}
+
+static DccDecoderUsage *pidcc_telemetry_find (int address) {
+
+   int i;
+   for (i = 0; i < DccDecoderCount; ++i) {
+      if (DccDecoders[i].address == address) return DccDecoders + i;
+   }
+   if (DccDecoderCount >= DCCTELEMETRYDECODERS - 1) {
+      // Keep the last entry for all the others.
+      address = PIDCC_NOADDRESS;
+      for (i = 0; i < DccDecoderCount; ++i) {
+         if (DccDecoders[i].address == address) return DccDecoders + i;
+      }
+   }
+   DccDecoderUsage *decoder = DccDecoders + DccDecoderCount++;
+   decoder->address = address;
+   decoder->usec = 0;
+   decoder->count = 0;
+   return decoder;
+}
+
+void pidcc_telemetry_line (int usage, int address, long long usec) {
+
+   if ((usage < 0) || (usage >= PIDCC_LINE_BACKGROUND)) return;
+   if (usec < 0) usec = 0;
+
+   DccLineTime[usage] += usec;
+   DccLineCount[usage] += 1;
+
+   switch (usage) {
+   case PIDCC_LINE_PACKET:
+   case PIDCC_LINE_REPEAT:
+   case PIDCC_LINE_REFRESH: {
+      DccDecoderUsage *decoder = pidcc_telemetry_find (address);
+      decoder->usec += usec;
+      decoder->count += 1;
+      break;
+   }
+   }
+}
+
+void pidcc_telemetry_queue (const char *name, int depth) {
+
+   int i;
+   for (i = 0; i < DccQueueCount; ++i) {
+      if (DccQueues[i].name == name) break;
+   }
+   if (i >= DccQueueCount) {
+      if (DccQueueCount >= DCCTELEMETRYQUEUES) return;
+      DccQueues[DccQueueCount++].name = name;
+   }
+   DccQueues[i].depth = depth;
+}
+
+long long pidcc_telemetry_elapsed (void) {
+   if (DccTelemetryStart < 0) return 0;
+   return pidcc_clock_now () - DccTelemetryStart;
+}
+
+const char *pidcc_telemetry_usage (int usage, long long *usec, long *count) {
+
+   if ((usage < 0) || (usage >= PIDCC_LINE_USAGES)) return 0;
+
+   if (usage == PIDCC_LINE_BACKGROUND) {
+      // Whatever was not used by the transmissions. The transmissions are
+      // accounted when they end, so this can be briefly negative.
+      long long used = 0;
+      int i;
+      for (i = 0; i < PIDCC_LINE_BACKGROUND; ++i) used += DccLineTime[i];
+      *usec = pidcc_telemetry_elapsed () - used;
+      if (*usec < 0) *usec = 0;
+      *count = 0;
+   } else {
+      *usec = DccLineTime[usage];
+      *count = DccLineCount[usage];
+   }
+   return DccLineNames[usage];
+}
+
+static int pidcc_telemetry_order (const void *a, const void *b) {
+   long long x = ((const DccDecoderUsage *)a)->usec;
+   long long y = ((const DccDecoderUsage *)b)->usec;
+   return (x < y) - (x > y);
+}
+
+static void pidcc_telemetry_name (int address, char *name, int size) {
+
+   if (address == PIDCC_NOADDRESS)
+      snprintf (name, size, "other");
+   else if (address == PIDCC_BROADCAST)
+      snprintf (name, size, "broadcast");
+   else if (address >= PIDCC_ACCESSORYADDRESS)
+      snprintf (name, size, "accessory %d", address - PIDCC_ACCESSORYADDRESS);
+   else if (address >= PIDCC_LONGADDRESS)
+      snprintf (name, size, "long %d", address - PIDCC_LONGADDRESS);
+   else
+      snprintf (name, size, "short %d", address);
+}
+
+int pidcc_telemetry_decoder (int index, char *name, int size,
+                             long long *usec, long *count) {
+
+   if ((index < 0) || (index >= DccDecoderCount)) return 0;
+
+   // The table is small: sort it when reading from the start.
+   if (index == 0)
+      qsort (DccDecoders, DccDecoderCount, sizeof(DccDecoderUsage),
+             pidcc_telemetry_order);
+
+   pidcc_telemetry_name (DccDecoders[index].address, name, size);
+   *usec = DccDecoders[index].usec;
+   *count = DccDecoders[index].count;
+   return 1;
+}
+
+const char *pidcc_telemetry_export (const char *path) {
+
+   char temporary[1024];
+   snprintf (temporary, sizeof(temporary), "%s.tmp", path);
+
+   FILE *out = fopen (temporary, "w");
+   if (!out) return "cannot write the metrics file";
+
+   int i;
+   long long usec;
+   long count;
+
+   fprintf (out, "# HELP pidcc_line_seconds_total Time on the track, by usage.\n"
+                 "# TYPE pidcc_line_seconds_total counter\n");
+   for (i = 0; i < PIDCC_LINE_USAGES; ++i) {
+      const char *name = pidcc_telemetry_usage (i, &usec, &count);
+      fprintf (out, "pidcc_line_seconds_total{usage=\"%s\"} %.6f\n",
+               name, usec / 1000000.0);
+   }
+   fprintf (out, "# HELP pidcc_line_transmissions_total Transmissions, by usage.\n"
+                 "# TYPE pidcc_line_transmissions_total counter\n");
+   for (i = 0; i < PIDCC_LINE_BACKGROUND; ++i) {
+      const char *name = pidcc_telemetry_usage (i, &usec, &count);
+      fprintf (out, "pidcc_line_transmissions_total{usage=\"%s\"} %ld\n",
+               name, count);
+   }
+   fprintf (out, "# HELP pidcc_line_elapsed_seconds_total Time since the track started.\n"
+                 "# TYPE pidcc_line_elapsed_seconds_total counter\n"
+                 "pidcc_line_elapsed_seconds_total %.6f\n",
+            pidcc_telemetry_elapsed () / 1000000.0);
+
+   fprintf (out, "# HELP pidcc_decoder_seconds_total Time on the track, by decoder.\n"
+                 "# TYPE pidcc_decoder_seconds_total counter\n");
+   for (i = 0; i < DccDecoderCount; ++i) {
+      char name[64];
+      pidcc_telemetry_name (DccDecoders[i].address, name, sizeof(name));
+      fprintf (out, "pidcc_decoder_seconds_total{decoder=\"%s\"} %.6f\n",
+               name, DccDecoders[i].usec / 1000000.0);
+   }
+   fprintf (out, "# HELP pidcc_decoder_transmissions_total Transmissions, by decoder.\n"
+                 "# TYPE pidcc_decoder_transmissions_total counter\n");
+   for (i = 0; i < DccDecoderCount; ++i) {
+      char name[64];
+      pidcc_telemetry_name (DccDecoders[i].address, name, sizeof(name));
+      fprintf (out, "pidcc_decoder_transmissions_total{decoder=\"%s\"} %ld\n",
+               name, DccDecoders[i].count);
+   }
+
+   fprintf (out, "# HELP pidcc_queue_depth Packets waiting, by queue.\n"
+                 "# TYPE pidcc_queue_depth gauge\n");
+   for (i = 0; i < DccQueueCount; ++i) {
+      fprintf (out, "pidcc_queue_depth{queue=\"%s\"} %d\n",
+               DccQueues[i].name, DccQueues[i].depth);
+   }
+
+   if (fclose (out)) {
+      remove (temporary);
+      return "cannot write the metrics file";
+   }
+   if (rename (temporary, path)) {
+      remove (temporary);
+      return "cannot rename the metrics file";
+   }
+   return 0;
+}
@@ -0,0 +1,44 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_telemetry.h - Account for the time on the track.
+ */
+#define PIDCC_LINE_PACKET     0
+#define PIDCC_LINE_REPEAT     1
+#define PIDCC_LINE_SEPARATOR  2
+#define PIDCC_LINE_REFRESH    3
+#define PIDCC_LINE_IDLE       4
+#define PIDCC_LINE_POWEROFF   5
+#define PIDCC_LINE_BACKGROUND 6
+#define PIDCC_LINE_USAGES     7
+
+void pidcc_telemetry_start (void);
+
+void pidcc_telemetry_line (int usage, int address, long long usec);
+void pidcc_telemetry_queue (const char *name, int depth);
+
+const char *pidcc_telemetry_usage (int usage, long long *usec, long *count);
+long long pidcc_telemetry_elapsed (void);
+int pidcc_telemetry_decoder (int index, char *name, int size,
+                             long long *usec, long *count);
+
+const char *pidcc_telemetry_export (const char *path);
+
@@ -0,0 +1,173 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_tuning.c - The timing parameters that depend on the hardware.
+ *
+ * The delays that pidcc uses to follow the pigpio transmissions depend on
+ * the Raspberry Pi model and its load. The defaults below are reasonable,
+ * and a tuning profile, typically written by "tstgpio -c" after measuring
+ * the actual hardware, can replace them when pidcc starts.
+ *
+ *    switch      How long after a SYNC transmit the new wave starts, i.e.
+ *                the longest wait for the background cycle to complete.
+ *    margin      How long after the estimated end of a wave to check that
+ *                pigpio moved to the next one.
+ *    retry       How soon to check again when pigpio did not move yet.
+ *    idlegap     The time from the end of the last packet to the first
+ *                IDLE or refresh packet.
+ *    idleperiod  The time from the start of an IDLE packet to the start
+ *                of the next one, when there is nothing to refresh.
+ *
+ * All values are in microseconds.
+ *
+ * The profile is a text file with one "name value" line per parameter.
+ * Empty lines and lines starting with '#' are ignored. The parameters not
+ * listed keep their default values.
+ *
+ * int pidcc_tuning_get (int parameter);
+ *
+ *    Return the current value of the specified parameter (see
+ *    PIDCC_TUNING_SWITCH, etc.).
+ *
+ * void pidcc_tuning_set (int parameter, int value);
+ *
+ *    Change the value of the specified parameter.
+ *
+ * const char *pidcc_tuning_name (int parameter);
+ *
+ *    Return the name of the specified parameter, or 0 if the parameter
+ *    is not valid.
+ *
+ * const char *pidcc_tuning_load (const char *path);
+ *
+ *    Load the parameters from the specified tuning profile. Return 0 on
+ *    success, or an error message. On error, the parameters read before
+ *    the error are kept.
+ *
+ * const char *pidcc_tuning_save (const char *path, const char *comment);
+ *
+ *    Write all the parameters to the specified tuning profile, after the
+ *    comment (each line of which should start with '#'), if any. The file
+ *    is written atomically (a temporary file is renamed). Return 0 on
+ *    success, or an error message.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "pidcc_tuning.h"
+
+static int DccTuning[PIDCC_TUNING_COUNT] = {
+   200, 50, 100, 15000, 25000
+};
+
+static const char *DccTuningNames[PIDCC_TUNING_COUNT] = {
+   "switch", "margin", "retry", "idlegap", "idleperiod"
+};
+
+// Sanity limits: a value outside of these is a damaged profile.
+static const int DccTuningMinimum[PIDCC_TUNING_COUNT] = {
+   0, 0, 10, 0, 5000
+};
+static const int DccTuningMaximum[PIDCC_TUNING_COUNT] = {
+   10000, 10000, 10000, 1000000, 1000000
+};
+
+
+int pidcc_tuning_get (int parameter) {
+   if ((parameter < 0) || (parameter >= PIDCC_TUNING_COUNT)) return 0;
+   return DccTuning[parameter];
+}
+
+void pidcc_tuning_set (int parameter, int value) {
+   if ((parameter < 0) || (parameter >= PIDCC_TUNING_COUNT)) return;
+   DccTuning[parameter] = value;
+}
+
+const char *pidcc_tuning_name (int parameter) {
+   if ((parameter < 0) || (parameter >= PIDCC_TUNING_COUNT)) return 0;
+   return DccTuningNames[parameter];
+}
+
+const char *pidcc_tuning_load (const char *path) {
+
+   FILE *file = fopen (path, "r");
+   if (!file) return "cannot open the tuning profile";
+
+   const char *error = 0;
+   char line[256];
+   while (fgets (line, sizeof(line), file)) {
+      char name[64];
+      int value;
+      if ((line[0] == '#') || (strspn (line, " \t\r\n") == strlen(line)))
+         continue;
+      if (sscanf (line, "%63s %d", name, &value) != 2) {
+         error = "invalid line in the tuning profile";
+         break;
+      }
+      int i;
+      for (i = 0; i < PIDCC_TUNING_COUNT; ++i) {
+         if (!strcmp (name, DccTuningNames[i])) break;
+      }
+      if (i >= PIDCC_TUNING_COUNT) {
+         error = "unknown parameter in the tuning profile";
+         break;
+      }
+      if ((value < DccTuningMinimum[i]) || (value > DccTuningMaximum[i])) {
+         error = "invalid value in the tuning profile";
+         break;
+      }
+      DccTuning[i] = value;
+   }
+   fclose (file);
+   return error;
+}
+
+const char *pidcc_tuning_save (const char *path, const char *comment) {
+
+   // Create the directory, if needed. The profile is the only file there.
+   char directory[1024];
+   snprintf (directory, sizeof(directory), "%s", path);
+   mkdir (dirname (directory), 0755);
+
+   char temporary[1024];
+   snprintf (temporary, sizeof(temporary), "%s.tmp", path);
+
+   FILE *file = fopen (temporary, "w");
+   if (!file) return "cannot create the tuning profile";
+
+   if (comment) fputs (comment, file);
+   int i;
+   for (i = 0; i < PIDCC_TUNING_COUNT; ++i) {
+      fprintf (file, "%s %d\n", DccTuningNames[i], DccTuning[i]);
+   }
+   if (fclose (file)) {
+      remove (temporary);
+      return "cannot write the tuning profile";
+   }
+   if (rename (temporary, path)) {
+      remove (temporary);
+      return "cannot install the tuning profile";
+   }
+   return 0;
+}
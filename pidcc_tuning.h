@@ -0,0 +1,38 @@
+/* DCC Transmitter - A software that generates the DCC signal for a booster.
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * ------------------------------------------------------------------------
+ *
+ * pidcc_tuning.h - The timing parameters that depend on the hardware.
+ */
+#define PIDCC_TUNING_PATH "/var/lib/pidcc/tuning"
+
+#define PIDCC_TUNING_SWITCH     0
+#define PIDCC_TUNING_MARGIN     1
+#define PIDCC_TUNING_RETRY      2
+#define PIDCC_TUNING_IDLEGAP    3
+#define PIDCC_TUNING_IDLEPERIOD 4
+#define PIDCC_TUNING_COUNT      5
+
+int  pidcc_tuning_get (int parameter);
+void pidcc_tuning_set (int parameter, int value);
+const char *pidcc_tuning_name (int parameter);
+
+const char *pidcc_tuning_load (const char *path);
+const char *pidcc_tuning_save (const char *path, const char *comment);
@@ -22,13 +22,17 @@
  * pidcc_wave.c - A module that generates the wave form for each DCC packet.
  *
  * This module is responsible for generating the DCC signal: it takes care
- * of the preamble, start bits data bits, error detection byte, stop bit and
- * transmission repeats.
+ * of the preamble, start bits data bits, error detection byte, stop bit,
+ * separators and transmission repeats. The bits of each packet come from
+ * pidcc_encode.c, and are converted into pigpio pulses here. The decision
+ * of which packet to send next, how many times and whether a separator is
+ * needed, belongs to the caller.
  *
  * The functions below typically return 0 on success, or a pointer to an error
  * description string on failure.
  *
- * const char *pidcc_wave_initialize (int gpioa, int gpiob, int debug);
+ * const char *pidcc_wave_initialize (int gpioa, int gpiob,
+ *                                    void (*debug) (const char *text));
  *
  *    Initialize the I/O library, if needed, and select the two GPIO pins
  *    to use. This function can be called multiple times, for example to change
@@ -38,20 +42,70 @@
  *    the first GPIO. That second GPIO is optional and can be set to 0
  *    if not needed by the hardware. If gpiob is 0, only gpioa will be used.
  *
+ *    The debug messages are passed to the debug function, if not 0: this
+ *    module never writes to the standard output itself.
+ *
  *    Return 0 on success, an error message on failure.
  *
+ * const char *pidcc_wave_district (int district, int gpioa, int gpiob);
+ *
+ *    Select the two GPIO pins of an extra district (1 to PIDCC_DISTRICTS-1,
+ *    see pidcc_district.h), or remove that district if gpioa is 0. The
+ *    pins of district 0 are the ones given to pidcc_wave_initialize().
+ *    This is not available in chain mode.
+ *
+ *    Return 0 on success, an error message on failure.
+ *
+ * int pidcc_wave_configured (int district);
+ *
+ *    Return 1 if the GPIO pins of that district have been selected.
+ *
  * const char *pidcc_wave_send (int programming,
- *                              const unsigned char *data, int length);
+ *                              const unsigned char *data, int length,
+ *                              int repeat, int gap, unsigned int trace);
  *
- *    Format and send a DCC packet. The DCC decoder address is part of the
- *    data: this module does not interpret the format of the DCC data.
- *    It is invalid to initiate a transmission if the state is not idle.
+ *    Format and send a DCC packet repeat times, with a 5 ms separator
+ *    between repeats. If gap is not 0, a 5 ms separator is also inserted
+ *    before the first transmission: the caller must request it when the
+ *    previous packet was sent to the same decoder. The DCC decoder address
+ *    is part of the data: this module does not interpret the format of the
+ *    DCC data.
+ *    The packet is queued behind the ones already being transmitted: it is
+ *    invalid to initiate a transmission if pidcc_wave_ready() returns 0.
+ *    The trace is the packet ID in pidcc_latency.c, or 0 for a refresh
+ *    packet: the start and end of each transmission are reported there.
+ *    The time of each transmission is reported to pidcc_telemetry.c.
  *
  *    Return 0 on success, an error message on failure.
  *
+ * const char *pidcc_wave_stage (int programming,
+ *                               const unsigned char *data, int length,
+ *                               unsigned int trace);
+ *
+ *    Build the wave for a packet that will be sent later, without
+ *    transmitting anything. This is meant to be called while the
+ *    transmitter is busy, so that the next pidcc_wave_send() for that
+ *    packet finds its wave in the cache. This can be called at any time.
+ *
+ *    Return 0 on success, an error message on failure.
+ *
+ * int pidcc_wave_ready (void);
+ *
+ *    Return 1 if a new packet can be submitted, 0 otherwise. This only
+ *    guarantees room for one transmission, with a separator.
+ *
+ * int pidcc_wave_chaining (void);
+ *
+ *    Return 1 if chain mode is enabled. In that mode, only one packet can
+ *    be pending, and it should be submitted with all its repeats.
+ *
+ * void pidcc_wave_cache_statistics (long *hits, long *misses, long *evictions);
+ *
+ *    Return the wave cache counters since the program started.
+ *
  * int pidcc_wave_microseconds (void);
  *
- *    Return the time it will take to send the latest packet.
+ *    Return the time it will take to send all the pending packets.
  *
  * int pidcc_wave_state (void);
  *
@@ -59,18 +113,62 @@
  *    not started yet, PIDCC_TRANSMITTING when transmitting a packet,
  *    and PIDCC_IDLE when there is nothing to transmit.
  *
+ *    This function also drives the transmit ring and must be called at
+ *    least once per packet time while not idle.
+ *
  *    A pending power cycle (transmitter turned off) is reported as
  *    a transmission.
  *
+ * int pidcc_wave_wakeup (void);
+ *
+ *    Return the number of microseconds until pidcc_wave_state() should be
+ *    called again, or -1 if there is nothing pending. This is based on the
+ *    estimated start and end time of each pending packet, so that the
+ *    caller wakes up right when the next transition is due.
+ *
+ * void pidcc_wave_notify (int fd);
+ *
+ *    Register an eventfd to be signaled, from a pigpio thread, when the
+ *    current wave changes. This is optional, and a fd of -1 cancels it.
+ *    The alert is only watched around the estimated end of each wave:
+ *    pidcc_wave_wakeup() then asks for an earlier wakeup, to arm it.
+ *
  * void pidcc_wave_idle (void);
  *
  *    Transmit the DCC IDLE packet (once).
  *
+ * const char *pidcc_wave_chain (int enable);
+ *
+ *    Enable or disable the chain transmit mode (see below). Chain mode
+ *    cannot be enabled while extra districts are configured.
+ *
+ *    Return 0 on success, an error message on failure.
+ *
+ * void pidcc_wave_abort (const unsigned char *stop, int length);
+ *
+ *    Get the emergency stop packet stop on the track without waiting for
+ *    the transmit ring to drain. The packets in the ring that the stop
+ *    makes obsolete (see pidcc_packet_stops()) are replaced with
+ *    separators, or with slots that carry only the extra districts: all
+ *    the other packets are still transmitted, in order. One transmission
+ *    of the stop is inserted right after what pigpio already has, with
+ *    separators if needed; the scheduler sends the stop again as usual.
+ *    If the packet on the track is obsolete, it is cut short (the
+ *    decoders discard it as malformed), and the segment pigpio had
+ *    queued after it is sent again. The stop, and the slot sent again,
+ *    then use the longer preamble of programming packets: a decoder may
+ *    take up to 9 "1" bits as the end of the packet that was cut short.
+ *    A power off is never cut short: the track stays off and the
+ *    emergency stop follows it. A chain cannot be changed: it is cut
+ *    short if obsolete, otherwise the stop waits.
+ *
  * const char *pidcc_wave_off (int duration);
  *
  *    Turn the transmitter off for the specified number of seconds. That
  *    duration should be less than a minute to avoid hitting pigpio limits.
+ *    All the districts are turned off.
  *    It is invalid to initiate a power cycle if the state is not idle.
+ *    No packet can be submitted until the power cycle has completed.
  *
  *    Return 0 on success, an error message on failure.
  *
@@ -78,6 +176,85 @@
  *
  *    Release all current resources.
  *
+ * WAVE CACHE:
+ *
+ *    Building a pigpio wave (gpioWaveAddNew, gpioWaveAddGeneric and
+ *    gpioWaveCreate) is costly, and a layout typically sends the same
+ *    few speed and function packets over and over. Each wave created is
+ *    kept alive in pigpio and indexed by its content (programming mode,
+ *    packet bytes and GPIO pins), so that retries, idle packets and
+ *    repeated commands reuse the existing wave.
+ *
+ *    pigpio only gives the resources of a deleted wave to a new wave that
+ *    needs exactly as many DMA control blocks, or else once every wave
+ *    above it (by ID) is deleted as well. This module tracks what pigpio
+ *    does with its control blocks, and keeps room for a transmit ring full
+ *    of new waves. To make room, or to free an entry of the cache, it
+ *    deletes the least recently used wave of the same size (same number
+ *    of pulses, same pins), whose resources the new wave reuses, or else
+ *    the wave with the highest ID, if cached and not transmitted. Only to
+ *    free an entry of the cache is the least recently used wave deleted
+ *    when neither exists.
+ *
+ *    The caller may also build the waves of the packets it is about to
+ *    send ahead of time (see pidcc_wave_stage()), while the transmit ring
+ *    is busy, so that a new wave is rarely built when the track is waiting
+ *    for it.
+ *
+ * TRANSMIT RING:
+ *
+ *    Up to 8 segments (packets or separators) can be pending at any time,
+ *    each one with its wave already built. Once a segment has started, the
+ *    next one is submitted with PI_WAVE_MODE_ONE_SHOT_SYNC, so that pigpio
+ *    switches from one to the next on the exact wave boundary, without
+ *    waiting for the event loop to notice the end of the transmission.
+ *    The background wave is only used when the ring is empty, or between
+ *    two transmissions of the same wave (a wave cannot be linked to itself).
+ *
+ * CHAIN MODE:
+ *
+ *    By default each repeat is a separate segment in the transmit ring, and
+ *    the event loop must be woken up to link each one. In chain mode the
+ *    packet and all its repeats are submitted as a single gpioWaveChain,
+ *    followed by the background wave looping forever. The whole burst then runs in
+ *    hardware with exact spacing. The downside is that gpioWaveChain has no
+ *    SYNC option: a new chain interrupts the background wave immediately,
+ *    truncating the current bit "0". Decoders ignore that truncated bit as
+ *    noise, and the preamble that follows is long enough to survive it.
+ *
+ *    In chain mode the cached packet waves do not include the preamble:
+ *    the chain repeats a single bit "1" wave with a loop counter in front
+ *    of each transmission, which saves DMA control blocks on every wave.
+ *
+ * MULTIPLE DISTRICTS:
+ *
+ *    A pigpio pulse sets and clears any set of GPIO pins, so a single wave
+ *    can carry the signal of several districts, each on its own pins.
+ *    When extra districts are configured, each segment of the transmit
+ *    ring becomes a slot: the transmission of district 0 (packet or
+ *    separator) plus the next transmission of each extra district, taken
+ *    from pidcc_district.c when the slot is built. All transmissions of a
+ *    slot start together, and the shorter ones are followed by "0" bits
+ *    up to the end of the longest one, the last of these bits stretched
+ *    to absorb the remainder. A packet never spans two slots, so that the
+ *    background wave, which drives all districts, can come between them.
+ *
+ *    The slot waves are rarely the same twice, and the wave cache is not
+ *    used. Instead, a fixed set of slot waves is recycled: a new slot
+ *    replaces a slot wave no longer transmitted, preferably one of the
+ *    same size, so that pigpio reuses its ID and DMA control blocks as
+ *    they are. To make that likely, a slot wave is padded to a multiple
+ *    of 32 pulses by splitting pulses in two, the second half setting
+ *    the same pins again (which changes nothing on the track).
+ *
+ *    When district 0 has nothing to send, slots with only "0" bits on
+ *    district 0 carry the extra districts' packets. An emergency stop on
+ *    district 0 (pidcc_wave_abort()) cuts the current slot short on all
+ *    districts if its district 0 packet is obsolete: the slot is then
+ *    rebuilt without that packet and sent again, and so are the obsolete
+ *    slots still queued. Each slot keeps the encoded transmissions of
+ *    the extra districts for that purpose.
+ *
  * CAUTION:
  *
  *    Cannot use GPIO 0 because '0' is used as null (no pin).
@@ -86,10 +263,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
 
-#include <pigpio.h> // Raspberry Pi OS only, not on regular Debian.
+#include "pidcc_output.h"
 
+#include "pidcc_clock.h"
+#include "pidcc_encode.h"
+#include "pidcc_district.h"
+#include "pidcc_latency.h"
+#include "pidcc_packet.h"
+#include "pidcc_telemetry.h"
+#include "pidcc_tuning.h"
 #include "pidcc_wave.h"
 
 static int DccWaveGpioA = 0;
@@ -100,46 +286,221 @@ static gpioPulse_t DccBit1[3];
 
 static gpioPulse_t DccOff[2];
 
-static gpioPulse_t DccPreamble[41];
+// The extra districts, see MULTIPLE DISTRICTS. Index 0 is not used: the
+// pins of district 0 are DccWaveGpioA and DccWaveGpioB.
+//
+static int DccDistrictGpioA[PIDCC_DISTRICTS];
+static int DccDistrictGpioB[PIDCC_DISTRICTS];
+static gpioPulse_t DccDistrictBit0[PIDCC_DISTRICTS][3];
+static gpioPulse_t DccDistrictBit1[PIDCC_DISTRICTS][3];
+static int DccDistrictCount = 0;
 
-// Enough room for 20 preamble bits, 6 start bits, 16 data bytes, 1 stop bit
-// and interpackets idle period (5 msec).
-#define DCCMAXWAVE (2*(20+6+(8*16)+1)+51)
+#define DCCMAXDATA 16
+
+// Enough room for 20 preamble bits, 17 start bits, 16 data bytes, the error
+// detection byte and 1 stop bit. The separator is a separate wave.
+#define DCCMAXWAVE (2*(20+17+(8*17)+1))
+
+// In a slot, a transmission may be followed by "0" bits up to the length
+// of the longest packet, plus one bit.
+#define DCCMAXSTREAM (2*DCCMAXWAVE+2)
 
 typedef struct {
    int count;
-   int retry;
-   int totalTime;
-   gpioPulse_t pulses[DCCMAXWAVE];
+   int micros;
+   gpioPulse_t pulses[DCCMAXSTREAM];
 } DccPacket;
 
 DccPacket DccPendingPacket;
 
-static int DccPendingWave = -1;
+static DccPacket DccStreams[PIDCC_DISTRICTS]; // The slot being built.
+
+// The transmissions of the extra districts in the slot being built, before
+// conversion. A slot may not carry anything for some districts.
+static PidccEncoded DccSlotEncoded[PIDCC_DISTRICTS];
+static int DccSlotCarried[PIDCC_DISTRICTS];
+
+// The transmit ring. The first segment is on the track, or about to start.
+// A segment is either one transmission of a packet, a separator or a power
+// off period.
+// As soon as it has started, the next segment is sent in SYNC mode so that
+// pigpio switches to it on the exact wave boundary. Only if the ring is
+// empty does the signal fall back to the background wave.
+//
+#define DCCWAVERING 8
+
+// pidcc_wave_abort() may insert an emergency stop, with its separators,
+// ahead of the segments already queued.
+#define DCCWAVEURGENT 3
+#define DCCWAVESEGMENTS (DCCWAVERING+DCCWAVEURGENT)
+
+typedef struct {
+   int wave;
+   int repeat;   // Chain mode only.
+   int gap;      // Chain mode only.
+   int preamble; // Chain mode only: preamble bits looped in the chain.
+   int totalTime;
+   int sent;
+   int started;
+   int chained;
+   unsigned int trace; // See pidcc_latency.c, 0 if not a client packet.
+   int usage;          // See pidcc_telemetry.h.
+   int address;        // Packets only.
+   int length;         // The packet, if this segment transmits one.
+   unsigned char data[DCCMAXDATA];
+   int inserted;       // An emergency stop from pidcc_wave_abort().
+   long long start; // Estimated, in microseconds (CLOCK_MONOTONIC).
+   long long end;
+
+   // Slots only: the transmissions of the extra districts, so that the
+   // slot can be rebuilt without its district 0 packet.
+   int carried[PIDCC_DISTRICTS];
+   PidccEncoded districts[PIDCC_DISTRICTS];
+} DccSegment;
+
+static DccSegment DccRing[DCCWAVESEGMENTS];
+static int DccRingFirst = 0;
+static int DccRingCount = 0;
+
+// The slot waves (see MULTIPLE DISTRICTS), recycled. A slot wave has as
+// many pulses as the slot needs, rounded up to a multiple of the quantum.
+//
+#define DCCSLOTWAVES DCCWAVESEGMENTS // As many as the ring can hold.
+#define DCCSLOTQUANTUM 32
+#define DCCSLOTSPLIT 20 // Shortest pulse split when padding, in microseconds.
+
+typedef struct {
+   int wave; // -1 when not used.
+   int pulses;
+   int sets;   // Pulses that set pins.
+   int clears; // Pulses that clear pins.
+} DccSlotWave;
+
+static DccSlotWave DccSlotWaves[DCCSLOTWAVES];
+
+static gpioPulse_t DccMerged[PIDCC_DISTRICTS*DCCMAXSTREAM+DCCSLOTQUANTUM];
+
+static int DccSuccessorLinked = 0;
+static int DccBackgroundLinked = 0;
+
+// The alert is armed only around the estimated end of the current wave.
+// DccNotifyAt is shared with the pigpio thread: the wave on the track when
+// armed, -1 once the change was signaled.
+//
+#define DCCNOTIFYWINDOW 1000 // Microseconds before the estimated end.
+
+static int DccNotifyFd = -1;
+static int DccNotifyArmed = 0;
+static int DccNotifyAt = -1;
+
+static int DccPowerOffWave = -1;
 static int DccBackgroundWave = -1;
+static int DccSeparatorWave = -1;
+static int DccSeparatorTime = 0;
+static int DccPreambleWave = -1;
+static int DccPreambleTime = 0;
+
+// The waves replaced after a pin change, deleted once no longer transmitted
+// (see pidcc_wave_retire()).
+//
+#define DCCRETIRED 8
+static int DccRetired[DCCRETIRED];
+static int DccRetiredCount = 0;
+
+// The wave cache. An entry is free when its wave ID is -1. The cache size
+// stays well below pigpio's limit of 250 wave IDs.
+//
+#define DCCWAVECACHE 128
+
+typedef struct {
+   int wave;
+   int programming;
+   int gpioa;
+   int gpiob;
+   int looped; // Preamble not included, looped in the chain instead.
+   int length;
+   unsigned char data[DCCMAXDATA];
+   int totalTime;
+   int pulses;
+   unsigned int used; // For LRU eviction.
+} DccCachedWave;
 
-static int DccTransmitStarting = 0;
+static DccCachedWave DccWaveCache[DCCWAVECACHE];
+
+static unsigned int DccWaveCacheClock = 0;
+
+// pigpio does not tell how many DMA control blocks are left: what it does
+// with them is tracked here (see WAVE CACHE).
+//
+static int DccWaveCbs[PI_MAX_WAVES];    // Size of each wave ID.
+static int DccWaveBottom[PI_MAX_WAVES]; // First control block of each ID.
+static char DccWaveDeleted[PI_MAX_WAVES];
+static int DccWaveIds = 0; // Wave IDs used, deleted or not.
+static int DccWaveTop = 0; // DMA control blocks used, deleted or not.
+static int DccWaveMaxCbs = 0;
+
+static long DccWaveCacheHits = 0;
+static long DccWaveCacheMisses = 0;
+static long DccWaveCacheEvictions = 0;
+
+static int DccChainMode = 0;
+static int DccChainRunning = 0;
+static int DccChainBackground = -1; // The background wave ending the chain.
+
+static int DccWaveIdling = 0; // Sending an IDLE packet.
 
 static int PigioInitialized = 0;
 
-static int PidccWaveDebug = 1; // Until initialized..
+static void (*PidccWaveDebug) (const char *text) = 0;
 
 
 static void pidcc_wave_debug (const char *text) {
+   if (PidccWaveDebug) PidccWaveDebug (text);
+}
 
-   if (!PidccWaveDebug) return;
+// Create a wave, and track where pigpio put it: in a deleted wave of the
+// same size, or above the highest wave.
+//
+static int pidcc_wave_new (void) {
+   int wave = gpioWaveCreate();
+   if ((wave < 0) || (wave >= PI_MAX_WAVES)) return wave;
+   if (wave >= DccWaveIds) {
+      DccWaveBottom[wave] = DccWaveTop;
+      DccWaveCbs[wave] = gpioWaveGetCbs();
+      DccWaveTop += DccWaveCbs[wave];
+      DccWaveIds = wave + 1;
+   }
+   DccWaveDeleted[wave] = 0;
+   return wave;
+}
 
-   struct timeval now;
-   gettimeofday (&now, 0);
-   long long sec = (long long)(now.tv_sec);
-   int usec = (int)(now.tv_usec);
-   printf ("$ %lld.%06d %s\n", sec, usec, text);
+// Delete a wave. pigpio reclaims its resources only if no wave above it
+// remains.
+//
+static void pidcc_wave_delete (int wave) {
+   gpioWaveDelete (wave);
+   if ((wave < 0) || (wave >= DccWaveIds)) return;
+   DccWaveDeleted[wave] = 1;
+   if (wave == DccWaveIds - 1) {
+      while ((wave > 0) && DccWaveDeleted[wave-1]) --wave;
+      DccWaveTop = DccWaveBottom[wave];
+      DccWaveIds = wave;
+   }
 }
 
-static void pidcc_wave_prepare (gpioPulse_t *pulse, int delay) {
+static long long pidcc_wave_now (void) {
+   return pidcc_clock_now ();
+}
 
-   pulse[0].gpioOn = (1 << DccWaveGpioA);
-   pulse[0].gpioOff = DccWaveGpioB ? (1 << DccWaveGpioB) : 0;
+static uint32_t pidcc_wave_mask (int gpio) {
+   return (gpio > 0) ? (1 << gpio) : 0;
+}
+
+static void pidcc_wave_prepare (gpioPulse_t *pulse, int delay,
+                                uint32_t on, uint32_t off) {
+
+   pulse[0].gpioOn = on;
+   pulse[0].gpioOff = off;
    pulse[0].usDelay = delay;
 
    pulse[1].gpioOn = pulse[0].gpioOff;
@@ -149,33 +510,212 @@ static void pidcc_wave_prepare (gpioPulse_t *pulse, int delay) {
    pulse[2].usDelay = 0; // End of wave.
 }
 
-static const char *pidcc_wave_background (void) {
-
-  int result;
+// The background wave is a bit "0" on all districts.
+//
+static const char *pidcc_wave_backgroundBuild (void) {
 
   if (DccBackgroundWave < 0) {
 
+     int result;
+     uint32_t on = pidcc_wave_mask (DccWaveGpioA);
+     uint32_t off = pidcc_wave_mask (DccWaveGpioB);
+     int i;
+     for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+        on |= pidcc_wave_mask (DccDistrictGpioA[i]);
+        off |= pidcc_wave_mask (DccDistrictGpioB[i]);
+     }
+     gpioPulse_t pulses[3];
+     pidcc_wave_prepare (pulses, PIDCC_BIT0_USEC, on, off);
+
      if (gpioWaveAddNew()) return "gpioWaveAddNew(background) failed";
 
-     result = gpioWaveAddGeneric(2, DccBit0);
+     result = gpioWaveAddGeneric(2, pulses);
      if (result < 0) return "gpioWaveAddGeneric(background) failed";
 
-     DccBackgroundWave = gpioWaveCreate();
+     DccBackgroundWave = pidcc_wave_new ();
      if (DccBackgroundWave < 0) return "gpioWaveCreate(background) failed";
   }
+  return 0;
+}
+
+static const char *pidcc_wave_background (void) {
 
-  result = gpioWaveTxSend (DccBackgroundWave, PI_WAVE_MODE_REPEAT_SYNC);
+  const char *error = pidcc_wave_backgroundBuild ();
+  if (error) return error;
+
+  int result = gpioWaveTxSend (DccBackgroundWave, PI_WAVE_MODE_REPEAT_SYNC);
   if (result < 0) return "gpioWaveTxSend(background) failed";
 
   return 0;
 }
 
-const char *pidcc_wave_initialize (int gpioa, int gpiob, int debug) {
+static DccSegment *pidcc_wave_segment (int index) {
+   return DccRing + ((DccRingFirst + index) % DCCWAVESEGMENTS);
+}
+
+static int pidcc_wave_inuse (int wave) {
+   int i;
+   for (i = 0; i < DccRingCount; ++i) {
+      if (pidcc_wave_segment(i)->wave == wave) return 1;
+   }
+   return 0;
+}
+
+// A wave may still be transmitted: on the track, queued in the transmit
+// ring, or part of the chain being transmitted.
+//
+static int pidcc_wave_busy (int wave) {
+   if (gpioWaveTxAt () == wave) return 1;
+   if (DccRingCount <= 0) return 0;
+   if (pidcc_wave_segment(0)->chained) return 1;
+   return pidcc_wave_inuse (wave);
+}
+
+// Delete the retired waves that are no longer transmitted.
+//
+static void pidcc_wave_sweep (void) {
+   int i = 0;
+   while (i < DccRetiredCount) {
+      if (pidcc_wave_busy (DccRetired[i])) {
+         i += 1;
+         continue;
+      }
+      pidcc_wave_delete (DccRetired[i]);
+      DccRetired[i] = DccRetired[--DccRetiredCount];
+   }
+}
+
+// A wave built for the old pins is replaced: delete it now if it is not
+// transmitted, later otherwise (see pidcc_wave_state()). Only a burst of
+// pin changes could fill the retired list: then the wave goes now anyway.
+//
+static void pidcc_wave_retire (int wave) {
+   if (wave < 0) return;
+   pidcc_wave_sweep ();
+   if (pidcc_wave_busy (wave) && (DccRetiredCount < DCCRETIRED)) {
+      DccRetired[DccRetiredCount++] = wave;
+      return;
+   }
+   pidcc_wave_delete (wave);
+}
+
+// The pins changed: build a new background wave.
+//
+static const char *pidcc_wave_rebuild (void) {
+
+  if (DccBackgroundWave < 0) return 0;
+
+  pidcc_wave_retire (DccBackgroundWave);
+  DccBackgroundWave = -1;
+
+  if (DccRingCount > 0) return 0; // Built when linked.
+  return pidcc_wave_background ();
+}
+
+// A subsequent DCC packet to the same decoder must not be sent within 5 msec
+// after the previous packet. To ensure this, the packet can be preceded with
+// a 5 msec long bit "0" stream ("0" lasts 200 usec, therefore we need 25
+// of them). Packets to different decoders can be sent back to back.
+//
+// Apparently a DCC generator must keep the power line in AC mode by sending
+// a continuous bit "0" signal. The stretched bit "0" was intended to force
+// a DC power level for compatibility with analog systems (now deprecated).
+//
+static const char *pidcc_wave_separator (void) {
+
+  if (DccSeparatorWave >= 0) return 0;
+
+  gpioPulse_t pulses[50];
+  int i;
+  for (i = 0; i < 50; i += 2) {
+     pulses[i] = DccBit0[0];
+     pulses[i+1] = DccBit0[1];
+  }
+  if (gpioWaveAddNew()) return "gpioWaveAddNew(separator) failed";
+
+  int result = gpioWaveAddGeneric(50, pulses);
+  if (result < 0) return "gpioWaveAddGeneric(separator) failed";
+
+  DccSeparatorWave = pidcc_wave_new ();
+  if (DccSeparatorWave < 0) return "gpioWaveCreate(separator) failed";
+  DccSeparatorTime = gpioWaveGetMicros();
+  return 0;
+}
+
+// In chain mode the preamble is not part of the packet waves: a wave of
+// a single bit "1" is repeated using a chain loop counter instead. This
+// saves the DMA control blocks of 15 to 20 bits on each cached wave, about
+// a third of a typical packet, so that more waves can stay in the cache.
+//
+static const char *pidcc_wave_preamble (void) {
+
+  if (DccPreambleWave >= 0) return 0;
+
+  if (gpioWaveAddNew()) return "gpioWaveAddNew(preamble) failed";
+
+  int result = gpioWaveAddGeneric(2, DccBit1);
+  if (result < 0) return "gpioWaveAddGeneric(preamble) failed";
+
+  DccPreambleWave = pidcc_wave_new ();
+  if (DccPreambleWave < 0) return "gpioWaveCreate(preamble) failed";
+  DccPreambleTime = gpioWaveGetMicros();
+  return 0;
+}
+
+// Return 1 if that GPIO is used by a district other than the one specified.
+//
+static int pidcc_wave_used (int district, int gpio) {
+
+   if (gpio <= 0) return 0;
+   if ((district != 0) && ((gpio == DccWaveGpioA) || (gpio == DccWaveGpioB)))
+      return 1;
+
+   int i;
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+      if (i == district) continue;
+      if ((gpio == DccDistrictGpioA[i]) || (gpio == DccDistrictGpioB[i]))
+         return 1;
+   }
+   return 0;
+}
+
+// This is called from a pigpio thread on each edge of the first GPIO,
+// while armed. Only the change of the current wave is signaled to the
+// event loop, once.
+//
+static void pidcc_wave_alert (int gpio, int level, uint32_t tick) {
+
+   int armed = __atomic_load_n (&DccNotifyAt, __ATOMIC_ACQUIRE);
+   if (armed < 0) return;
+   if (gpioWaveTxAt () == armed) return;
+   __atomic_store_n (&DccNotifyAt, -1, __ATOMIC_RELEASE);
+
+   uint64_t signal = 1;
+   if (write (DccNotifyFd, &signal, sizeof(signal)) < 0) return;
+}
+
+static void pidcc_wave_watch (int enable) {
+
+   if (enable) {
+      __atomic_store_n (&DccNotifyAt, gpioWaveTxAt (), __ATOMIC_RELEASE);
+      if (!DccNotifyArmed) gpioSetAlertFunc (DccWaveGpioA, pidcc_wave_alert);
+      DccNotifyArmed = 1;
+   } else if (DccNotifyArmed) {
+      gpioSetAlertFunc (DccWaveGpioA, 0);
+      DccNotifyArmed = 0;
+   }
+}
+
+const char *pidcc_wave_initialize (int gpioa, int gpiob,
+                                   void (*debug) (const char *text)) {
 
    if (gpioa <= 0) return "Invalid pin number"; // Don't use GPIO 0.
    if (gpiob == gpioa) return "GPIO A and GPIO B must be different";
+   if (pidcc_wave_used (0, gpioa) || pidcc_wave_used (0, gpiob))
+      return "GPIO already used by another district";
 
    PidccWaveDebug = debug;
+   if (DccWaveGpioA > 0) pidcc_wave_watch (0);
    DccWaveGpioA = DccWaveGpioB = 0;
 
    if (! PigioInitialized) {
@@ -183,6 +723,12 @@ const char *pidcc_wave_initialize (int gpioa, int gpiob, int debug) {
          return "pigio initialization failed";
       }
       PigioInitialized = 1;
+
+      int i;
+      for (i = 0; i < DCCWAVECACHE; ++i) DccWaveCache[i].wave = -1;
+      for (i = 0; i < DCCSLOTWAVES; ++i) DccSlotWaves[i].wave = -1;
+      DccWaveIds = DccWaveTop = 0;
+      DccWaveMaxCbs = gpioWaveGetMaxCbs();
    }
 
    if (gpioSetMode(gpioa, PI_OUTPUT)) {
@@ -196,153 +742,1185 @@ const char *pidcc_wave_initialize (int gpioa, int gpiob, int debug) {
    DccWaveGpioA = gpioa;
    DccWaveGpioB = gpiob;
 
-   pidcc_wave_prepare (DccBit0, 100);
-   pidcc_wave_prepare (DccBit1, 58);
+   uint32_t on = pidcc_wave_mask (gpioa);
+   uint32_t off = pidcc_wave_mask (gpiob);
+   pidcc_wave_prepare (DccBit0, PIDCC_BIT0_USEC, on, off);
+   pidcc_wave_prepare (DccBit1, PIDCC_BIT1_USEC, on, off);
 
-   int i;
-   for (i = 0; i < 40; i += 2) {
-      DccPreamble[i] = DccBit1[0];
-      DccPreamble[i+1] = DccBit1[1];
-   }
-   DccPreamble[40].usDelay = 0; // End of preamble sequence.
+   // The pins changed: replace the waves built for the old ones.
+   pidcc_wave_retire (DccSeparatorWave);
+   DccSeparatorWave = -1;
+   pidcc_wave_retire (DccPreambleWave);
+   DccPreambleWave = -1;
+
+   const char *error = pidcc_wave_separator ();
+   if (error) return error;
+   error = pidcc_wave_preamble ();
+   if (error) return error;
 
+   pidcc_telemetry_start ();
+   if (DccBackgroundWave >= 0) return pidcc_wave_rebuild ();
    return pidcc_wave_background ();
 }
 
-static const char *pidcc_wave_append (DccPacket *packet,
-                                      const gpioPulse_t *pulse) {
+// Convert encoded bit runs into pigpio pulses, using the bit pulses of the
+// pins of one district.
+//
+static void pidcc_wave_convert (DccPacket *packet,
+                                const PidccEncoded *encoded,
+                                const gpioPulse_t *bit0,
+                                const gpioPulse_t *bit1) {
+
+  gpioPulse_t *pulse = packet->pulses;
+  int i;
+  for (i = 0; i < encoded->count; ++i) {
+     const gpioPulse_t *bit = encoded->runs[i].bit ? bit1 : bit0;
+     int count = encoded->runs[i].count;
+     while (count-- > 0) {
+        *(pulse++) = bit[0];
+        *(pulse++) = bit[1];
+     }
+  }
+  packet->count = pulse - packet->pulses;
+  packet->micros = pidcc_encode_microseconds (encoded);
+}
+
+// Convert the encoded bit runs into pigpio pulses, for the current pins.
+// The first run is the preamble, which is left out if looped.
+//
+static const char *pidcc_wave_format (DccPacket *packet,
+                                      int programming, int looped,
+                                      const unsigned char *data, int length) {
+
+  PidccEncoded encoded;
+  const char *error = pidcc_encode_packet (&encoded, programming, data, length);
+  if (error) return error;
+
+  if (looped) {
+     encoded.count -= 1;
+     memmove (encoded.runs, encoded.runs + 1, encoded.count * sizeof(PidccRun));
+  }
+  pidcc_wave_convert (packet, &encoded, DccBit0, DccBit1);
+  return 0;
+}
 
+static DccCachedWave *pidcc_wave_lookup (int programming,
+                                         const unsigned char *data,
+                                         int length) {
    int i;
-   for (i = packet->count; i < DCCMAXWAVE; ++i) {
-      if (pulse->usDelay == 0) break; // end of pulse data.
-      packet->pulses[i] = *(pulse++);
+   for (i = 0; i < DCCWAVECACHE; ++i) {
+      DccCachedWave *cached = DccWaveCache + i;
+      if (cached->wave < 0) continue;
+      if (cached->length != length) continue;
+      if (cached->programming != programming) continue;
+      if (cached->looped != DccChainMode) continue;
+      if (cached->gpioa != DccWaveGpioA) continue;
+      if (cached->gpiob != DccWaveGpioB) continue;
+      if (memcmp (cached->data, data, length)) continue;
+      return cached;
    }
-   if (i > DCCMAXWAVE) return "DCC packet too long";
-   packet->count = i;
    return 0;
 }
 
-static const char *pidcc_wave_appendByte (DccPacket *packet,
-                                          unsigned char byte) {
+// Delete a cached wave, except the ones being transmitted, to make room
+// for a new wave of the specified number of pulses (see WAVE CACHE): the
+// least recently used wave of the same size, else the highest wave if it
+// is cached, else (only with any set) the least recently used wave.
+// Return DCCEVICTTOP if the resources came back to pigpio, DCCEVICTSAME if
+// they are waiting for a wave of the same size, DCCEVICTANY if they may
+// not come back soon, or 0 if there was nothing to delete.
+//
+#define DCCEVICTTOP  1
+#define DCCEVICTSAME 2
+#define DCCEVICTANY  3
+
+static int pidcc_wave_evict (int pulses, int any) {
+
+   DccCachedWave *top = 0;
+   DccCachedWave *same = 0;
+   DccCachedWave *oldest = 0;
+   int i;
+   for (i = 0; i < DCCWAVECACHE; ++i) {
+      DccCachedWave *cached = DccWaveCache + i;
+      if (cached->wave < 0) continue;
+      if (pidcc_wave_inuse (cached->wave)) continue;
+      if (cached->wave == DccWaveIds - 1) top = cached;
+      unsigned int age = DccWaveCacheClock - cached->used;
+      if ((cached->pulses == pulses) &&
+          (cached->gpioa == DccWaveGpioA) && (cached->gpiob == DccWaveGpioB)) {
+         if ((!same) || (age > DccWaveCacheClock - same->used)) same = cached;
+      }
+      if ((!oldest) || (age > DccWaveCacheClock - oldest->used)) oldest = cached;
+   }
+   DccCachedWave *victim = same;
+   int result = DCCEVICTSAME;
+   if (!victim) {
+      victim = top;
+      result = DCCEVICTTOP;
+   }
+   if ((!victim) && any) {
+      victim = oldest;
+      result = DCCEVICTANY;
+   }
+   if (!victim) return 0;
+
+   pidcc_wave_debug ("pidcc_wave_evict(): deleting a cached wave");
+   pidcc_wave_delete (victim->wave);
+   victim->wave = -1;
+   DccWaveCacheEvictions += 1;
+   return result;
+}
+
+// Whether a new wave of the specified number of pulses would leave too
+// little room for the transmit ring, assuming the worst case of 3 DMA
+// control blocks per pulse for each new wave.
+//
+static int pidcc_wave_crowded (int pulses) {
+   if (DccWaveIds + DCCWAVERING >= PI_MAX_WAVES) return 1;
+   return DccWaveTop + (3 * pulses * DCCWAVERING) > DccWaveMaxCbs;
+}
 
+static DccCachedWave *pidcc_wave_free (int pulses) {
    int i;
-   const char *error;
-   for (i = 0x80; i > 0; i >>= 1) {
-      if (byte & i)
-         error = pidcc_wave_append (packet, DccBit1);
-      else
-         error = pidcc_wave_append (packet, DccBit0);
-      if (error) return error;
+   for (i = 0; i < DCCWAVECACHE; ++i) {
+      if (DccWaveCache[i].wave < 0) return DccWaveCache + i;
    }
-   return 0;
+   if (!pidcc_wave_evict (pulses, 1)) return 0;
+   return pidcc_wave_free (pulses);
 }
 
-static const char *pidcc_wave_format (DccPacket *packet,
+static const char *pidcc_wave_create (const DccPacket *packet,
                                       int programming,
-                                      const unsigned char *data, int length) {
+                                      const unsigned char *data, int length,
+                                      DccCachedWave **created) {
 
-  packet->count = 0;
-  packet->retry = 0; // For now, in case of error.
-  unsigned char detect = 0;
+   DccCachedWave *cached = pidcc_wave_free (packet->count);
+   if (!cached) return "no wave available";
 
-  // A programming packet requires 20 bits of preamble, a normal packet
-  // requires 14 bits (this generates 15).
-  gpioPulse_t *preamble = DccPreamble + (programming?0:10);
-  const char *error = pidcc_wave_append (packet, preamble);
-  if (error) return error;
+   // A wave of the same size makes room at once: pigpio reuses it. Each
+   // wave deleted from the top gives some room back.
+   while (pidcc_wave_crowded (packet->count)) {
+      if (pidcc_wave_evict (packet->count, 0) != DCCEVICTTOP) break;
+   }
 
-  int i;
-  for (i = 0; i < length; ++i) {
-     error = pidcc_wave_append (packet, DccBit0); // Start bit.
-     if (error) return error;
-     error = pidcc_wave_appendByte (packet, data[i]);
-     if (error) return error;
-     detect ^= data[i];
-  }
+   int wave;
+   for (;;) {
+      if (gpioWaveAddNew()) return "gpioWaveAddNew(transmit) failed";
 
-  error = pidcc_wave_append (packet, DccBit0);
-  if (error) return error;
-  error = pidcc_wave_appendByte (packet, detect);
-  if (error) return error;
+      int result = gpioWaveAddGeneric(packet->count,
+                                      (gpioPulse_t *)(packet->pulses));
+      if (result < 0) return "gpioWaveAddGeneric(transmit) failed";
 
-  error = pidcc_wave_append (packet, DccBit1); // Stop bit.
+      wave = pidcc_wave_new ();
+      if (wave >= 0) break;
+
+      // Not enough resources left in pigpio: free a wave and retry.
+      if (!pidcc_wave_evict (packet->count, 0))
+         return "gpioWaveCreate(transmit) failed";
+   }
+
+   cached->wave = wave;
+   cached->programming = programming;
+   cached->looped = DccChainMode;
+   cached->gpioa = DccWaveGpioA;
+   cached->gpiob = DccWaveGpioB;
+   cached->length = length;
+   memcpy (cached->data, data, length);
+   cached->totalTime = gpioWaveGetMicros();
+   cached->pulses = packet->count;
+
+   *created = cached;
+   return 0;
+}
+
+// Send the first segment, and all its repeats, as one chain that ends
+// with the background wave repeating forever.
+//
+static const char *pidcc_wave_transmitChain (DccSegment *segment) {
+
+  // After a pin change, the background wave is built here: the previous
+  // chain is still looping the old one.
+  const char *error = pidcc_wave_backgroundBuild ();
   if (error) return error;
 
-  // A subsequent DCC packet must not be sent within 5 msec after the previous
-  // packet. To ensure this, follow the packet with a 5 msec long bit "0"
-  // stream ("0" lasts 200 usec, therefore we need 25 of them).
-  //
-  // Apparently a DCC generator must keep the power line in AC mode by sending
-  // a continuous bit "0" signal. The stretched bit "0" was intended to force
-  // a DC power level for compatibility with analog systems (now deprecated).
-  //
-  for (i = 0; i < 25; ++i) {
-     error = pidcc_wave_append (packet, DccBit0);
-     if (error) return error;
+  char chain[24];
+  int length = 0;
+
+  if (segment->gap) chain[length++] = DccSeparatorWave;
+
+  if (segment->wave == DccPowerOffWave) {
+     chain[length++] = segment->wave;
+  } else {
+     chain[length++] = 255;
+     chain[length++] = 0;
+     if (segment->preamble) {
+        chain[length++] = 255;
+        chain[length++] = 0;
+        chain[length++] = DccPreambleWave;
+        chain[length++] = 255;
+        chain[length++] = 1;
+        chain[length++] = segment->preamble;
+        chain[length++] = 0;
+     }
+     chain[length++] = segment->wave;
+     chain[length++] = DccSeparatorWave;
+     chain[length++] = 255;
+     chain[length++] = 1;
+     chain[length++] = segment->repeat & 0xff;
+     chain[length++] = segment->repeat >> 8;
   }
+  chain[length++] = 255;
+  chain[length++] = 0;
+  chain[length++] = DccBackgroundWave;
+  chain[length++] = 255;
+  chain[length++] = 3;
+  DccChainBackground = DccBackgroundWave;
+
+  int result = gpioWaveChain (chain, length);
+  if (result < 0) return "gpioWaveChain(transmit) failed";
+
+  segment->sent = 1;
+  segment->chained = 1;
+  segment->start = pidcc_wave_now ();
+  segment->end = segment->start + segment->totalTime;
+  DccChainRunning = 1;
+  pidcc_latency_started (segment->trace,
+                         segment->start + (segment->gap ? DccSeparatorTime : 0));
+  return 0;
+}
+
+// Send the first segment of the ring, to start after the current
+// background cycle.
+//
+static const char *pidcc_wave_transmit (DccSegment *segment) {
+
+  if (DccChainMode) return pidcc_wave_transmitChain (segment);
+
+  int result = gpioWaveTxSend (segment->wave, PI_WAVE_MODE_ONE_SHOT_SYNC);
+  if (result < 0) return "gpioWaveTxSend(transmit) failed";
 
-  // Plan to repeat the packet a few times, as per the DCC standard.
-  packet->retry = programming ? 5 : 2;
+  // The segment starts at the end of the current background cycle.
+  segment->sent = 1;
+  segment->start = pidcc_wave_now () + pidcc_tuning_get (PIDCC_TUNING_SWITCH);
+  segment->end = segment->start + segment->totalTime;
+  DccBackgroundLinked = 0;
   return 0;
 }
 
-static const char *pidcc_wave_transmit (void) {
+// Report how the time of this segment was used, up to the specified end
+// (the segment may have been cut short). A chain is split into its
+// separators, first transmission and repeats.
+//
+static void pidcc_wave_account (const DccSegment *segment, long long end) {
 
-  if (gpioWaveAddNew()) return "gpioWaveAddNew(transmit) failed";
+   if (!(segment->started || segment->chained)) return; // Never went out.
 
-  int result = gpioWaveAddGeneric(DccPendingPacket.count,
-                                  DccPendingPacket.pulses);
-  if (result < 0) return "gpioWaveAddGeneric(transmit) failed";
+   long long remaining = end - segment->start;
+   if (remaining <= 0) return;
 
-  DccPendingWave = gpioWaveCreate();
-  if (DccPendingWave < 0) return "gpioWaveCreate(transmit) failed";
-  DccPendingPacket.totalTime = gpioWaveGetMicros();
+   if (!segment->chained || (segment->wave == DccPowerOffWave)) {
+      pidcc_telemetry_line (segment->usage, segment->address, remaining);
+      return;
+   }
+   if (segment->gap) {
+      long long used = (remaining < DccSeparatorTime) ? remaining : DccSeparatorTime;
+      pidcc_telemetry_line (PIDCC_LINE_SEPARATOR, segment->address, used);
+      remaining -= used;
+   }
+   int packetTime = ((segment->totalTime - (segment->gap ? DccSeparatorTime : 0))
+                        / segment->repeat) - DccSeparatorTime;
+   int usage = segment->usage;
+   int i;
+   for (i = 0; (i < segment->repeat) && (remaining > 0); ++i) {
+      long long used = (remaining < packetTime) ? remaining : packetTime;
+      pidcc_telemetry_line (usage, segment->address, used);
+      remaining -= used;
+      if (usage == PIDCC_LINE_PACKET) usage = PIDCC_LINE_REPEAT;
+      if (remaining <= 0) break;
+      used = (remaining < DccSeparatorTime) ? remaining : DccSeparatorTime;
+      pidcc_telemetry_line (PIDCC_LINE_SEPARATOR, segment->address, used);
+      remaining -= used;
+   }
+}
 
-  result = gpioWaveTxSend (DccPendingWave, PI_WAVE_MODE_ONE_SHOT_SYNC);
-  if (result < 0) return "gpioWaveTxSend(transmit) failed";
+static void pidcc_wave_pop (void) {
 
-  DccTransmitStarting = 1;
-  return 0;
+   DccSegment *first = pidcc_wave_segment (0);
+   long long now = pidcc_wave_now ();
+   long long end = (first->end < now) ? first->end : now; // If cut short.
+   pidcc_wave_account (first, end);
+
+   if (first->wave == DccPowerOffWave) {
+      pidcc_wave_delete (DccPowerOffWave);
+      DccPowerOffWave = -1;
+   }
+   if (first->trace) pidcc_latency_ended (first->trace, end);
+   DccRingFirst = (DccRingFirst + 1) % DCCWAVESEGMENTS;
+   DccRingCount -= 1;
+   DccSuccessorLinked = 0;
+   DccBackgroundLinked = 0;
+}
+
+// Make sure that something is scheduled to follow the segment currently
+// on the track, so that the signal never stops. That is the next segment
+// in the ring if there is one, or else the background wave.
+//
+// A wave cannot follow itself (the transition would not be visible),
+// so the background wave is used as a spacer in that case.
+//
+static void pidcc_wave_link (void) {
+
+   if (DccRingCount <= 0) return;
+
+   DccSegment *first = pidcc_wave_segment (0);
+
+   if (!first->sent) {
+      const char *error = pidcc_wave_transmit (first);
+      if (error) {
+         pidcc_wave_debug (error);
+         pidcc_wave_pop ();
+      }
+      return;
+   }
+   if (first->chained || !first->started) return;
+   if (DccSuccessorLinked) return;
+
+   if (DccRingCount > 1) {
+      DccSegment *next = pidcc_wave_segment (1);
+      if (next->wave != first->wave) {
+         pidcc_wave_debug ("pidcc_wave_link(): link next segment");
+         if (gpioWaveTxSend (next->wave, PI_WAVE_MODE_ONE_SHOT_SYNC) >= 0) {
+            next->sent = 1;
+            next->start = first->end;
+            next->end = next->start + next->totalTime;
+            DccSuccessorLinked = 1;
+            return;
+         }
+      }
+   }
+   if (!DccBackgroundLinked) {
+      pidcc_wave_debug ("pidcc_wave_link(): link background");
+      pidcc_wave_background ();
+      DccBackgroundLinked = 1;
+   }
+}
+
+static void pidcc_wave_fill (DccSegment *segment,
+                             int wave, int totalTime, int usage,
+                             int address, unsigned int trace) {
+   segment->wave = wave;
+   segment->trace = trace;
+   segment->usage = usage;
+   segment->address = address;
+   segment->length = 0;
+   segment->repeat = 1;
+   segment->gap = 0;
+   segment->preamble = 0;
+   segment->totalTime = totalTime;
+   segment->sent = 0;
+   segment->started = 0;
+   segment->chained = 0;
+   segment->inserted = 0;
+   memset (segment->carried, 0, sizeof(segment->carried));
+}
+
+static const char *pidcc_wave_push (int wave, int totalTime, int usage,
+                                    int address, unsigned int trace) {
+
+   DccSegment *segment = pidcc_wave_segment (DccRingCount);
+   pidcc_wave_fill (segment, wave, totalTime, usage, address, trace);
+   DccRingCount += 1;
+
+   if (DccRingCount == 1) {
+      const char *error = pidcc_wave_transmit (segment);
+      if (error) {
+         DccRingCount -= 1;
+         return error;
+      }
+      return 0;
+   }
+   pidcc_wave_link ();
+   return 0;
+}
+
+// Record which packet the last segment queued transmits (see
+// pidcc_wave_abort()).
+//
+static void pidcc_wave_packet (const unsigned char *data, int length) {
+   DccSegment *segment = pidcc_wave_segment (DccRingCount - 1);
+   memcpy (segment->data, data, length);
+   segment->length = length;
+}
+
+int pidcc_wave_ready (void) {
+
+   if (!PigioInitialized) return 0;
+   if (DccRingCount <= 0) return 1;
+
+   // A chain cannot be extended: wait for it to complete.
+   if (DccChainMode || pidcc_wave_segment(0)->chained) return 0;
+
+   if (DccPowerOffWave >= 0) return 0;
+
+   // Leave room for a separator and a packet.
+   return DccRingCount < DCCWAVERING - 1;
+}
+
+int pidcc_wave_chaining (void) {
+   return DccChainMode;
+}
+
+// Follow a transmission with bit "0" pulses up to the slot duration. The
+// last bit is stretched by the remainder, less than one bit "0", so that
+// no half bit gets shorter than a bit "0" (see pidcc_wave_slot()).
+//
+static void pidcc_wave_pad (DccPacket *stream, int micros,
+                            const gpioPulse_t *bit0) {
+
+   int bits = (micros - stream->micros) / (2 * PIDCC_BIT0_USEC);
+   if (bits <= 0) return;
+
+   int remainder = (micros - stream->micros) % (2 * PIDCC_BIT0_USEC);
+   gpioPulse_t *pulse = stream->pulses + stream->count;
+   while (bits-- > 0) {
+      *(pulse++) = bit0[0];
+      *(pulse++) = bit0[1];
+   }
+   pulse[-2].usDelay += remainder / 2;
+   pulse[-1].usDelay += remainder - (remainder / 2);
+   stream->count = pulse - stream->pulses;
+   stream->micros = micros;
+}
+
+// Merge the streams of all districts, which all have the same duration,
+// into a single list of pulses, in time order. A pulse starts wherever
+// one of the districts has an edge. Return the number of pulses.
+//
+static int pidcc_wave_merge (gpioPulse_t *merged) {
+
+   int cursor[PIDCC_DISTRICTS];
+   int left[PIDCC_DISTRICTS]; // Microseconds left in the current pulse.
+   int i;
+
+   gpioPulse_t *pulse = merged;
+   pulse->gpioOn = pulse->gpioOff = 0;
+   for (i = 0; i < PIDCC_DISTRICTS; ++i) {
+      cursor[i] = 0;
+      left[i] = 0;
+      if (DccStreams[i].count <= 0) continue;
+      pulse->gpioOn |= DccStreams[i].pulses[0].gpioOn;
+      pulse->gpioOff |= DccStreams[i].pulses[0].gpioOff;
+      left[i] = DccStreams[i].pulses[0].usDelay;
+   }
+   for (;;) {
+      int step = 0;
+      for (i = 0; i < PIDCC_DISTRICTS; ++i) {
+         if ((left[i] > 0) && ((step <= 0) || (left[i] < step))) step = left[i];
+      }
+      if (step <= 0) break; // All streams are complete.
+
+      pulse->usDelay = step;
+      pulse += 1;
+      pulse->gpioOn = pulse->gpioOff = 0;
+      for (i = 0; i < PIDCC_DISTRICTS; ++i) {
+         if (left[i] <= 0) continue;
+         left[i] -= step;
+         if (left[i] > 0) continue;
+         if (++cursor[i] >= DccStreams[i].count) continue;
+         const gpioPulse_t *next = DccStreams[i].pulses + cursor[i];
+         pulse->gpioOn |= next->gpioOn;
+         pulse->gpioOff |= next->gpioOff;
+         left[i] = next->usDelay;
+      }
+   }
+   return pulse - merged;
+}
+
+// Split pulses in two, from the end, until there are target pulses (or
+// no pulse left long enough). The second half sets and clears the same
+// pins again, which changes nothing on the track. Return the new count.
+//
+static int pidcc_wave_split (gpioPulse_t *pulses, int count, int target) {
+
+   while (count < target) {
+      int splits = 0;
+      int i;
+      for (i = 0; i < count; ++i) {
+         if (pulses[i].usDelay >= 2 * DCCSLOTSPLIT) splits += 1;
+      }
+      if (splits <= 0) break;
+      if (splits > target - count) splits = target - count;
+      int total = count + splits;
+
+      // Work backward, so that every pulse moves up before it is overwritten.
+      int to = count + splits - 1;
+      for (i = count - 1; i >= 0; --i) {
+         gpioPulse_t pulse = pulses[i];
+         if ((splits > 0) && (pulse.usDelay >= 2 * DCCSLOTSPLIT)) {
+            int half = pulse.usDelay / 2;
+            pulses[to] = pulse;
+            pulses[to--].usDelay -= half;
+            pulse.usDelay = half;
+            splits -= 1;
+         }
+         pulses[to--] = pulse;
+      }
+      count = total;
+   }
+   return count;
+}
+
+// Create the wave of the slot just merged, in place of a slot wave that is
+// no longer transmitted: preferably one of the same size, which pigpio
+// reuses as is, else an unused entry, else the one with the highest ID.
+//
+static const char *pidcc_wave_slotCreate (int count, int *created) {
+
+   int sets = 0;
+   int clears = 0;
+   int i;
+   for (i = 0; i < count; ++i) {
+      if (DccMerged[i].gpioOn) sets += 1;
+      if (DccMerged[i].gpioOff) clears += 1;
+   }
+   DccSlotWave *same = 0;
+   DccSlotWave *unused = 0;
+   DccSlotWave *highest = 0;
+   for (i = 0; i < DCCSLOTWAVES; ++i) {
+      DccSlotWave *slot = DccSlotWaves + i;
+      if (slot->wave < 0) {
+         if (!unused) unused = slot;
+         continue;
+      }
+      if (pidcc_wave_inuse (slot->wave)) continue;
+      if ((slot->pulses == count) &&
+          (slot->sets == sets) && (slot->clears == clears)) same = slot;
+      if ((!highest) || (slot->wave > highest->wave)) highest = slot;
+   }
+   DccSlotWave *slot = same ? same : (unused ? unused : highest);
+   if (!slot) return "no slot wave available";
+
+   if (slot->wave >= 0) {
+      pidcc_wave_delete (slot->wave);
+      slot->wave = -1;
+   }
+   int wave;
+   for (;;) {
+      if (gpioWaveAddNew()) return "gpioWaveAddNew(slot) failed";
+
+      int result = gpioWaveAddGeneric(count, DccMerged);
+      if (result < 0) return "gpioWaveAddGeneric(slot) failed";
+
+      wave = pidcc_wave_new ();
+      if (wave >= 0) break;
+
+      // Not enough resources left in pigpio: free cached waves and retry.
+      if (!pidcc_wave_evict (count, 1)) return "gpioWaveCreate(slot) failed";
+   }
+   slot->wave = wave;
+   slot->pulses = count;
+   slot->sets = sets;
+   slot->clears = clears;
+   *created = wave;
+   return 0;
+}
+
+// The extra districts are gone: delete the slot waves.
+//
+static void pidcc_wave_slotRelease (void) {
+   int i;
+   for (i = 0; i < DCCSLOTWAVES; ++i) {
+      pidcc_wave_retire (DccSlotWaves[i].wave);
+      DccSlotWaves[i].wave = -1;
+   }
+}
+
+// Build the wave of a slot: the transmission of district 0 is already
+// formatted in the first stream, possibly empty, and the transmissions
+// of the extra districts are in DccSlotEncoded.
+//
+static const char *pidcc_wave_slotBuild (int *wave, int *totalTime) {
+
+   int micros = DccStreams[0].micros;
+   int i;
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+      DccPacket *stream = DccStreams + i;
+      stream->count = stream->micros = 0;
+      if (DccDistrictGpioA[i] <= 0) continue;
+      if (DccSlotCarried[i])
+         pidcc_wave_convert (stream, DccSlotEncoded + i,
+                             DccDistrictBit0[i], DccDistrictBit1[i]);
+      if (stream->micros > micros) micros = stream->micros;
+   }
+   if (micros <= 0) return "nothing to transmit";
+
+   // What follows a shorter transmission must be at least one bit "0":
+   // if not, the slot is made longer by one bit.
+   for (i = 0; i < PIDCC_DISTRICTS; ++i) {
+      if ((i > 0) && (DccDistrictGpioA[i] <= 0)) continue;
+      int pad = micros - DccStreams[i].micros;
+      if ((pad > 0) && (pad < 2 * PIDCC_BIT0_USEC)) {
+         micros += 2 * PIDCC_BIT0_USEC;
+         break;
+      }
+   }
+   pidcc_wave_pad (DccStreams, micros, DccBit0);
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+      if (DccDistrictGpioA[i] <= 0) continue;
+      pidcc_wave_pad (DccStreams + i, micros, DccDistrictBit0[i]);
+   }
+   int count = pidcc_wave_merge (DccMerged);
+   int quanta = (count + DCCSLOTQUANTUM - 1) / DCCSLOTQUANTUM;
+   count = pidcc_wave_split (DccMerged, count, quanta * DCCSLOTQUANTUM);
+
+   const char *error = pidcc_wave_slotCreate (count, wave);
+   if (error) return error;
+
+   *totalTime = gpioWaveGetMicros();
+   return 0;
+}
+
+// Build the wave for one slot (see MULTIPLE DISTRICTS) and queue it in the
+// transmit ring. The transmission of district 0 is already formatted in
+// the first stream, possibly empty; the next transmission of each extra
+// district is taken now.
+//
+static const char *pidcc_wave_slot (int usage, int address,
+                                    unsigned int trace) {
+   int i;
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+      DccSlotCarried[i] = (DccDistrictGpioA[i] > 0) &&
+                          pidcc_district_next (i, DccSlotEncoded + i);
+   }
+   int wave;
+   int totalTime;
+   const char *error = pidcc_wave_slotBuild (&wave, &totalTime);
+   if (error) return error;
+
+   error = pidcc_wave_push (wave, totalTime, usage, address, trace);
+   if (error) return error;
+
+   // Keep what the extra districts transmit, see pidcc_wave_reslot().
+   DccSegment *segment = pidcc_wave_segment (DccRingCount - 1);
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+      segment->carried[i] = DccSlotCarried[i];
+      if (DccSlotCarried[i]) segment->districts[i] = DccSlotEncoded[i];
+   }
+   return 0;
+}
+
+static void pidcc_wave_gap (void) {
+   PidccEncoded encoded;
+   encoded.runs[0].bit = 0;
+   encoded.runs[0].count = 25; // See pidcc_wave_separator().
+   encoded.count = 1;
+   pidcc_wave_convert (DccStreams, &encoded, DccBit0, DccBit1);
+}
+
+// Send a packet as slots, with the extra districts (see pidcc_wave_send()).
+//
+static const char *pidcc_wave_sendSlots (int programming,
+                                         const unsigned char *data,
+                                         int length, int repeat, int gap,
+                                         int usage, unsigned int trace) {
+
+   long long start = pidcc_wave_now ();
+   int address = pidcc_packet_address (data, length);
+   const char *error;
+
+   if (gap) {
+      pidcc_wave_gap ();
+      error = pidcc_wave_slot (PIDCC_LINE_SEPARATOR, address, 0);
+      if (error) return error;
+   }
+   while (repeat-- > 0) {
+      // The stream is padded when the slot is built: format it again.
+      error = pidcc_wave_format (DccStreams, programming, 0, data, length);
+      if (error) return error;
+      pidcc_latency_built (trace, start);
+
+      if (pidcc_latency_pending (trace, 1) > 0) usage = PIDCC_LINE_REPEAT;
+      error = pidcc_wave_slot (usage, address, trace);
+      if (error) {
+         pidcc_latency_ended (trace, pidcc_wave_now ());
+         return error;
+      }
+      pidcc_wave_packet (data, length);
+      if (repeat <= 0) break;
+      pidcc_wave_gap ();
+      error = pidcc_wave_slot (PIDCC_LINE_SEPARATOR, address, 0);
+      if (error) return error;
+   }
+   return 0;
+}
+
+// Keep the extra districts going while district 0 has nothing to send.
+// One slot is kept waiting behind the one on the track, so that the next
+// packet of district 0 waits for one slot at most.
+//
+static void pidcc_wave_carry (void) {
+
+   if (DccDistrictCount <= 0) return;
+   if (DccPowerOffWave >= 0) return;
+
+   while ((DccRingCount < 2) && pidcc_district_pending ()) {
+      DccStreams[0].count = DccStreams[0].micros = 0;
+      const char *error =
+         pidcc_wave_slot (PIDCC_LINE_BACKGROUND, PIDCC_NOADDRESS, 0);
+      if (error) {
+         pidcc_wave_debug (error);
+         break;
+      }
+   }
+}
+
+// Return the wave for this packet, from the cache if possible.
+//
+static const char *pidcc_wave_build (int programming,
+                                     const unsigned char *data, int length,
+                                     unsigned int trace,
+                                     DccCachedWave **built) {
+
+   long long start = pidcc_wave_now ();
+   DccCachedWave *cached = pidcc_wave_lookup (programming, data, length);
+   if (cached) {
+      pidcc_wave_debug ("pidcc_wave_build(): cached");
+      DccWaveCacheHits += 1;
+   } else {
+      pidcc_wave_debug ("pidcc_wave_build(): new wave");
+      DccWaveCacheMisses += 1;
+      const char *error =
+           pidcc_wave_format (&DccPendingPacket,
+                              programming, DccChainMode, data, length);
+      if (error) return error;
+
+      error = pidcc_wave_create (&DccPendingPacket,
+                                 programming, data, length, &cached);
+      if (error) return error;
+   }
+   cached->used = ++DccWaveCacheClock;
+   *built = cached;
+   pidcc_latency_built (trace, start);
+   return 0;
+}
+
+const char *pidcc_wave_district (int district, int gpioa, int gpiob) {
+
+   if (!PigioInitialized) return "Not initialized yet";
+   if ((district <= 0) || (district >= PIDCC_DISTRICTS))
+      return "invalid district";
+   if (DccChainMode) return "districts are not available in chain mode";
+
+   if (gpioa > 0) {
+      if (gpiob == gpioa) return "GPIO A and GPIO B must be different";
+      if (pidcc_wave_used (district, gpioa) ||
+          pidcc_wave_used (district, gpiob))
+         return "GPIO already used by another district";
+      if (gpioSetMode(gpioa, PI_OUTPUT)) return "gpioSetMode(gpioa) failed";
+      if (gpiob) {
+         if (gpioSetMode(gpiob, PI_OUTPUT)) return "gpioSetMode(gpiob) failed";
+      }
+      uint32_t on = pidcc_wave_mask (gpioa);
+      uint32_t off = pidcc_wave_mask (gpiob);
+      pidcc_wave_prepare (DccDistrictBit0[district], PIDCC_BIT0_USEC, on, off);
+      pidcc_wave_prepare (DccDistrictBit1[district], PIDCC_BIT1_USEC, on, off);
+   } else {
+      gpioa = gpiob = 0;
+      pidcc_district_clear (district);
+   }
+   if (DccDistrictGpioA[district] > 0) DccDistrictCount -= 1;
+   if (gpioa > 0) DccDistrictCount += 1;
+   DccDistrictGpioA[district] = gpioa;
+   DccDistrictGpioB[district] = gpiob;
+
+   // The cached waves are not used with multiple districts: give their
+   // DMA control blocks to the slot waves.
+   if (DccDistrictCount > 0) {
+      while (pidcc_wave_evict (0, 1)) ;
+   } else {
+      pidcc_wave_slotRelease ();
+   }
+   return pidcc_wave_rebuild ();
+}
+
+int pidcc_wave_configured (int district) {
+   if (district == 0) return DccWaveGpioA > 0;
+   if ((district < 0) || (district >= PIDCC_DISTRICTS)) return 0;
+   return DccDistrictGpioA[district] > 0;
 }
 
 const char *pidcc_wave_send (int programming,
-                             const unsigned char *data, int length) {
+                             const unsigned char *data, int length,
+                             int repeat, int gap, unsigned int trace) {
 
    if (!PigioInitialized) return "Not initialized yet";
    if (DccWaveGpioA <= 0) return "No GPIO pin";
 
-   if (DccPendingWave >= 0) return "busy";
+   if (!pidcc_wave_ready ()) return "busy";
+   if (length > DCCMAXDATA) return "DCC packet too long";
+   if (repeat < 1) repeat = 1;
 
-   pidcc_wave_debug ("pidcc_wave_send(): new transmission");
+   // A packet to the decoder of an emergency stop inserted by
+   // pidcc_wave_abort() needs a separator: the scheduler does not know.
+   if ((!gap) && (!DccChainMode) && (DccRingCount > 0)) {
+      DccSegment *last = pidcc_wave_segment (DccRingCount - 1);
+      if (last->inserted &&
+          (last->address == pidcc_packet_address (data, length))) gap = 1;
+   }
+
+   // Each repeat requires its own separator, except in chain mode.
+   if (!DccChainMode) {
+      int needed = (gap ? 1 : 0) + (2 * repeat) - 1;
+      if (DccRingCount + needed > DCCWAVERING) return "busy";
+   }
+
+   int usage = PIDCC_LINE_REFRESH;
+   if (DccWaveIdling) usage = PIDCC_LINE_IDLE;
+   else if (trace) usage = PIDCC_LINE_PACKET;
+
+   if (DccDistrictCount > 0)
+      return pidcc_wave_sendSlots (programming, data, length,
+                                   repeat, gap, usage, trace);
+
+   DccCachedWave *cached;
    const char *error =
-           pidcc_wave_format (&DccPendingPacket, programming, data, length);
+      pidcc_wave_build (programming, data, length, trace, &cached);
    if (error) return error;
 
-/*
-printf ("New DCC frame:\n");
-int i;
-for (i = 0; i < DccPendingPacket.count; ++i) {
-   printf ("   %c%d usec\n", (i&1) ? '-' : '_', DccPendingPacket.pulses[i].usDelay);
+   int address = pidcc_packet_address (data, length);
+
+   if (DccChainMode) {
+      // The whole burst is one segment: this can only be the first one.
+      DccSegment *segment = pidcc_wave_segment (0);
+      segment->wave = cached->wave;
+      segment->trace = trace;
+      segment->address = address;
+      memcpy (segment->data, data, length);
+      segment->length = length;
+      segment->usage = usage;
+      segment->repeat = repeat;
+      segment->gap = gap;
+      segment->preamble = cached->looped ? pidcc_encode_preamble (programming)
+                                         : 0;
+      segment->totalTime = (gap ? DccSeparatorTime : 0)
+                     + (repeat * (cached->totalTime + DccSeparatorTime
+                                  + (segment->preamble * DccPreambleTime)));
+      segment->sent = segment->started = segment->chained = 0;
+         DccRingCount = 1;
+      if (pidcc_latency_pending (trace, 1) > 0) segment->usage = PIDCC_LINE_REPEAT;
+      error = pidcc_wave_transmitChain (segment);
+      if (error) {
+         DccRingCount = 0;
+         pidcc_latency_ended (trace, pidcc_wave_now ());
+      }
+      return error;
+   }
+
+   if (gap) {
+      error = pidcc_wave_push (DccSeparatorWave, DccSeparatorTime,
+                               PIDCC_LINE_SEPARATOR, address, 0);
+      if (error) return error;
+   }
+   while (repeat-- > 0) {
+      if (pidcc_latency_pending (trace, 1) > 0) usage = PIDCC_LINE_REPEAT;
+      error = pidcc_wave_push (cached->wave, cached->totalTime,
+                               usage, address, trace);
+      if (error) {
+         pidcc_latency_ended (trace, pidcc_wave_now ());
+         return error;
+      }
+      pidcc_wave_packet (data, length);
+      if (repeat <= 0) break;
+      error = pidcc_wave_push (DccSeparatorWave, DccSeparatorTime,
+                               PIDCC_LINE_SEPARATOR, address, 0);
+      if (error) return error;
+   }
+   return 0;
 }
-*/
-   return pidcc_wave_transmit ();
+
+const char *pidcc_wave_stage (int programming,
+                              const unsigned char *data, int length,
+                              unsigned int trace) {
+
+   if (!PigioInitialized) return "Not initialized yet";
+   if (DccWaveGpioA <= 0) return "No GPIO pin";
+   if (length > DCCMAXDATA) return "DCC packet too long";
+
+   if (DccDistrictCount > 0) return 0; // Slots are built when sent.
+
+   if (pidcc_wave_lookup (programming, data, length)) {
+      pidcc_latency_built (trace, pidcc_wave_now ());
+      return 0;
+   }
+   DccCachedWave *cached;
+   return pidcc_wave_build (programming, data, length, trace, &cached);
 }
 
 void pidcc_wave_idle (void) {
    static unsigned char idlepacket[] = {255, 0};
-   const char *error = pidcc_wave_send (0, idlepacket, 2);
-   if (error) return;
-   DccPendingPacket.retry = 0;
+   DccWaveIdling = 1;
+   pidcc_wave_send (0, idlepacket, 2, 1, 0, 0);
+   DccWaveIdling = 0;
+}
+
+const char *pidcc_wave_chain (int enable) {
+
+   enable = enable ? 1 : 0;
+   if (enable == DccChainMode) return 0;
+   if (enable && (DccDistrictCount > 0))
+      return "chain mode is not available with multiple districts";
+   DccChainMode = enable;
+
+   // A chain cannot be interrupted cleanly: the change only takes effect
+   // after the current transmission. When leaving chain mode, replace the
+   // background chain with the regular background wave.
+   if (!enable && PigioInitialized && (DccRingCount <= 0)) {
+      if (DccChainRunning) {
+         gpioWaveTxStop ();
+         DccChainRunning = 0;
+         pidcc_wave_background ();
+      }
+   }
+   return 0;
+}
+
+// Return 1 if the emergency stop makes the packet of this segment obsolete.
+//
+static int pidcc_wave_obsolete (const DccSegment *segment,
+                                const unsigned char *stop, int length) {
+   if (segment->length <= 0) return 0;
+   return pidcc_packet_stops (stop, length, segment->data, segment->length);
+}
+
+// Return 1 if the segment at that position transmits a packet to that
+// decoder, which then must be kept 5 ms apart from the emergency stop.
+//
+static int pidcc_wave_apart (int index, int address) {
+   if ((index < 0) || (index >= DccRingCount)) return 0;
+   if (address == PIDCC_NOADDRESS) return 0;
+   DccSegment *segment = pidcc_wave_segment (index);
+   return (segment->length > 0) && (segment->address == address);
+}
+
+// Remove a segment that pigpio does not have.
+//
+static void pidcc_wave_remove (int index) {
+
+   DccSegment *segment = pidcc_wave_segment (index);
+   if (segment->trace) pidcc_latency_ended (segment->trace, pidcc_wave_now ());
+
+   for (; index < DccRingCount - 1; ++index) {
+      *pidcc_wave_segment (index) = *pidcc_wave_segment (index + 1);
+   }
+   DccRingCount -= 1;
+}
+
+// Build a slot again from what it transmits (see pidcc_wave_abort()).
+// When extended is set, the packets get the longer preamble of a
+// programming packet.
+//
+static const char *pidcc_wave_reslot (DccSegment *segment, int extended) {
+
+   const char *error = 0;
+   int i;
+   for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+      DccSlotCarried[i] = segment->carried[i];
+      if (!segment->carried[i]) continue;
+      DccSlotEncoded[i] = segment->districts[i];
+      if (extended && DccSlotEncoded[i].runs[0].bit)
+         DccSlotEncoded[i].runs[0].count = pidcc_encode_preamble (1);
+   }
+   if (segment->length > 0)
+      error = pidcc_wave_format (DccStreams, extended, 0,
+                                 segment->data, segment->length);
+   else if (segment->usage == PIDCC_LINE_SEPARATOR)
+      pidcc_wave_gap ();
+   else
+      DccStreams[0].count = DccStreams[0].micros = 0;
+   if (error) return error;
+
+   segment->wave = -1; // Its slot wave may be reused.
+   return pidcc_wave_slotBuild (&segment->wave, &segment->totalTime);
+}
+
+// Replace the transmission of an obsolete packet with a separator, which
+// keeps the packets around it apart. A slot keeps what it carries for the
+// extra districts. Return 0 on success, or an error message on failure.
+//
+static const char *pidcc_wave_blank (DccSegment *segment, int extended) {
+
+   if (segment->trace) pidcc_latency_ended (segment->trace, pidcc_wave_now ());
+   segment->trace = 0;
+   segment->length = 0;
+   segment->usage = PIDCC_LINE_SEPARATOR;
+
+   if (DccDistrictCount > 0) return pidcc_wave_reslot (segment, extended);
+
+   segment->wave = DccSeparatorWave;
+   segment->totalTime = DccSeparatorTime;
+   return 0;
+}
+
+// Insert one transmission of the emergency stop (or a separator if data
+// is 0) at that position in the ring. On the extra districts, a slot is
+// filled with bits "0": their own transmissions stay in order. When
+// extended is set, the stop gets the longer preamble of a programming
+// packet.
+//
+static const char *pidcc_wave_insert (int index, int address, int extended,
+                                      const unsigned char *data, int length) {
+   int wave;
+   int totalTime;
+   const char *error = 0;
+
+   if (DccDistrictCount > 0) {
+      int i;
+      for (i = 1; i < PIDCC_DISTRICTS; ++i) DccSlotCarried[i] = 0;
+      if (data)
+         error = pidcc_wave_format (DccStreams, extended, 0, data, length);
+      else pidcc_wave_gap ();
+      if (!error) error = pidcc_wave_slotBuild (&wave, &totalTime);
+   } else if (data) {
+      DccCachedWave *cached;
+      error = pidcc_wave_build (extended, data, length, 0, &cached);
+      if (!error) {
+         wave = cached->wave;
+         totalTime = cached->totalTime;
+      }
+   } else {
+      wave = DccSeparatorWave;
+      totalTime = DccSeparatorTime;
+   }
+   if (error) return error;
+
+   int i;
+   for (i = DccRingCount; i > index; --i) {
+      *pidcc_wave_segment (i) = *pidcc_wave_segment (i - 1);
+   }
+   DccSegment *segment = pidcc_wave_segment (index);
+   pidcc_wave_fill (segment, wave, totalTime,
+                    data ? PIDCC_LINE_PACKET : PIDCC_LINE_SEPARATOR,
+                    address, 0);
+   if (data) {
+      memcpy (segment->data, data, length);
+      segment->length = length;
+      segment->inserted = 1;
+   }
+   DccRingCount += 1;
+   return 0;
+}
+
+void pidcc_wave_abort (const unsigned char *stop, int length) {
+
+   if (!PigioInitialized) return;
+   if (DccRingCount <= 0) return; // Only the background is on the track.
+   if (DccPowerOffWave >= 0) return; // Let the power off run its course.
+   if (length > DCCMAXDATA) return;
+
+   int i;
+   DccSegment *first = pidcc_wave_segment (0);
+   if (DccChainMode || first->chained) {
+      // A chain cannot be changed: only stop it if it is obsolete.
+      if (!pidcc_wave_obsolete (first, stop, length)) return;
+      pidcc_wave_debug ("pidcc_wave_abort(): chain");
+      gpioWaveTxStop ();
+      DccChainRunning = 0;
+      while (DccRingCount > 0) pidcc_wave_pop ();
+      pidcc_wave_background ();
+      return;
+   }
+
+   // The segments already handed to pigpio cannot be changed: if one is
+   // obsolete, stop the transmission and take them all back.
+   int handed = 0;
+   int obsolete = 0;
+   while ((handed < DccRingCount) && pidcc_wave_segment(handed)->sent) {
+      if (pidcc_wave_obsolete (pidcc_wave_segment(handed), stop, length))
+         obsolete = 1;
+      handed += 1;
+   }
+   long long now = pidcc_wave_now ();
+   int cut = 0;
+   if (obsolete) {
+      pidcc_wave_debug ("pidcc_wave_abort(): cut short");
+      gpioWaveTxStop ();
+      cut = pidcc_wave_segment(0)->started;
+      for (i = 0; i < handed; ++i) {
+         DccSegment *segment = pidcc_wave_segment (i);
+         pidcc_wave_account (segment, (segment->end < now) ? segment->end : now);
+         segment->sent = segment->started = 0;
+      }
+      handed = 0;
+      DccSuccessorLinked = 0;
+      DccBackgroundLinked = 0;
+      pidcc_wave_background ();
+   }
+
+   // Neutralize the obsolete packets that pigpio does not have. The first
+   // segment has nothing before it to keep apart from. A slot that was cut
+   // short is sent again, with longer preambles: a decoder may take up to
+   // 9 "1" bits as the end of the packet that was cut.
+   for (i = handed; i < DccRingCount; ) {
+      DccSegment *segment = pidcc_wave_segment (i);
+      int extended = cut && (i == 0);
+      const char *error = 0;
+      if (pidcc_wave_obsolete (segment, stop, length)) {
+         int carried = 0;
+         int j;
+         for (j = 1; j < PIDCC_DISTRICTS; ++j) carried |= segment->carried[j];
+         if ((i == 0) && !carried) {
+            pidcc_wave_remove (i);
+            continue;
+         }
+         error = pidcc_wave_blank (segment, extended);
+      } else if (extended && (DccDistrictCount > 0)) {
+         error = pidcc_wave_reslot (segment, 1);
+      }
+      if (error) {
+         pidcc_wave_debug (error);
+         if (segment->wave < 0) {
+            pidcc_wave_remove (i);
+            continue;
+         }
+      }
+      i += 1;
+   }
+
+   // The emergency stop goes next, ahead of what was queued. The same
+   // packet, queued by the scheduler, comes later as usual. After a cut,
+   // the stop too needs a longer preamble.
+   if (handed < DccRingCount) {
+      int address = pidcc_packet_address (stop, length);
+      int before = pidcc_wave_apart (handed - 1, address);
+      int after = pidcc_wave_apart (handed, address);
+      if (DccRingCount + before + 1 + after <= DCCWAVESEGMENTS) {
+         const char *error = 0;
+         int index = handed;
+         if (before) error = pidcc_wave_insert (index++, address, 0, 0, 0);
+         if (!error)
+            error = pidcc_wave_insert (index++, address, obsolete,
+                                       stop, length);
+         if (after && !error)
+            error = pidcc_wave_insert (index, address, 0, 0, 0);
+         if (error) pidcc_wave_debug (error);
+      }
+   }
+   pidcc_wave_link ();
 }
 
 const char *pidcc_wave_off (int duration) {
 
     if (!PigioInitialized) return "Not initialized yet";;
     if (DccWaveGpioB <= 0) return "power off requires two GPIO pins";
-    if (DccPendingWave >= 0) return "busy";
+    if (DccRingCount > 0) return "busy";
 
     DccOff[0].gpioOn = 0;
     DccOff[0].gpioOff = (1 << DccWaveGpioA) + (1 << DccWaveGpioB);
+    int i;
+    for (i = 1; i < PIDCC_DISTRICTS; ++i) {
+       DccOff[0].gpioOff |= pidcc_wave_mask (DccDistrictGpioA[i]) |
+                            pidcc_wave_mask (DccDistrictGpioB[i]);
+    }
     DccOff[0].usDelay = 1000000 * duration;
     DccOff[1].usDelay = 0; // End of wave.
 
@@ -351,61 +1929,155 @@ const char *pidcc_wave_off (int duration) {
     int result = gpioWaveAddGeneric(1, DccOff);
     if (result < 0) return "gpioWaveAddGeneric(off) failed";
 
-    DccPendingWave = gpioWaveCreate();
-    if (DccPendingWave < 0) return "gpioWaveCreate(off) failed";
-
-    result = gpioWaveTxSend (DccPendingWave, PI_WAVE_MODE_ONE_SHOT_SYNC);
-    if (result < 0) return "gpioWaveTxSend(off) failed";
-
-    DccPendingPacket.retry = 0;
+    DccPowerOffWave = pidcc_wave_new ();
+    if (DccPowerOffWave < 0) return "gpioWaveCreate(off) failed";
+
+    const char *error = pidcc_wave_push (DccPowerOffWave, DccOff[0].usDelay,
+                                         PIDCC_LINE_POWEROFF,
+                                         PIDCC_NOADDRESS, 0);
+    if (error) {
+       pidcc_wave_delete (DccPowerOffWave);
+       DccPowerOffWave = -1;
+       return error;
+    }
     return 0;
 }
 
+void pidcc_wave_cache_statistics (long *hits, long *misses, long *evictions) {
+   *hits = DccWaveCacheHits;
+   *misses = DccWaveCacheMisses;
+   *evictions = DccWaveCacheEvictions;
+}
+
 int pidcc_wave_microseconds (void) {
-   if (DccPendingWave < 0) return 100000;
-   return DccPendingPacket.totalTime + 200; // One background cycle after.
+
+   if (DccRingCount <= 0) return 100000;
+
+   int i;
+   int total = pidcc_tuning_get (PIDCC_TUNING_SWITCH); // Background cycle.
+   for (i = 0; i < DccRingCount; ++i) {
+      total += pidcc_wave_segment(i)->totalTime;
+   }
+   return total;
+}
+
+int pidcc_wave_wakeup (void) {
+
+   if (DccRingCount <= 0) {
+      if (DccWaveGpioA > 0) pidcc_wave_watch (0);
+      return -1;
+   }
+   DccSegment *first = pidcc_wave_segment (0);
+   long long target = (first->started || first->chained) ? first->end
+                                                         : first->start;
+
+   // Arm the alert close to the transition only, not on every edge.
+   if ((DccNotifyFd >= 0) && (DccWaveGpioA > 0)) {
+      long long early = target - DCCNOTIFYWINDOW - pidcc_wave_now ();
+      if (early > 0) {
+         pidcc_wave_watch (0);
+         if (early > 60000000) return 60000000;
+         return (int)early;
+      }
+      pidcc_wave_watch (1);
+   }
+   // Wake up a little after the estimated transition, and check again
+   // soon if the estimate was too early (see pidcc_tuning.c).
+   long long delay =
+      target + pidcc_tuning_get (PIDCC_TUNING_MARGIN) - pidcc_wave_now ();
+   if (delay <= 0) return pidcc_tuning_get (PIDCC_TUNING_RETRY);
+   if (delay > 60000000) return 60000000;
+   return (int)delay;
+}
+
+void pidcc_wave_notify (int fd) {
+
+   if (DccWaveGpioA > 0) pidcc_wave_watch (0);
+   DccNotifyFd = fd;
 }
 
 int pidcc_wave_state (void) {
 
    if (!PigioInitialized) return PIDCC_IDLE;
 
-   if (DccPendingWave < 0) {
+   pidcc_wave_sweep ();
+   pidcc_wave_carry ();
+
+   if (DccRingCount <= 0) {
       pidcc_wave_debug ("pidcc_wave_state(): idle");
       return PIDCC_IDLE;
    }
 
-   if (DccTransmitStarting) {
-      if (gpioWaveTxAt () == DccBackgroundWave) {
-         pidcc_wave_debug ("pidcc_wave_state(): starting a transmit");
-         return PIDCC_STARTING;
+   int at = gpioWaveTxAt ();
+
+   while (DccRingCount > 0) {
+
+      DccSegment *first = pidcc_wave_segment (0);
+
+      if (first->chained) {
+         // The chain is complete once it has reached its background wave,
+         // which a pin change may have replaced since.
+         if (gpioWaveTxBusy () && (at != DccChainBackground)) {
+            pidcc_wave_debug ("pidcc_wave_state(): still transmitting chain");
+            return PIDCC_TRANSMITTING;
+         }
+         pidcc_wave_pop ();
+         continue;
       }
-      // The transmission has started: restart the background wave right
-      // after the transmission completed.
-      pidcc_wave_debug ("pidcc_wave_state(): transmission has started");
-      pidcc_wave_background ();
-      DccTransmitStarting = 0;
-   }
 
-   if (gpioWaveTxAt () == DccPendingWave) {
-      pidcc_wave_debug ("pidcc_wave_state(): still transmitting");
-      return PIDCC_TRANSMITTING; // Not complete yet.
-   }
+      if (!first->started) {
+         if (at == first->wave) {
+            // The transmission has started: schedule what comes next.
+            pidcc_wave_debug ("pidcc_wave_state(): transmission has started");
+            first->started = 1;
+            long long now = pidcc_wave_now ();
+            if (first->start > now) {
+               first->start = now;
+               first->end = now + first->totalTime;
+            }
+            pidcc_latency_started (first->trace, first->start);
+            DccSuccessorLinked = 0;
+            DccBackgroundLinked = 0;
+            pidcc_wave_carry ();
+            pidcc_wave_link ();
+            return PIDCC_TRANSMITTING;
+         }
+         if (gpioWaveTxBusy ()) {
+            pidcc_wave_debug ("pidcc_wave_state(): starting a transmit");
+            return PIDCC_STARTING;
+         }
+         // The whole segment went out, and then the signal stopped,
+         // before we had a chance to notice.
+         pidcc_wave_debug ("pidcc_wave_state(): missed a transmission");
+         first->started = 1;
+         pidcc_latency_started (first->trace, first->start);
+
+      } else if (at == first->wave) {
+         pidcc_wave_link (); // In case a new segment was queued since.
+         pidcc_wave_debug ("pidcc_wave_state(): still transmitting");
+         return PIDCC_TRANSMITTING; // Not complete yet.
+      }
 
-   // At this point, there is a pending wave but transmission is complete.
-   gpioWaveDelete (DccPendingWave);
-   DccPendingWave = -1;
+      // At this point, the first segment's transmission is complete.
+      pidcc_wave_pop ();
 
-   if (DccPendingPacket.retry > 0) {
-      pidcc_wave_debug ("pidcc_wave_state(): repeat transmission");
-      DccPendingPacket.retry -= 1;
-      pidcc_wave_transmit();
-      return PIDCC_STARTING;
+      // The next segment, if any, may already be on the track.
+      if (!gpioWaveTxBusy ()) pidcc_wave_background ();
+      pidcc_wave_carry ();
+      pidcc_wave_link ();
    }
 
    // At this point, there is really nothing more to transmit.
    pidcc_wave_debug ("pidcc_wave_state(): became idle");
-   if (!gpioWaveTxBusy ()) pidcc_wave_background (); // We missed something..
+   if (DccChainRunning && !DccChainMode) {
+      // Chain mode was disabled while a chain was running.
+      gpioWaveTxStop ();
+      DccChainRunning = 0;
+   }
+   if (!gpioWaveTxBusy ()) {
+      DccChainRunning = 0;
+      pidcc_wave_background (); // We missed something..
+   }
    return PIDCC_IDLE;
 }
 
@@ -21,14 +21,30 @@
  *
  * pidcc_wave.h - A module that generates the wave form for each DCC packet.
  */
-const char *pidcc_wave_initialize (int gpioa, int gpiob, int debug);
+const char *pidcc_wave_initialize (int gpioa, int gpiob,
+                                   void (*debug) (const char *text));
+const char *pidcc_wave_district (int district, int gpioa, int gpiob);
+int pidcc_wave_configured (int district);
 
 const char *pidcc_wave_send (int programming,
-                             const unsigned char *data, int length);
+                             const unsigned char *data, int length,
+                             int repeat, int gap, unsigned int trace);
+const char *pidcc_wave_stage (int programming,
+                              const unsigned char *data, int length,
+                              unsigned int trace);
 const char *pidcc_wave_off (int duration);
 
+int pidcc_wave_ready (void);
+int pidcc_wave_chaining (void);
+
+void pidcc_wave_cache_statistics (long *hits, long *misses, long *evictions);
+
 int pidcc_wave_microseconds (void);
+int pidcc_wave_wakeup (void);
+void pidcc_wave_notify (int fd);
 void pidcc_wave_idle (void);
+const char *pidcc_wave_chain (int enable);
+void pidcc_wave_abort (const unsigned char *stop, int length);
 void pidcc_wave_release (void);
 
 #define PIDCC_IDLE         0
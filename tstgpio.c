@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <pigpio.h> // Raspberry Pi OS only, not on regular Debian.
+#include <time.h>
+#include "pidcc_output.h"
+#include "pidcc_clock.h"
+#include "pidcc_tuning.h"
 #include <sys/select.h>
 
 static int gpioa;
@@ -81,6 +84,239 @@ static void startStopWave (int count, gpioPulse_t *pulses) {
   }
 }
 
+// Benchmark and calibration. ----------------------------------------
+//
+// Measure how long the pigpio wave functions take, depending on the number
+// of pulses, how long after gpioWaveTxSend() gpioWaveTxAt() reports the new
+// wave, and how long a SYNC transmit waits for the end of the background
+// wave, depending on its period. All times are in microseconds.
+
+#define SAMPLES 100
+
+typedef struct {
+  int count;
+  long long values[SAMPLES];
+} Series;
+
+static void record (Series *series, long long value) {
+  if (series->count < SAMPLES) series->values[series->count++] = value;
+}
+
+static int compare (const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static long long percentile (Series *series, int percent) {
+  if (series->count <= 0) return 0;
+  qsort (series->values, series->count, sizeof(long long), compare);
+  int index = ((series->count * percent) + 99) / 100 - 1;
+  if (index < 0) index = 0;
+  return series->values[index];
+}
+
+static long long average (const Series *series) {
+  if (series->count <= 0) return 0;
+  long long total = 0;
+  int i;
+  for (i = 0; i < series->count; ++i) total += series->values[i];
+  return total / series->count;
+}
+
+// Alternate the two GPIOs, as in a DCC signal.
+static void squareWave (gpioPulse_t *pulses, int count, int usec) {
+  int i;
+  for (i = 0; i < count; ++i) {
+     if (i & 1) {
+        pulses[i].gpioOn = gpiob ? (1 << gpiob) : 0;
+        pulses[i].gpioOff = (1 << gpioa);
+     } else {
+        pulses[i].gpioOn = (1 << gpioa);
+        pulses[i].gpioOff = gpiob ? (1 << gpiob) : 0;
+     }
+     pulses[i].usDelay = usec;
+  }
+}
+
+static int createWave (int count, gpioPulse_t *pulses) {
+  gpioWaveAddNew();
+  gpioWaveAddGeneric(count, pulses);
+  int wave = gpioWaveCreate();
+  if (wave < 0) {
+     printf ("gpioWaveCreate() failed\n");
+     gpioTerminate ();
+     exit (1);
+  }
+  return wave;
+}
+
+// Wait until pigpio reports that the wave is transmitted. Return how long
+// that took, or -1 if the wave was never seen.
+static long long waitForWave (int wave, long long start) {
+  for (;;) {
+     long long now = pidcc_clock_now ();
+     if (gpioWaveTxAt() == wave) return now - start;
+     if (now > start + 1000000) return -1;
+  }
+}
+
+static void waitForIdle (void) {
+  while (gpioWaveTxBusy()) {
+    struct timeval timer;
+    timer.tv_sec = 0;
+    timer.tv_usec = 200;
+    select (0, 0, 0, 0, &timer);
+  }
+}
+
+#define MAXPULSES 512
+
+static const int PulseCounts[] = {2, 16, 64, 256, MAXPULSES, 0};
+
+static Series TxAtLatency;
+
+static void benchmarkWaves (void) {
+
+  static gpioPulse_t pulses[MAXPULSES];
+  int i, s;
+
+  printf ("Wave functions, per pulse count (usec, average / p99):\n");
+  printf ("%8s %14s %14s %14s %14s %14s\n", "pulses",
+          "AddNew", "AddGeneric", "Create", "TxSend", "Delete");
+
+  for (i = 0; PulseCounts[i]; ++i) {
+     int count = PulseCounts[i];
+     Series addnew = {0}, addgeneric = {0}, create = {0};
+     Series txsend = {0}, delete = {0};
+
+     squareWave (pulses, count, 100);
+
+     for (s = 0; s < SAMPLES; ++s) {
+        long long t0 = pidcc_clock_now ();
+        gpioWaveAddNew();
+        long long t1 = pidcc_clock_now ();
+        gpioWaveAddGeneric(count, pulses);
+        long long t2 = pidcc_clock_now ();
+        int wave = gpioWaveCreate();
+        long long t3 = pidcc_clock_now ();
+        if (wave < 0) {
+           printf ("gpioWaveCreate() failed for %d pulses\n", count);
+           gpioTerminate ();
+           exit (1);
+        }
+        gpioWaveTxSend (wave, PI_WAVE_MODE_ONE_SHOT);
+        long long t4 = pidcc_clock_now ();
+        long long seen = waitForWave (wave, t3);
+        if (seen >= 0) record (&TxAtLatency, seen - (t4 - t3));
+        waitForIdle ();
+        long long t5 = pidcc_clock_now ();
+        gpioWaveDelete (wave);
+        long long t6 = pidcc_clock_now ();
+
+        record (&addnew, t1 - t0);
+        record (&addgeneric, t2 - t1);
+        record (&create, t3 - t2);
+        record (&txsend, t4 - t3);
+        record (&delete, t6 - t5);
+     }
+     printf ("%8d %6lld / %-5lld %6lld / %-5lld %6lld / %-5lld "
+             "%6lld / %-5lld %6lld / %-5lld\n", count,
+             average (&addnew), percentile (&addnew, 99),
+             average (&addgeneric), percentile (&addgeneric, 99),
+             average (&create), percentile (&create, 99),
+             average (&txsend), percentile (&txsend, 99),
+             average (&delete), percentile (&delete, 99));
+  }
+  printf ("\nFrom gpioWaveTxSend() to gpioWaveTxAt(): "
+          "p50 %lld, p99 %lld, max %lld usec\n",
+          percentile (&TxAtLatency, 50), percentile (&TxAtLatency, 99),
+          percentile (&TxAtLatency, 100));
+}
+
+static const int BackgroundPeriods[] = {116, 200, 400, 1000, 2000, 0};
+
+#define DCCBACKGROUNDPERIOD 200 // The background of pidcc: bit "0".
+
+static Series SwitchDelay;
+
+static void benchmarkSync (void) {
+
+  gpioPulse_t background[2];
+  gpioPulse_t test[2];
+  int i, s;
+
+  printf ("\nSYNC switch delay, per background period (usec):\n");
+  printf ("%8s %8s %8s %8s\n", "period", "p50", "p99", "max");
+
+  squareWave (test, 2, 100);
+  int testWave = createWave (2, test);
+
+  srandom (time (0));
+
+  for (i = 0; BackgroundPeriods[i]; ++i) {
+     int period = BackgroundPeriods[i];
+     Series delay = {0};
+
+     squareWave (background, 2, period / 2);
+     int backgroundWave = createWave (2, background);
+
+     for (s = 0; s < SAMPLES; ++s) {
+        gpioWaveTxSend (backgroundWave, PI_WAVE_MODE_REPEAT);
+        usleep (period + (random() % period)); // Anywhere in a cycle.
+        long long start = pidcc_clock_now ();
+        gpioWaveTxSend (testWave, PI_WAVE_MODE_ONE_SHOT_SYNC);
+        long long seen = waitForWave (testWave, start);
+        if (seen >= 0) record (&delay, seen);
+        waitForIdle ();
+     }
+     printf ("%8d %8lld %8lld %8lld\n", period, percentile (&delay, 50),
+             percentile (&delay, 99), percentile (&delay, 100));
+     if (period == DCCBACKGROUNDPERIOD) SwitchDelay = delay;
+
+     gpioWaveDelete (backgroundWave);
+  }
+  gpioWaveDelete (testWave);
+}
+
+static int roundUp (long long value, int minimum) {
+  int rounded = (int)(((value + 9) / 10) * 10);
+  return (rounded < minimum) ? minimum : rounded;
+}
+
+// Write the tuning profile that pidcc loads when it starts.
+static void calibrate (const char *path) {
+
+  int margin = roundUp (percentile (&TxAtLatency, 99), 10);
+  int retry = 2 * margin;
+  if (retry < 50) retry = 50;
+  if (retry > 1000) retry = 1000;
+
+  pidcc_tuning_set (PIDCC_TUNING_SWITCH,
+                    roundUp (percentile (&SwitchDelay, 99), 10));
+  pidcc_tuning_set (PIDCC_TUNING_MARGIN, margin);
+  pidcc_tuning_set (PIDCC_TUNING_RETRY, retry);
+
+  char comment[256];
+  time_t now = time (0);
+  strftime (comment, sizeof(comment),
+            "# Measured by tstgpio on %Y-%m-%d %H:%M:%S.\n"
+            "# The idle cadence is not measured: edit as needed.\n",
+            localtime (&now));
+
+  const char *error = pidcc_tuning_save (path, comment);
+  if (error) {
+     printf ("%s: %s\n", path, error);
+     gpioTerminate ();
+     exit (1);
+  }
+  printf ("\nTuning profile written to %s:\n", path);
+  int i;
+  for (i = 0; i < PIDCC_TUNING_COUNT; ++i) {
+     printf ("   %s %d\n", pidcc_tuning_name (i), pidcc_tuning_get (i));
+  }
+}
+
 int main (int argc, const char **argv) {
 
   if (argc <= 1) {
@@ -89,12 +325,37 @@ int main (int argc, const char **argv) {
   }
 
   if (!strcmp (argv[1], "-h")) {
-     printf ("%s [-h] gpioa[':' gpiob] pulse ..\n\n", argv[0]);
+     printf ("%s [-h] gpioa[':' gpiob] pulse ..\n", argv[0]);
+     printf ("%s -b gpioa[':' gpiob]\n", argv[0]);
+     printf ("%s -c[=PATH] gpioa[':' gpiob]\n\n", argv[0]);
      printf ("  Repeatedly generate the specified pulse sequence, between\n");
      printf ("  a 20 usec start pulse and a 60 usec stop pulse.\n");
+     printf ("  With -b, measure the cost and latency of the pigpio wave\n");
+     printf ("  functions. With -c, also write the tuning profile for\n");
+     printf ("  pidcc (default: %s).\n", PIDCC_TUNING_PATH);
      exit (0);
   }
 
+  int benchmark = 0;
+  const char *profile = 0;
+  if (!strcmp (argv[1], "-b")) {
+     benchmark = 1;
+  } else if (!strcmp (argv[1], "-c")) {
+     benchmark = 1;
+     profile = PIDCC_TUNING_PATH;
+  } else if (!strncmp (argv[1], "-c=", 3)) {
+     benchmark = 1;
+     profile = argv[1] + 3;
+  }
+  if (benchmark) {
+     argv += 1;
+     argc -= 1;
+     if (argc <= 1) {
+        printf ("GPIO number is missing\n");
+        exit(1);
+     }
+  }
+
   gpioa = atoi(argv[1]);
   const char *sep = strchr (argv[1], ':');
   gpiob = sep ? atoi(sep+1) : 0;
@@ -133,7 +394,13 @@ int main (int argc, const char **argv) {
      }
   }
 
-  startStopWave (count, pulses);
+  if (benchmark) {
+     benchmarkWaves ();
+     benchmarkSync ();
+     if (profile) calibrate (profile);
+  } else {
+     startStopWave (count, pulses);
+  }
 
   gpioTerminate ();
 }